@@ -0,0 +1,8 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "kiss_fft_fixed.h"
+
+#include <kiss_fft.c>
@@ -0,0 +1,36 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+//
+// kissfft built with FIXED_POINT=32: Q31 scalars, every stage is scaled down by its radix, so a
+// transform of size nfft is scaled by 1/nfft in both directions and can not overflow. Public names
+// get the 'fixed' suffix to link along with the float build. The header may follow
+// kiss_fft.h/kiss_fftr.h, but from this point on the kissfft names in the translation unit refer
+// to the fixed-point build.
+//
+#pragma once
+
+#undef KISS_FFT_H
+#undef KISS_FTR_H
+#undef kiss_fft_scalar
+#undef FIXED_POINT
+#define FIXED_POINT 32
+
+#define kiss_fft_cpx kiss_fft_fixed_cpx
+#define kiss_fft_state kiss_fft_fixed_state
+#define kiss_fft_cfg kiss_fft_fixed_cfg
+#define kiss_fft_alloc kiss_fft_fixed_alloc
+#define kiss_fft kiss_fft_fixed
+#define kiss_fft_stride kiss_fft_fixed_stride
+#define kiss_fft_cleanup kiss_fft_fixed_cleanup
+#define kiss_fft_next_fast_size kiss_fft_fixed_next_fast_size
+
+#define kiss_fftr_state kiss_fftr_fixed_state
+#define kiss_fftr_cfg kiss_fftr_fixed_cfg
+#define kiss_fftr_alloc kiss_fftr_fixed_alloc
+#define kiss_fftr kiss_fftr_fixed
+#define kiss_fftri kiss_fftri_fixed
+
+#include <kiss_fftr.h>
@@ -0,0 +1,36 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+//
+// kissfft built with USE_SIMD: every scalar is an __m128, i.e. four independent transforms
+// run at once in SSE lanes. Public names get the 'simd' suffix to link along with the scalar
+// build. The header may follow kiss_fft.h/kiss_fftr.h, but from this point on the kissfft
+// names in the translation unit refer to the SIMD build.
+//
+#pragma once
+
+#undef KISS_FFT_H
+#undef KISS_FTR_H
+#undef KISS_FFT_MALLOC
+#undef KISS_FFT_FREE
+#undef kiss_fft_scalar
+#define USE_SIMD
+
+#define kiss_fft_cpx kiss_fft_simd_cpx
+#define kiss_fft_state kiss_fft_simd_state
+#define kiss_fft_cfg kiss_fft_simd_cfg
+#define kiss_fft_alloc kiss_fft_simd_alloc
+#define kiss_fft kiss_fft_simd
+#define kiss_fft_stride kiss_fft_simd_stride
+#define kiss_fft_cleanup kiss_fft_simd_cleanup
+#define kiss_fft_next_fast_size kiss_fft_simd_next_fast_size
+
+#define kiss_fftr_state kiss_fftr_simd_state
+#define kiss_fftr_cfg kiss_fftr_simd_cfg
+#define kiss_fftr_alloc kiss_fftr_simd_alloc
+#define kiss_fftr kiss_fftr_simd
+#define kiss_fftri kiss_fftri_simd
+
+#include <kiss_fftr.h>
@@ -0,0 +1,81 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "aligned.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace {
+size_t g_huge_threshold = 2 * ALIGNED_HUGE_PAGE;
+}
+
+void aligned_huge_threshold(size_t bytes)
+{
+    g_huge_threshold = bytes;
+}
+
+size_t aligned_huge_threshold()
+{
+    return g_huge_threshold;
+}
+
+void *aligned_malloc(size_t bytes)
+{
+    const bool huge = g_huge_threshold && bytes >= g_huge_threshold;
+    const size_t align = huge ? ALIGNED_HUGE_PAGE : ALIGNED_BYTES;
+    bytes = (bytes + align - 1) & ~(align - 1);
+    void *p = NULL;
+#ifdef _WIN32
+    p = _aligned_malloc(bytes ? bytes : align, align);
+#else
+    if (posix_memalign(&p, align, bytes ? bytes : align)) {
+        p = NULL;
+    }
+#endif
+    if (!p) {
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge) {
+        madvise(p, bytes, MADV_HUGEPAGE); // a hint, THP may be disabled
+    }
+#endif
+    return p;
+}
+
+void aligned_free(void *p)
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+bool test_aligned()
+{
+    const size_t threshold = aligned_huge_threshold();
+    aligned_huge_threshold(1 << 20);
+    bool success = true;
+    {
+        AlignedArray<double> small = aligned_array<double>(3);
+        AlignedArray<char> big = aligned_array<char>((1 << 20) + 1);
+        success &= (uintptr_t)small.get() % ALIGNED_BYTES == 0 && (uintptr_t)big.get() % ALIGNED_HUGE_PAGE == 0;
+        small[2] = 1;
+        big[1 << 20] = 1;
+        assert(success);
+    }
+    aligned_huge_threshold(threshold);
+    return success;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+//
+// Cache-line aligned buffers for the analysis path.
+//
+// Allocations of at least the huge page threshold are aligned and rounded up to 2 MiB and
+// marked for transparent huge pages (madvise, Linux), so multi-megabyte FFT and PCM working
+// sets need far fewer TLB entries. Throws std::bad_alloc like new[].
+//
+#define ALIGNED_BYTES 64
+#define ALIGNED_HUGE_PAGE (2u << 20)
+
+void *aligned_malloc(size_t bytes);
+void aligned_free(void *p);
+
+void aligned_huge_threshold(size_t bytes); // [default: 4 MiB], 0 disables huge pages
+size_t aligned_huge_threshold();
+
+struct AlignedDelete {
+    void operator()(void *p) const { aligned_free(p); }
+};
+template <class T> using AlignedArray = std::unique_ptr<T[], AlignedDelete>;
+
+template <class T> AlignedArray<T> aligned_array(size_t n) // uninitialized
+{
+    return AlignedArray<T>(static_cast<T *>(aligned_malloc(n * sizeof(T))));
+}
+
+bool test_aligned();
@@ -4,53 +4,446 @@
  */
 
 #include "bestoffset.h"
+#include "decimate.h"
+#include "kernels.h"
 #include "ssd.h"
+#include "testsignal.h"
+#include "threads.h"
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
-#include <queue>
+#include <new>
+#include <vector>
 
 #define SCOPE_ARRAY(type, name, len) \
     std::unique_ptr<type[]> name##_buf(new type[len]); \
     auto name = name##_buf.get();
 
-void bestOffset(float ssd[NUM_BEST], int offsets[NUM_BEST], const double *left, const double *right, unsigned channels,
-                unsigned ncorr, unsigned corr_len, const int initialOffset)
-{
-#if 0 // direct
-	SCOPE_ARRAY(double, ssd2, ncorr)
-	SCOPE_ARRAY(double, ssd3, ncorr)
-#define POW2(x) ((x) * (x))
-	for(unsigned i = 0; i < ncorr; i++) {
-		ssd2[i] = ssd3[i] = 0;
-		for(unsigned j = 0; j < corr_len*channels; j++) {
-			ssd2[i] += POW2(left[i*channels+j] - right[j]);
-			ssd3[i] += POW2(left[j] - right[i*channels+j]);
-		}
-	}
-#endif
+namespace {
+// num_best smallest SSD values seen so far, best first. Ties go to the larger (unsigned) index,
+// i.e. to negative offsets. Blocks are scanned for values not above the current worst one, so
+// the cost is a vectorized compare per lag plus a few insertions.
+class BestList
+{
+    const unsigned num_;
+    unsigned size_ = 0;
+    double ssd_[MAX_BEST];
+    unsigned index_[MAX_BEST];
+    double limit_ = INFINITY; // worst kept SSD once the list is full
+
+    static bool better(double ssd, unsigned index, double ssd2, unsigned index2)
+    {
+        return ssd < ssd2 || (ssd == ssd2 && index > index2);
+    }
+    void insert(double ssd, unsigned index)
+    {
+        if (size_ == num_) {
+            if (!better(ssd, index, ssd_[num_ - 1], index_[num_ - 1])) {
+                return;
+            }
+            size_--;
+        }
+        unsigned k = size_++;
+        for (; k > 0 && better(ssd, index, ssd_[k - 1], index_[k - 1]); k--) {
+            ssd_[k] = ssd_[k - 1];
+            index_[k] = index_[k - 1];
+        }
+        ssd_[k] = ssd;
+        index_[k] = index;
+        if (size_ == num_) {
+            limit_ = ssd_[num_ - 1];
+        }
+    }
+    // ssd[j] is for lag 'first + j' (negative: lag -(first + j))
+    void scan(const double *ssd, unsigned n, unsigned first, bool negative)
+    {
+        const Kernels *k = kernels();
+        for (unsigned j = 0; (j += k->find_le(ssd + j, n - j, limit_)) < n; j++) {
+            insert(ssd[j], negative ? 0u - (first + j) : first + j);
+        }
+    }
+
+public:
+    explicit BestList(unsigned num_best) : num_(num_best) { assert(num_best >= 1 && num_best <= MAX_BEST); }
+
+    void merge(const BestList &list) // the same as pushing everything 'list' has seen
+    {
+        for (unsigned i = 0; i < list.size_; i++) {
+            insert(list.ssd_[i], list.index_[i]);
+        }
+    }
+
+    void push(const double *ssd0, const double *ssd1, unsigned pos, const unsigned nlags[2], int initialOffset)
+    {
+        scan(ssd1, nlags[1], pos, false); // min -> max
+
+        // ignore negative offsets from reference
+        const unsigned begin = std::max(pos, 1u);
+        const unsigned end = initialOffset < 0 ? 0 : std::min(pos + nlags[0], (unsigned)initialOffset + 1);
+        if (begin < end) {
+            scan(ssd0 + begin - pos, end - begin, begin, true);
+        }
+    }
+    void get(float ssd[], int offsets[], int initialOffset)
+    {
+        for (unsigned i = 0; i < num_; i++) {
+            ssd[i] = i < size_ ? (float)ssd_[i] : INFINITY;
+            offsets[i] = (i < size_ ? (int)index_[i] : 0) + initialOffset;
+        }
+    }
+};
+
+// Lags [0, n) of the left signal that may give an offset, the rest are ignored by BestList
+unsigned negativeLags(unsigned ncorr, int initialOffset)
+{
+    return initialOffset > 0 ? std::min(ncorr, (unsigned)initialOffset + 1) : 0;
+}
+// Lags of a block at 'pos' that are computed in each direction
+void blockLags(unsigned nlags[2], unsigned pos, unsigned n, unsigned n0)
+{
+    nlags[0] = pos < n0 ? std::min(n, n0 - pos) : 0;
+    nlags[1] = n;
+}
+} // namespace
+
+template <class T>
+void bestOffset(float ssd[], int offsets[], unsigned num_best, const T *left, const T *right, unsigned channels,
+                unsigned ncorr, unsigned corr_len, const int initialOffset, AlignWorkspace *ws)
+{
+    // directions are searched separately, each with transforms sized for its own lag range, in runs
+    // of blocks for the worker threads; every run keeps its own list
+    const T *in[2] = {left, right};
+    const unsigned n0 = negativeLags(ncorr, initialOffset);
+    const unsigned ndir[2] = {n0 > 1 ? n0 : 0, ncorr}; // lag 0 is searched in the positive direction only
+    unsigned runs[2];
+    xcorr_runs(runs, ndir, corr_len);
+    AlignScope scope(ws);
+    struct Context {
+        BestList *lists;
+        int initialOffset;
+    } ctx = {scope.alloc<BestList>(runs[0] + runs[1]), initialOffset};
+    for (unsigned r = 0; r < runs[0] + runs[1]; r++) {
+        new (&ctx.lists[r]) BestList(num_best); // trivially destructible
+    }
+    auto push = [](void *ctx, unsigned run, unsigned dir, unsigned pos, const double *out, unsigned n) {
+        Context *c = static_cast<Context *>(ctx);
+        unsigned nlags[2] = {0, 0};
+        nlags[dir] = n;
+        c->lists[run].push(out, out, pos, nlags, c->initialOffset);
+    };
+    ssd_blocks(runs, push, &ctx, in, channels, ndir, corr_len, scope.workspace());
+    BestList q(num_best);
+    for (unsigned r = 0; r < runs[0] + runs[1]; r++) {
+        q.merge(ctx.lists[r]);
+    }
+    q.get(ssd, offsets, initialOffset);
+}
+
+#define COARSE_CANDIDATES 8 // at least, num_best if more
+#define COARSE_MARGIN 2 // coarse lags around a candidate to refine
+
+template <class T>
+void bestOffsetCoarse(float ssd[], int offsets[], unsigned num_best, const T *left, const T *right,
+                      unsigned channels, unsigned ncorr, unsigned corr_len, const int initialOffset, unsigned factor,
+                      AlignWorkspace *ws)
+{
+    unsigned stages = 0;
+    while ((2u << stages) <= factor) {
+        stages++;
+    }
+    const unsigned cn = ncorr >> stages, cl = corr_len >> stages, len = (ncorr + corr_len) >> stages;
+    if (cn < 2 * COARSE_CANDIDATES || cl < 2) {
+        return bestOffset(ssd, offsets, num_best, left, right, channels, ncorr, corr_len, initialOffset, ws);
+    }
+    factor = 1 << stages;
+    AlignScope scope(ws);
+
+    // coarse SSD curve, candidates are its deepest local minima in both directions
+    struct Candidate {
+        double ssd;
+        int lag; // signed coarse lag
+        bool operator<(const Candidate &c) const { return ssd < c.ssd || (ssd == c.ssd && lag < c.lag); }
+    };
+    Candidate *cand = scope.alloc<Candidate>(2 * cn);
+    unsigned ncand = 0;
+    {
+        AlignScope coarse(scope.workspace());
+        T *x0 = coarse.alloc<T>(len * channels);
+        T *x1 = coarse.alloc<T>(len * channels);
+        double *c0 = coarse.alloc<double>(cn);
+        double *c1 = coarse.alloc<double>(cn);
+        decimate(x0, left, channels, ncorr + corr_len, stages, coarse.workspace());
+        decimate(x1, right, channels, ncorr + corr_len, stages, coarse.workspace());
+        // ignore negative offsets from reference, with a margin for the coarse lag step
+        const int back = initialOffset + (int)(COARSE_MARGIN * factor);
+        const unsigned cmax = back >= (int)factor ? back / factor : 0; // valleys need one lag past it
+        const unsigned cn0 = cmax ? std::min(cn, cmax + 2) : 0;
+        double *out[2] = {c0, c1};
+        const T *in[2] = {x0, x1};
+        const unsigned nlags[2] = {cn0, cn};
+        ssd_x2(out, in, channels, nlags, cl, coarse.workspace());
+        auto valley = [cn](const double *c, unsigned i) {
+            return (i == 0 || c[i] <= c[i - 1]) && (i + 1 == cn || c[i] <= c[i + 1]);
+        };
+        for (unsigned i = 0; i < cn; i++) {
+            if (valley(c1, i)) {
+                cand[ncand++] = Candidate{c1[i], (int)i};
+            }
+            if (i > 0 && i <= cmax && valley(c0, i)) {
+                cand[ncand++] = Candidate{c0[i], -(int)i};
+            }
+        }
+        const unsigned num = std::min(ncand, std::max(num_best, (unsigned)COARSE_CANDIDATES));
+        std::partial_sort(cand, cand + num, cand + ncand);
+        ncand = num;
+    }
+
+    // full-rate lag windows around the candidates, merged, both directions share one window
+    std::pair<unsigned, unsigned> win[MAX_BEST]; // [begin, end), COARSE_CANDIDATES <= MAX_BEST
+    for (unsigned i = 0; i < ncand; i++) {
+        const unsigned lag = std::abs(cand[i].lag) * factor, margin = COARSE_MARGIN * factor;
+        win[i] = std::make_pair(lag > margin ? lag - margin : 0, std::min(ncorr, lag + margin + 1));
+    }
+    std::sort(win, win + ncand);
+    unsigned block = 0, n = 0;
+    for (unsigned i = 0; i < ncand; i++) {
+        if (n > 0 && win[i].first <= win[n - 1].second) {
+            win[n - 1].second = std::max(win[n - 1].second, win[i].second);
+        } else {
+            win[n++] = win[i];
+        }
+    }
+    for (unsigned i = 0; i < n; i++) {
+        block = std::max(block, win[i].second - win[i].first);
+    }
+
+    const T *in[2] = {left, right};
+    const unsigned n0 = negativeLags(ncorr, initialOffset);
+    SsdSegments<T> seg(in, channels, corr_len, block, n0 > 1 ? 3 : 2, SSD_AUTO, scope.workspace());
+    double *ssd0 = scope.alloc<double>(seg.block());
+    double *ssd1 = scope.alloc<double>(seg.block());
+    double *ssd_[2] = {ssd0, ssd1};
+    BestList q(num_best);
+    for (unsigned i = 0; i < n; i++) {
+        unsigned nlags[2];
+        blockLags(nlags, win[i].first, win[i].second - win[i].first, n0 > 1 ? n0 : 0);
+        const T *src[2] = {left + win[i].first * channels, right + win[i].first * channels};
+        seg.run(ssd_, src, nlags);
+        q.push(ssd0, ssd1, win[i].first, nlags, initialOffset);
+    }
+    q.get(ssd, offsets, initialOffset);
+}
+
+template <class T>
+void bestOffsetSegmented(float ssd[], int offsets[], unsigned num_best, BestOffsetRead<T> read, void *ctx,
+                         unsigned channels, unsigned ncorr, unsigned corr_len, const int initialOffset,
+                         AlignWorkspace *ws)
+{
+    const unsigned block = xcorr_block(ncorr, corr_len), len = block + corr_len;
+    AlignScope scope(ws);
+    T *left = scope.alloc<T>(len * channels);
+    T *right = scope.alloc<T>(len * channels);
+    T *prefix0 = scope.alloc<T>(corr_len * channels);
+    T *prefix1 = scope.alloc<T>(corr_len * channels);
+    T *buf[2] = {left, right};
+    unsigned avail = read(ctx, buf, len);
+
+    BestList q(num_best);
+    if (avail > corr_len) {
+        memcpy(prefix0, left, sizeof(T) * corr_len * channels);
+        memcpy(prefix1, right, sizeof(T) * corr_len * channels);
+        const T *prefix[2] = {prefix0, prefix1};
+        const unsigned n0 = negativeLags(ncorr, initialOffset);
+        SsdSegments<T> seg(prefix, channels, corr_len, block, n0 > 1 ? 3 : 2, SSD_AUTO, scope.workspace());
+        double *ssd0 = scope.alloc<double>(block);
+        double *ssd1 = scope.alloc<double>(block);
+        double *ssd_[2] = {ssd0, ssd1};
+        const T *src[2] = {left, right};
+        for (unsigned pos = 0; pos < ncorr && avail > corr_len;) {
+            const unsigned n = std::min(std::min(block, avail - corr_len), ncorr - pos);
+            unsigned nlags[2];
+            blockLags(nlags, pos, n, n0 > 1 ? n0 : 0);
+            seg.run(ssd_, src, nlags);
+            q.push(ssd0, ssd1, pos, nlags, initialOffset);
+            pos += n;
+            // overlap-save: keep the last corr_len frames, read the next block after them
+            avail -= n;
+            memmove(left, left + n * channels, sizeof(T) * avail * channels);
+            memmove(right, right + n * channels, sizeof(T) * avail * channels);
+            T *tail[2] = {left + avail * channels, right + avail * channels};
+            avail += read(ctx, tail, len - avail);
+        }
+    }
+    q.get(ssd, offsets, initialOffset);
+}
+
+template void bestOffset(float[], int[], unsigned, const double *, const double *, unsigned, unsigned, unsigned,
+                          const int, AlignWorkspace *);
+template void bestOffset(float[], int[], unsigned, const float *, const float *, unsigned, unsigned, unsigned,
+                          const int, AlignWorkspace *);
+template void bestOffset(float[], int[], unsigned, const int16_t *, const int16_t *, unsigned, unsigned, unsigned,
+                          const int, AlignWorkspace *);
+template void bestOffsetCoarse(float[], int[], unsigned, const double *, const double *, unsigned, unsigned, unsigned,
+                                const int, unsigned, AlignWorkspace *);
+template void bestOffsetCoarse(float[], int[], unsigned, const float *, const float *, unsigned, unsigned, unsigned,
+                                const int, unsigned, AlignWorkspace *);
+template void bestOffsetCoarse(float[], int[], unsigned, const int16_t *, const int16_t *, unsigned, unsigned,
+                                unsigned, const int, unsigned, AlignWorkspace *);
+template void bestOffsetSegmented(float[], int[], unsigned, BestOffsetRead<double>, void *, unsigned, unsigned,
+                                   unsigned, const int, AlignWorkspace *);
+template void bestOffsetSegmented(float[], int[], unsigned, BestOffsetRead<float>, void *, unsigned, unsigned,
+                                   unsigned, const int, AlignWorkspace *);
+template void bestOffsetSegmented(float[], int[], unsigned, BestOffsetRead<int16_t>, void *, unsigned, unsigned,
+                                   unsigned, const int, AlignWorkspace *);
+
+// 16-bit PCM searched in fixed point against the same samples as float: a delayed, attenuated
+// and noisy copy of low-passed noise, the candidates must come in the same order
+static bool test_bestoffset_fixed()
+{
+    const unsigned channels = 2, n = 4000, corr_len = 8000, shift = 1234, len = (n + corr_len + shift) * channels;
+    const int initialOffset = 100;
+    SCOPE_ARRAY(int16_t, ref, len)
+    SCOPE_ARRAY(int16_t, tst, len)
+    SCOPE_ARRAY(float, ref_f, len)
+    SCOPE_ARRAY(float, tst_f, len)
+    SCOPE_ARRAY(double, x, len)
+    SCOPE_ARRAY(double, y, len)
+    test_noise(x, len / channels, channels);
+    test_delayed(y, x, len / channels, channels, shift, 0.8, 1 / 30.);
+    for (unsigned i = 0; i < len; i++) {
+        ref[i] = (int16_t)floor(x[i] * 30000);
+        tst[i] = (int16_t)floor(y[i] * 30000);
+        ref_f[i] = ref[i] / 32768.f;
+        tst_f[i] = tst[i] / 32768.f;
+    }
+    bool success = true;
+    for (unsigned coarse = 0; coarse < 2; coarse++) {
+        float s0[3], s1[3];
+        int o0[3], o1[3];
+        if (coarse) {
+            bestOffsetCoarse(s0, o0, 3, ref, tst, channels, n, corr_len, initialOffset, 8);
+            bestOffsetCoarse(s1, o1, 3, ref_f, tst_f, channels, n, corr_len, initialOffset, 8);
+        } else {
+            bestOffset(s0, o0, 3, ref, tst, channels, n, corr_len, initialOffset);
+            bestOffset(s1, o1, 3, ref_f, tst_f, channels, n, corr_len, initialOffset);
+        }
+        success &= o0[0] == (int)shift + initialOffset;
+        for (unsigned i = 0; i < 3; i++) {
+            success &= o0[i] == o1[i] && fabs(s0[i] - s1[i]) < 1e-4 * s1[i];
+            assert(success);
+        }
+    }
+    return success;
+}
+
+// a search of several blocks per direction gives the same candidates on any number of threads
+static bool test_bestoffset_threads()
+{
+    const unsigned channels = 2, n = 200000, corr_len = 2000, shift = 70000, len = (n + corr_len + shift) * channels;
+    const int initialOffset = 100000;
+    const unsigned saved = thread_count();
+    SCOPE_ARRAY(double, noise, len)
+    SCOPE_ARRAY(float, x, len)
+    test_noise(noise, len / channels, channels);
+    std::copy(noise, noise + len, x);
+    bool success = true;
+    float s0[3], s1[3];
+    int o0[3], o1[3];
+    thread_count(1);
+    bestOffset(s0, o0, 3, x + shift * channels, x, channels, n, corr_len, initialOffset);
+    success &= o0[0] == (int)shift + initialOffset;
+    for (unsigned threads = 2; threads <= 5; threads += 3) {
+        thread_count(threads);
+        bestOffset(s1, o1, 3, x + shift * channels, x, channels, n, corr_len, initialOffset);
+        for (unsigned i = 0; i < 3; i++) {
+            success &= o0[i] == o1[i] && s0[i] == s1[i];
+            assert(success);
+        }
+    }
+    thread_count(saved);
+    return success;
+}
+
+bool test_bestoffset()
+{
+    const unsigned ncorr = 300, block = 64;
+    const int initialOffset = 100;
     SCOPE_ARRAY(double, ssd0, ncorr)
     SCOPE_ARRAY(double, ssd1, ncorr)
-    const double *in[2] = {left, right};
-    double *ssd_[2] = {ssd0, ssd1};
-    ssd_x2(ssd_, in, channels, ncorr, corr_len);
+    std::vector<std::pair<double, unsigned>> all; // ssd, index
+    for (unsigned i = 0; i < ncorr; i++) { // lots of ties
+        ssd0[i] = i * 7 % 31;
+        ssd1[i] = i * 11 % 37;
+        all.push_back(std::make_pair(ssd1[i], i));
+        if (i > 0 && (int)i <= initialOffset) {
+            all.push_back(std::make_pair(ssd0[i], 0u - i));
+        }
+    }
+    std::sort(all.begin(), all.end(), [](const std::pair<double, unsigned> &a, const std::pair<double, unsigned> &b) {
+        return a.first < b.first || (a.first == b.first && a.second > b.second);
+    });
 
-    std::priority_queue<std::pair<double, unsigned>> q;
-    q.push(std::pair<double, unsigned>(-ssd1[0], 0));
-    for (signed i = 1; i < (signed)ncorr; i++) {
-        q.push(std::pair<double, unsigned>(-ssd1[i], i)); // min -> max
+    static const unsigned nums[] = {1, 3, 50};
+    bool success = true;
+    for (unsigned num : nums) {
+        BestList q(num), odd(num); // odd blocks merged later, as the runs of worker threads are
+        for (unsigned pos = 0; pos < ncorr; pos += block) {
+            const unsigned n = std::min(block, ncorr - pos), nlags[2] = {n, n};
+            (pos / block % 2 ? odd : q).push(ssd0 + pos, ssd1 + pos, pos, nlags, initialOffset);
+        }
+        q.merge(odd);
+        float ssd[MAX_BEST];
+        int offsets[MAX_BEST];
+        q.get(ssd, offsets, initialOffset);
+        for (unsigned i = 0; i < num; i++) {
+            success &= ssd[i] == (float)all[i].first && offsets[i] == (int)all[i].second + initialOffset;
+            assert(success);
+        }
+    }
 
-        // ignore negative offsets from reference
-        if (i > initialOffset) {
-            continue;
+    // repeated searches of the same geometry take all temporaries from the workspace and all
+    // transforms from the plan cache, threaded runs too
+    const unsigned channels = 2, n = 2000, corr_len = 1000, shift = 300, len = (n + corr_len + shift) * channels;
+    SCOPE_ARRAY(double, x, len)
+    test_noise(x, len / channels, channels);
+    AlignWorkspace ws;
+    float s[3];
+    int o[3];
+    const unsigned saved = thread_count();
+    for (unsigned threads : {1u, 3u}) {
+        thread_count(threads);
+        unsigned allocs = 0, plans = 0;
+        for (unsigned run = 0; run < 3; run++) {
+            bestOffsetCoarse(s, o, 3, x + shift * channels, x, channels, n, corr_len, 0, 8, &ws);
+            success &= o[0] == (int)shift;
+            bestOffset(s, o, 3, x + shift * channels, x, channels, n, corr_len, 0, &ws);
+            success &= o[0] == (int)shift;
+            success &= run == 0 || (ws.heap_allocs() == allocs && fft_plan_allocs() == plans);
+            allocs = ws.heap_allocs();
+            plans = fft_plan_allocs();
+            assert(success);
         }
-        q.push(std::pair<double, unsigned>(-ssd0[i], -i)); // negative index
+        success &= threads == 1 || ws.worker(1)->capacity() > 0; // the threaded runs kept their buffers
+        assert(success);
     }
-    for (unsigned i = 0; i < NUM_BEST; i++) {
-        ssd[i] = (float)-q.top().first;
-        offsets[i] = q.top().second;
-        q.pop();
+    thread_count(saved);
+
+    // more best offsets than the default number of coarse candidates, one per period of the signal
+    const unsigned period = 160, num_periodic = 12;
+    for (unsigned i = 0; i < len; i++) {
+        x[i] = x[i % (period * channels)];
     }
-    for (auto i = 0; i < NUM_BEST; i++) {
-        offsets[i] += initialOffset;
+    float sp[num_periodic];
+    int op[num_periodic];
+    bestOffsetCoarse(sp, op, num_periodic, x, x, channels, n, corr_len, 0, 8, &ws);
+    for (unsigned i = 0; i < num_periodic; i++) {
+        success &= op[i] % period == 0;
+        assert(success);
     }
+    success &= test_bestoffset_fixed() && test_bestoffset_threads();
+    return success;
 }
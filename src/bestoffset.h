@@ -5,9 +5,36 @@
 
 #pragma once
 
-#define NUM_BEST 3
+#include "workspace.h"
 
-void bestOffset(float ssd[NUM_BEST],   // ... left  | ... right
-                int offsets[NUM_BEST], //  negative | positive
-                const double *left, const double *right, unsigned channels, unsigned ncorr, unsigned corr_len,
-                const int initialOffset);
+#define MAX_BEST 64 // num_best limit, candidates are kept on the stack
+
+// Temporaries come from 'ws' if given, so repeated searches of the same geometry do not allocate.
+// Samples are double, float or int16_t (T), the SSD curves are evaluated in double either way,
+// 16-bit PCM is correlated in fixed point (see SsdTraits).
+
+template <class T>
+void bestOffset(float ssd[],   // num_best, best first: ... left  | ... right
+                int offsets[], //                        negative | positive
+                unsigned num_best, const T *left, const T *right, unsigned channels, unsigned ncorr,
+                unsigned corr_len, const int initialOffset, AlignWorkspace *ws = NULL);
+
+// Coarse-to-fine search: the SSD curve is computed at 1/factor rate (factor is a power of 2) to pick
+// candidate valleys, then each candidate is refined at full rate within a few coarse lags around it
+template <class T>
+void bestOffsetCoarse(float ssd[], int offsets[], unsigned num_best, const T *left, const T *right,
+                      unsigned channels, unsigned ncorr, unsigned corr_len, const int initialOffset, unsigned factor,
+                      AlignWorkspace *ws = NULL);
+
+// Reads up to 'frames' frames of both signals, continuing where the previous call stopped.
+// Returns the number of frames read into both buffers, 0 at the end of either signal.
+template <class T> using BestOffsetRead = unsigned (*)(void *ctx, T *buf[2], unsigned frames);
+
+// Same search with the input consumed block by block (overlap-save), so memory depends on
+// corr_len only. Fewer than ncorr lags are searched if the input ends early.
+template <class T>
+void bestOffsetSegmented(float ssd[], int offsets[], unsigned num_best, BestOffsetRead<T> read, void *ctx,
+                         unsigned channels, unsigned ncorr, unsigned corr_len, const int initialOffset,
+                         AlignWorkspace *ws = NULL);
+
+bool test_bestoffset();
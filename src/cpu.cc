@@ -0,0 +1,50 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "cpu.h"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+const char *const g_names[] = {"generic", "sse2", "avx2", "avx512"};
+
+CpuLevel detect()
+{
+    CpuLevel level = CPU_GENERIC;
+#ifdef WAVALIGN_SSE2
+    __builtin_cpu_init();
+    level = CPU_SSE2;
+#ifdef WAVALIGN_AVX2
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        level = CPU_AVX2;
+    }
+#endif
+#ifdef WAVALIGN_AVX512
+    if (level == CPU_AVX2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+        level = CPU_AVX512;
+    }
+#endif
+#endif
+    const char *env = getenv("WAVALIGN_CPU");
+    for (unsigned i = 0; env && i < level; i++) {
+        if (!strcmp(env, g_names[i])) {
+            return (CpuLevel)i;
+        }
+    }
+    return level;
+}
+} // namespace
+
+CpuLevel cpu_level()
+{
+    static const CpuLevel level = detect();
+    return level;
+}
+
+const char *cpu_level_name(CpuLevel level)
+{
+    return g_names[level];
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+//
+// SIMD level for runtime dispatch, ordered.
+//
+// cpu_level() is the highest level supported by both the build and the CPU. The WAVALIGN_CPU
+// environment variable (generic, sse2, avx2, avx512) lowers it, e.g. to test the fallback paths.
+//
+enum CpuLevel {
+    CPU_GENERIC,
+    CPU_SSE2,
+    CPU_AVX2, // AVX2 + FMA
+    CPU_AVX512, // AVX-512F/DQ
+};
+
+CpuLevel cpu_level();
+const char *cpu_level_name(CpuLevel level);
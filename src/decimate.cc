@@ -0,0 +1,110 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "decimate.h"
+#include "kernels.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <memory>
+
+#define SCOPE_ARRAY(type, name, len) \
+    std::unique_ptr<type[]> name##_buf(new type[len]); \
+    auto name = name##_buf.get();
+
+// 31-tap Blackman-windowed half-band filter, odd taps h[1], h[3], ... only
+#define HB_TAPS 8
+
+namespace {
+struct HalfBand {
+    double taps[HB_TAPS];
+    HalfBand()
+    {
+        const unsigned M = 2 * HB_TAPS - 1; // half length
+        double sum = 0;
+        for (unsigned i = 0; i < HB_TAPS; i++) {
+            const double j = 2 * i + 1, x = M_PI * j / (M + 1);
+            const double w = 0.42 + 0.5 * cos(x) + 0.08 * cos(2 * x);
+            taps[i] = sin(M_PI * j / 2) / (M_PI * j) * w;
+            sum += 2 * taps[i];
+        }
+        for (auto &t : taps) { // unity gain at DC
+            t *= 0.5 / sum;
+        }
+    }
+};
+const HalfBand g_halfband;
+
+// polyphase split of n frames
+template <class T> void split(double *even, double *odd, const T *src, unsigned stride, unsigned n)
+{
+    for (unsigned k = 0; k < n / 2; k++) {
+        even[k] = src[2 * k * stride];
+        odd[k] = src[(2 * k + 1) * stride];
+    }
+}
+
+template <class T> T sample(double x)
+{
+    return (T)x;
+}
+template <> int16_t sample(double x) // rounded and clipped
+{
+    return (int16_t)std::min(std::max(floor(x + 0.5), (double)INT16_MIN), (double)INT16_MAX);
+}
+} // namespace
+
+template <class T>
+unsigned decimate(T *out, const T *in, unsigned channels, unsigned frames, unsigned stages, AlignWorkspace *ws)
+{
+    const unsigned nout = frames >> stages;
+    AlignScope scope(ws);
+    double *x = scope.alloc<double>(frames / 2);
+    double *even = scope.alloc<double>(frames / 2);
+    double *odd = scope.alloc<double>(frames / 2 + 2 * HB_TAPS);
+    memset(odd, 0, sizeof(double) * HB_TAPS);
+    for (unsigned ch = 0; ch < channels; ch++) {
+        unsigned n = frames;
+        for (unsigned s = 0; s < stages; s++) {
+            // interleaved input for the first stage, x[] then; zeros around the odd phase for the filter tails
+            if (s == 0) {
+                split(even, odd + HB_TAPS, in + ch, channels, n);
+            } else {
+                split(even, odd + HB_TAPS, x, 1, n);
+            }
+            n /= 2;
+            memset(odd + HB_TAPS + n, 0, sizeof(double) * HB_TAPS);
+            kernels()->halfband(x, even, odd + HB_TAPS, g_halfband.taps, HB_TAPS, n);
+        }
+        for (unsigned j = 0; j < nout; j++) {
+            out[j * channels + ch] = stages ? sample<T>(x[j]) : in[j * channels + ch];
+        }
+    }
+    return nout;
+}
+
+template unsigned decimate(double *, const double *, unsigned, unsigned, unsigned, AlignWorkspace *);
+template unsigned decimate(float *, const float *, unsigned, unsigned, unsigned, AlignWorkspace *);
+template unsigned decimate(int16_t *, const int16_t *, unsigned, unsigned, unsigned, AlignWorkspace *);
+
+bool test_decimate()
+{
+    const unsigned channels = 2, frames = 4096, stages = 3, nout = frames >> stages;
+    SCOPE_ARRAY(double, in, frames * channels)
+    SCOPE_ARRAY(double, out, nout * channels)
+    for (unsigned j = 0; j < frames; j++) {
+        in[j * channels] = 1;                           // DC passes
+        in[j * channels + 1] = cos(M_PI * 0.75 * j / 4); // above the final Nyquist, rejected
+    }
+    bool success = decimate(out, in, channels, frames, stages) == nout;
+    for (unsigned j = 8; j < nout - 8; j++) { // away from edges
+        success &= fabs(out[j * channels] - 1) < 1e-3 && fabs(out[j * channels + 1]) < 1e-2;
+        assert(success);
+    }
+    return success;
+}
@@ -0,0 +1,17 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include "workspace.h"
+
+// Low-pass and decimate interleaved frames by 2^stages with a chain of half-band filters,
+// the signal is zero outside of [0, frames). Returns the number of output frames, frames >> stages.
+template <class T> // double, float or int16_t
+unsigned decimate(T *out,      // (frames >> stages) * channels
+                  const T *in, // frames * channels
+                  unsigned channels, unsigned frames, unsigned stages, AlignWorkspace *ws = NULL);
+
+bool test_decimate();
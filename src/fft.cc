@@ -0,0 +1,157 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "fft.h"
+#include "cpu.h"
+
+#include <kiss_fftr.h>
+
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <memory>
+
+#define SCOPE_ARRAY(type, name, len) \
+    std::unique_ptr<type[]> name##_buf(new type[len]); \
+    auto name = name##_buf.get();
+
+namespace {
+const struct {
+    const FftBackend *backend;
+    CpuLevel level;
+} g_backends[] = {
+#ifdef WAVALIGN_AVX2
+    {&fft_backend_avx2, CPU_AVX2},
+#endif
+    {&fft_backend_kiss, CPU_GENERIC},
+};
+std::atomic<const FftBackend *> g_backend(nullptr);
+std::atomic<unsigned> g_four_step_min(FFT_FOUR_STEP_MIN);
+} // namespace
+
+void fft_four_step_min(unsigned nfft)
+{
+    g_four_step_min.store(nfft);
+}
+
+unsigned fft_four_step_min()
+{
+    return g_four_step_min.load();
+}
+
+const FftBackend *fft_backend_list(unsigned idx)
+{
+    for (auto &b : g_backends) {
+        if (b.level <= cpu_level() && idx-- == 0) {
+            return b.backend;
+        }
+    }
+    return NULL;
+}
+
+const FftBackend *fft_backend()
+{
+    const FftBackend *backend = g_backend.load();
+    if (!backend) {
+        backend = fft_backend_list(0);
+        g_backend.store(backend);
+    }
+    return backend;
+}
+
+bool fft_backend_select(const char *name)
+{
+    for (unsigned i = 0; fft_backend_list(i); i++) {
+        if (!strcmp(fft_backend_list(i)->name, name)) {
+            g_backend.store(fft_backend_list(i));
+            return true;
+        }
+    }
+    return false;
+}
+
+// Plain DFT for small sizes, a separate kiss_fftr plan above, the DFT would dominate the self-test time
+static void reference_rfft(const kiss_fft_scalar *x, unsigned nfft, kiss_fft_cpx *X)
+{
+    if (nfft > 256) {
+        kiss_fftr_cfg cfg = kiss_fftr_alloc(nfft, 0, NULL, NULL);
+        kiss_fftr(cfg, x, X);
+        kiss_fftr_free(cfg);
+        return;
+    }
+    for (unsigned k = 0; k <= nfft / 2; k++) {
+        double re = 0, im = 0;
+        for (unsigned j = 0; j < nfft; j++) {
+            double phase = -2 * M_PI * (double)((unsigned long long)j * k % nfft) / nfft;
+            re += x[j] * cos(phase);
+            im += x[j] * sin(phase);
+        }
+        X[k].r = (kiss_fft_scalar)re;
+        X[k].i = (kiss_fft_scalar)im;
+    }
+}
+
+static bool test_fft(const FftBackend *backend, unsigned n)
+{
+    const unsigned nfft = backend->fast_size(n), freq_len = nfft / 2 + 1, count = 3;
+    SCOPE_ARRAY(kiss_fft_scalar, x, nfft * count)
+    SCOPE_ARRAY(kiss_fft_scalar, y, nfft * count)
+    SCOPE_ARRAY(kiss_fft_cpx, X, freq_len * count)
+    SCOPE_ARRAY(kiss_fft_cpx, Y, freq_len * count)
+    for (unsigned i = 0; i < nfft * count; i++) {
+        x[i] = (kiss_fft_scalar)((int)(i * i % 23) - 11) / 11;
+    }
+    RfftPlan fwd(nfft, false, backend);
+    RfftPlan inv(nfft, true, backend);
+    fwd.forward(x, X);
+    inv.inverse(X, y);
+
+    bool success = nfft >= n && nfft % 2 == 0;
+    const double eps = 1e-4 * nfft;
+    reference_rfft(x, nfft, Y);
+    for (unsigned k = 0; k < freq_len; k++) {
+        success &= fabs(X[k].r - Y[k].r) < eps && fabs(X[k].i - Y[k].i) < eps;
+        assert(success);
+    }
+    for (unsigned j = 0; j < nfft; j++) {
+        success &= fabs(y[j] - nfft * x[j]) < eps;
+        assert(success);
+    }
+
+    const kiss_fft_scalar *in[count] = {x, x + nfft, x + 2 * nfft};
+    kiss_fft_cpx *spec[count] = {Y, Y + freq_len, Y + 2 * freq_len};
+    kiss_fft_scalar *out[count] = {y, y + nfft, y + 2 * nfft};
+    fwd.forward(in, spec, count);
+    success &= fabs(Y[0].r - X[0].r) < eps && fabs(Y[freq_len - 1].i - X[freq_len - 1].i) < eps;
+    assert(success);
+    inv.inverse(spec, out, count);
+    for (unsigned j = 0; j < nfft * count; j++) {
+        success &= fabs(y[j] - nfft * x[j]) < eps;
+        assert(success);
+    }
+    return success;
+}
+
+bool test_fft()
+{
+    static const unsigned sizes[] = {2, 30, 64, 250, 1000, 4100};
+    bool success = true;
+    for (unsigned i = 0; fft_backend_list(i); i++) {
+        for (unsigned n : sizes) {
+            success &= test_fft(fft_backend_list(i), n);
+        }
+    }
+    // one small four-step plan, 32x64 complex points; wavalign_bench four_step_check runs large sizes and threads
+    const unsigned four_step_min = fft_four_step_min();
+    fft_four_step_min(4096);
+    fft_plan_cache_flush();
+    for (unsigned i = 0; fft_backend_list(i); i++) {
+        success &= test_fft(fft_backend_list(i), 4096);
+    }
+    fft_four_step_min(four_step_min);
+    fft_plan_cache_flush();
+    return success;
+}
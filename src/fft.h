@@ -0,0 +1,69 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include "fftplan.h"
+
+#include <kiss_fft.h>
+
+//
+// Real FFT backend.
+//
+// forward: nfft real samples -> nfft/2+1 complex bins
+// inverse: nfft/2+1 complex bins -> nfft real samples, unnormalized, i.e. inverse(forward(x)) = nfft * x
+// The batched variants run 'count' transforms of the same plan, backends may share work between
+// them (kissfft packs two real signals into one complex transform).
+//
+struct FftBackend {
+    FftPlanType plan;
+    const char *name;
+    unsigned (*fast_size)(unsigned n); // smallest supported even nfft >= n
+    void (*forward)(void *cfg, const kiss_fft_scalar *in, kiss_fft_cpx *out);
+    void (*inverse)(void *cfg, const kiss_fft_cpx *in, kiss_fft_scalar *out);
+    void (*forward_batch)(void *cfg, const kiss_fft_scalar *const in[], kiss_fft_cpx *const out[], unsigned count);
+    void (*inverse_batch)(void *cfg, const kiss_fft_cpx *const in[], kiss_fft_scalar *const out[], unsigned count);
+};
+
+extern const FftBackend fft_backend_kiss; // portable default
+#ifdef WAVALIGN_AVX2
+extern const FftBackend fft_backend_avx2; // radix-4/8 Stockham, x86-64 AVX2+FMA
+#endif
+
+const FftBackend *fft_backend(); // the fastest one the CPU supports
+
+bool fft_backend_select(const char *name);
+const FftBackend *fft_backend_list(unsigned idx); // supported ones, NULL-terminated
+
+// Plans of at least 'nfft' points use a four-step FFT (avx2 backend), 0 disables it. These run on up to
+// thread_count() threads. Plans keep the mode and the thread count they were created with: flush the
+// plan cache after a change.
+#define FFT_FOUR_STEP_MIN (1 << 23)
+void fft_four_step_min(unsigned nfft);
+unsigned fft_four_step_min();
+
+class RfftPlan : FftPlanBase
+{
+public:
+    RfftPlan(unsigned nfft, bool inverse, const FftBackend *backend = fft_backend())
+        : FftPlanBase(&backend->plan, nfft, inverse), backend_(backend)
+    {
+    }
+    void forward(const kiss_fft_scalar *in, kiss_fft_cpx *out) const { backend_->forward(cfg_, in, out); }
+    void inverse(const kiss_fft_cpx *in, kiss_fft_scalar *out) const { backend_->inverse(cfg_, in, out); }
+    void forward(const kiss_fft_scalar *const in[], kiss_fft_cpx *const out[], unsigned count) const
+    {
+        backend_->forward_batch(cfg_, in, out, count);
+    }
+    void inverse(const kiss_fft_cpx *const in[], kiss_fft_scalar *const out[], unsigned count) const
+    {
+        backend_->inverse_batch(cfg_, in, out, count);
+    }
+
+private:
+    const FftBackend *backend_;
+};
+
+bool test_fft();
@@ -0,0 +1,638 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+//
+// Mixed-radix (8, 4, 2, 3, 5) Stockham FFT with AVX2/FMA kernels.
+//
+// The complex transform of length M = nfft/2 runs over x[n] = in[2n] + i*in[2n+1] and the real
+// spectrum is separated afterwards, the same way kiss_fftr does it. Each Stockham stage reads
+//   x[q + s*(p + k*m)], k < R
+// and writes the twiddled radix-R butterfly to
+//   y[q + s*(R*p + j)], j < R
+// so the output is in natural order without bit reversal. Four complex values fill a register:
+// stages with the stride s multiple of 4 vectorize along q, the first stage (s = 1) vectorizes
+// along p and transposes 4 x R blocks on store.
+//
+// Transforms of at least fft_four_step_min() points run as four-step FFTs: ncfft = n1 * n2 is seen as
+// an n2 x n1 matrix, the columns are transformed (length n2), twiddled, transposed, and then the
+// columns of the result (length n1). TILE columns are copied out at a time and transformed together,
+// interleaved: that is the Stockham plan with every stride multiplied by TILE, vectorized along q.
+// The short transforms run in L2 instead of streaming the whole array once per stage, so the array
+// is read and written twice in total. Both passes are split over the worker threads by column
+// groups (threads.h), as many as thread_count() was when the plan was created.
+//
+// This file is built with -mavx2 -mfma, so it must not emit code shared with other translation
+// units (inline functions, templates from headers): the backend is selected at runtime only.
+//
+#ifdef WAVALIGN_AVX2
+
+#include "fft.h"
+#include "threads.h"
+
+#include <immintrin.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+typedef kiss_fft_cpx cpx;
+
+#define MAX_STAGES 32
+struct Stage {
+    unsigned radix, s, m;
+    bool pvec; // first stage vectorized along p, twiddles are stored as [j - 1][p] instead of [p][j - 1]
+    cpx *tw;   // (radix - 1) * m
+    cpx *root; // radix, generic radix only
+};
+struct Plan {
+    unsigned nfft, ncfft;
+    bool inverse;
+    unsigned nstages;
+    Stage stage[MAX_STAGES];
+    cpx *super_tw; // real spectrum separation, ncfft/2 + 1
+    cpx *work[2];  // ncfft each
+
+    // four-step mode, sub[0] is NULL otherwise
+    Plan *sub[2];      // TILE interleaved complex transforms of length n1 and n2
+    unsigned n1, n2;   // ncfft = n1 * n2, both multiples of 16
+    cpx *tw, *tw_tile; // w^((TILE * g + b) * k2) = tw[g][k2] * tw_tile[k2][b], w = exp(-+2pi*i/ncfft)
+    unsigned nslots;   // column groups processed at once, at most thread_count() at plan creation
+    unsigned tile_len; // TILE * max(n1, n2)
+    cpx *tile;         // nslots * 3 * tile_len: in, out and work of every slot
+};
+#define TILE 16 // columns per pass of the four-step mode: two cache lines
+
+//
+// complex arithmetic on one value (scalar) and on four values (AVX)
+//
+struct Scalar {
+    typedef cpx T;
+    static T load(const cpx *p) { return *p; }
+    static void store(cpx *p, T a) { *p = a; }
+    static T set(const cpx &c) { return c; }
+    static T add(T a, T b) { return T{a.r + b.r, a.i + b.i}; }
+    static T sub(T a, T b) { return T{a.r - b.r, a.i - b.i}; }
+    static T mul(T a, T b) { return T{a.r * b.r - a.i * b.i, a.r * b.i + a.i * b.r}; }
+    static T scale(T a, float s) { return T{a.r * s, a.i * s}; }
+    static T mul_i(T a) { return T{-a.i, a.r}; }     // *i
+    static T mul_neg_i(T a) { return T{a.i, -a.r}; } // *(-i)
+};
+struct Avx {
+    typedef __m256 T;
+    static T load(const cpx *p) { return _mm256_loadu_ps((const float *)p); }
+    static void store(cpx *p, T a) { _mm256_storeu_ps((float *)p, a); }
+    static T set(const cpx &c) { return _mm256_castpd_ps(_mm256_broadcast_sd((const double *)&c)); }
+    static T add(T a, T b) { return _mm256_add_ps(a, b); }
+    static T sub(T a, T b) { return _mm256_sub_ps(a, b); }
+    static T mul(T a, T b)
+    {
+        T br = _mm256_moveldup_ps(b), bi = _mm256_movehdup_ps(b);
+        return _mm256_fmaddsub_ps(a, br, _mm256_mul_ps(_mm256_permute_ps(a, 0xB1), bi));
+    }
+    static T scale(T a, float s) { return _mm256_mul_ps(a, _mm256_set1_ps(s)); }
+    static T mul_i(T a) { return _mm256_xor_ps(_mm256_permute_ps(a, 0xB1), _mm256_setr_ps(-0.f, 0, -0.f, 0, -0.f, 0, -0.f, 0)); }
+    static T mul_neg_i(T a) { return _mm256_xor_ps(_mm256_permute_ps(a, 0xB1), _mm256_setr_ps(0, -0.f, 0, -0.f, 0, -0.f, 0, -0.f)); }
+    static T conj(T a) { return _mm256_xor_ps(a, _mm256_setr_ps(0, -0.f, 0, -0.f, 0, -0.f, 0, -0.f)); }
+    static T reverse(T a) { return _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(a), 0x1B)); }
+};
+
+// multiplication by the quarter-turn root of unity: -i for the forward transform, i for the inverse one
+template <class O, bool INV>
+inline typename O::T rot(typename O::T a)
+{
+    return INV ? O::mul_i(a) : O::mul_neg_i(a);
+}
+
+//
+// in-place DFT of R values
+//
+template <class O, bool INV>
+inline void bfly2(typename O::T *a)
+{
+    typename O::T t = a[1];
+    a[1] = O::sub(a[0], t);
+    a[0] = O::add(a[0], t);
+}
+
+template <class O, bool INV>
+inline void bfly3(typename O::T *a)
+{
+    typedef typename O::T T;
+    T t1 = O::add(a[1], a[2]), t2 = O::sub(a[1], a[2]);
+    T m = O::sub(a[0], O::scale(t1, 0.5f)), n = O::scale(rot<O, INV>(t2), 0.866025403784438647f);
+    a[0] = O::add(a[0], t1);
+    a[1] = O::add(m, n);
+    a[2] = O::sub(m, n);
+}
+
+template <class O, bool INV>
+inline void bfly4(typename O::T *a)
+{
+    typedef typename O::T T;
+    T t0 = O::add(a[0], a[2]), t1 = O::sub(a[0], a[2]);
+    T t2 = O::add(a[1], a[3]), t3 = rot<O, INV>(O::sub(a[1], a[3]));
+    a[0] = O::add(t0, t2);
+    a[2] = O::sub(t0, t2);
+    a[1] = O::add(t1, t3);
+    a[3] = O::sub(t1, t3);
+}
+
+template <class O, bool INV>
+inline void bfly5(typename O::T *a)
+{
+    typedef typename O::T T;
+    const float c1 = 0.309016994374947424f, c2 = -0.809016994374947424f; // cos(2pi/5), cos(4pi/5)
+    const float s1 = 0.951056516295153572f, s2 = 0.587785252292473129f;  // sin(2pi/5), sin(4pi/5)
+    T t1 = O::add(a[1], a[4]), t2 = O::add(a[2], a[3]);
+    T t3 = O::sub(a[1], a[4]), t4 = O::sub(a[2], a[3]);
+    T m1 = O::add(a[0], O::add(O::scale(t1, c1), O::scale(t2, c2)));
+    T m2 = O::add(a[0], O::add(O::scale(t1, c2), O::scale(t2, c1)));
+    T n1 = rot<O, INV>(O::add(O::scale(t3, s1), O::scale(t4, s2)));
+    T n2 = rot<O, INV>(O::sub(O::scale(t3, s2), O::scale(t4, s1)));
+    a[0] = O::add(a[0], O::add(t1, t2));
+    a[1] = O::add(m1, n1);
+    a[4] = O::sub(m1, n1);
+    a[2] = O::add(m2, n2);
+    a[3] = O::sub(m2, n2);
+}
+
+template <class O, bool INV>
+inline void bfly8(typename O::T *a)
+{
+    typedef typename O::T T;
+    const float c = 0.707106781186547524f;
+    const cpx w1 = {c, INV ? c : -c}, w3 = {-c, INV ? c : -c};
+    T e[4] = {a[0], a[2], a[4], a[6]}, o[4] = {a[1], a[3], a[5], a[7]};
+    bfly4<O, INV>(e);
+    bfly4<O, INV>(o);
+    o[1] = O::mul(o[1], O::set(w1));
+    o[2] = rot<O, INV>(o[2]);
+    o[3] = O::mul(o[3], O::set(w3));
+    for (unsigned k = 0; k < 4; k++) {
+        a[k] = O::add(e[k], o[k]);
+        a[k + 4] = O::sub(e[k], o[k]);
+    }
+}
+
+template <class O, bool INV, unsigned R>
+inline void bfly(typename O::T *a)
+{
+    switch (R) {
+        case 2:
+            return bfly2<O, INV>(a);
+        case 3:
+            return bfly3<O, INV>(a);
+        case 4:
+            return bfly4<O, INV>(a);
+        case 5:
+            return bfly5<O, INV>(a);
+        case 8:
+            return bfly8<O, INV>(a);
+    }
+}
+
+//
+// Stockham stages
+//
+template <class O, bool INV, unsigned R>
+void stage_q(const Stage &st, const cpx *x, cpx *y, unsigned qstep)
+{
+    typedef typename O::T T;
+    const unsigned s = st.s, m = st.m;
+    for (unsigned p = 0; p < m; p++) {
+        T w[R];
+        for (unsigned j = 1; j < R; j++) {
+            w[j] = O::set(st.tw[p * (R - 1) + j - 1]);
+        }
+        for (unsigned q = 0; q < s; q += qstep) {
+            T a[R];
+            for (unsigned k = 0; k < R; k++) {
+                a[k] = O::load(x + q + s * (p + k * m));
+            }
+            bfly<O, INV, R>(a);
+            O::store(y + q + s * R * p, a[0]);
+            for (unsigned j = 1; j < R; j++) {
+                O::store(y + q + s * (R * p + j), O::mul(a[j], w[j]));
+            }
+        }
+    }
+}
+
+inline void transpose4(__m256 *a, __m256 *r)
+{
+    __m256d t0 = _mm256_unpacklo_pd(_mm256_castps_pd(a[0]), _mm256_castps_pd(a[1]));
+    __m256d t1 = _mm256_unpackhi_pd(_mm256_castps_pd(a[0]), _mm256_castps_pd(a[1]));
+    __m256d t2 = _mm256_unpacklo_pd(_mm256_castps_pd(a[2]), _mm256_castps_pd(a[3]));
+    __m256d t3 = _mm256_unpackhi_pd(_mm256_castps_pd(a[2]), _mm256_castps_pd(a[3]));
+    r[0] = _mm256_castpd_ps(_mm256_permute2f128_pd(t0, t2, 0x20));
+    r[1] = _mm256_castpd_ps(_mm256_permute2f128_pd(t1, t3, 0x20));
+    r[2] = _mm256_castpd_ps(_mm256_permute2f128_pd(t0, t2, 0x31));
+    r[3] = _mm256_castpd_ps(_mm256_permute2f128_pd(t1, t3, 0x31));
+}
+
+template <bool INV, unsigned R> // R = 4 or 8, s = 1
+void stage_p(const Stage &st, const cpx *x, cpx *y)
+{
+    const unsigned m = st.m;
+    for (unsigned p = 0; p < m; p += 4) {
+        __m256 a[R], r[R];
+        for (unsigned k = 0; k < R; k++) {
+            a[k] = Avx::load(x + p + k * m);
+        }
+        bfly<Avx, INV, R>(a);
+        for (unsigned j = 1; j < R; j++) {
+            a[j] = Avx::mul(a[j], Avx::load(st.tw + (j - 1) * m + p));
+        }
+        for (unsigned j = 0; j < R; j += 4) {
+            transpose4(a + j, r + j);
+        }
+        for (unsigned i = 0; i < 4; i++) {
+            for (unsigned j = 0; j < R; j += 4) {
+                Avx::store(y + R * (p + i) + j, r[j + i]);
+            }
+        }
+    }
+}
+
+template <bool INV>
+void stage_generic(const Stage &st, const cpx *x, cpx *y)
+{
+    const unsigned R = st.radix, s = st.s, m = st.m;
+    for (unsigned p = 0; p < m; p++) {
+        for (unsigned q = 0; q < s; q++) {
+            for (unsigned j = 0; j < R; j++) {
+                cpx b = {0, 0};
+                for (unsigned k = 0; k < R; k++) {
+                    b = Scalar::add(b, Scalar::mul(x[q + s * (p + k * m)], st.root[j * k % R]));
+                }
+                y[q + s * (R * p + j)] = j ? Scalar::mul(b, st.tw[p * (R - 1) + j - 1]) : b;
+            }
+        }
+    }
+}
+
+template <bool INV, unsigned R>
+void stage(const Stage &st, const cpx *x, cpx *y)
+{
+    if (st.pvec) {
+        stage_p<INV, (R == 8 ? 8 : 4)>(st, x, y);
+    } else if (st.s % 4 == 0) {
+        stage_q<Avx, INV, R>(st, x, y, 4);
+    } else {
+        stage_q<Scalar, INV, R>(st, x, y, 1);
+    }
+}
+
+template <bool INV>
+void transform_four_step(const Plan *plan, const cpx *src, cpx *dst, cpx *tmp);
+
+// complex transform of length ncfft, the last stage writes to dst
+template <bool INV>
+void transform(const Plan *plan, const cpx *src, cpx *dst, cpx *tmp)
+{
+    if (plan->sub[0]) {
+        return transform_four_step<INV>(plan, src, dst, tmp);
+    }
+    const cpx *x = src;
+    if (plan->nstages == 0) {
+        dst[0] = src[0];
+    }
+    for (unsigned i = 0; i < plan->nstages; i++) {
+        const Stage &st = plan->stage[i];
+        cpx *y = (plan->nstages - 1 - i) % 2 ? tmp : dst;
+        switch (st.radix) {
+            case 2:
+                stage<INV, 2>(st, x, y);
+                break;
+            case 3:
+                stage<INV, 3>(st, x, y);
+                break;
+            case 4:
+                stage<INV, 4>(st, x, y);
+                break;
+            case 5:
+                stage<INV, 5>(st, x, y);
+                break;
+            case 8:
+                stage<INV, 8>(st, x, y);
+                break;
+            default:
+                stage_generic<INV>(st, x, y);
+                break;
+        }
+        x = y;
+    }
+}
+
+// dst[c * dst_stride + r] = src[r * src_stride + c], r < rows, c < cols, both multiples of 4
+void transpose(cpx *dst, unsigned dst_stride, const cpx *src, unsigned src_stride, unsigned rows, unsigned cols)
+{
+    for (unsigned r = 0; r < rows; r += 4) {
+        for (unsigned c = 0; c < cols; c += 4) {
+            __m256 a[4], t[4];
+            for (unsigned i = 0; i < 4; i++) {
+                a[i] = Avx::load(src + (r + i) * src_stride + c);
+            }
+            transpose4(a, t);
+            for (unsigned i = 0; i < 4; i++) {
+                Avx::store(dst + (c + i) * dst_stride + r, t[i]);
+            }
+        }
+    }
+}
+
+// dst[r * dst_stride + c] = src[r * src_stride + c], r < rows, c < TILE
+void copy_tile(cpx *dst, unsigned dst_stride, const cpx *src, unsigned src_stride, unsigned rows)
+{
+    for (unsigned r = 0; r < rows; r++) {
+        for (unsigned c = 0; c < TILE; c += 4) {
+            Avx::store(dst + r * dst_stride + c, Avx::load(src + r * src_stride + c));
+        }
+    }
+}
+
+struct FourStep {
+    const Plan *plan;
+    const cpx *src;
+    cpx *dst, *tmp;
+};
+
+// x[n1 * j2 + j1]: transforms of length n2 along j2 for TILE columns j1 at a time, twiddled, to
+// tmp[n2 * j1 + k2]. Slot s of the plan takes its share of the columns.
+template <bool INV>
+void four_step_columns(void *ctx, unsigned slot)
+{
+    const FourStep &fs = *(const FourStep *)ctx;
+    const Plan *plan = fs.plan, *p2 = plan->sub[1];
+    const unsigned n1 = plan->n1, n2 = plan->n2, groups = n1 / TILE;
+    cpx *in = plan->tile + 3 * slot * plan->tile_len, *out = in + plan->tile_len, *work = out + plan->tile_len;
+    for (unsigned g = groups * slot / plan->nslots; g < groups * (slot + 1) / plan->nslots; g++) {
+        const unsigned c = g * TILE;
+        copy_tile(in, TILE, fs.src + c, n1, n2);
+        transform<INV>(p2, in, out, work);
+        const cpx *tw = plan->tw + g * n2;
+        for (unsigned k = 0; k < n2; k++) { // w^((c + b) * k) = w^(c * k) * w^(b * k)
+            __m256 w = Avx::set(tw[k]);
+            for (unsigned b = 0; b < TILE; b += 4) {
+                cpx *x = out + k * TILE + b;
+                Avx::store(x, Avx::mul(Avx::load(x), Avx::mul(w, Avx::load(plan->tw_tile + k * TILE + b))));
+            }
+        }
+        transpose(fs.tmp + c * n2, n2, out, TILE, n2, TILE);
+    }
+}
+
+// transforms of length n1 along j1 of tmp[n2 * j1 + k2] for TILE columns k2 at a time to X[n2 * k1 + k2]
+template <bool INV>
+void four_step_rows(void *ctx, unsigned slot)
+{
+    const FourStep &fs = *(const FourStep *)ctx;
+    const Plan *plan = fs.plan, *p1 = plan->sub[0];
+    const unsigned n1 = plan->n1, n2 = plan->n2, groups = n2 / TILE;
+    cpx *in = plan->tile + 3 * slot * plan->tile_len, *out = in + plan->tile_len, *work = out + plan->tile_len;
+    for (unsigned g = groups * slot / plan->nslots; g < groups * (slot + 1) / plan->nslots; g++) {
+        copy_tile(in, TILE, fs.tmp + g * TILE, n2, n1);
+        transform<INV>(p1, in, out, work);
+        copy_tile(fs.dst + g * TILE, n2, out, TILE, n1);
+    }
+}
+
+// the slots run on the worker threads, both passes split the array into column groups
+template <bool INV>
+void transform_four_step(const Plan *plan, const cpx *src, cpx *dst, cpx *tmp)
+{
+    FourStep fs = {plan, src, dst, tmp};
+    parallel_for(plan->nslots, four_step_columns<INV>, &fs);
+    parallel_for(plan->nslots, four_step_rows<INV>, &fs);
+}
+
+//
+// real <-> half-complex, the same algebra as in kiss_fftr:
+//   X[k]   = (F1 + T) / 2, X[N-k] = conj(F1 - T) / 2, F1 = Z[k] + conj(Z[N-k]), T = (Z[k] - conj(Z[N-k])) * tw[k]
+//   Z[k]   = F1 + T,       Z[N-k] = conj(F1 - T),     F1 = X[k] + conj(X[N-k]), T = (X[k] - conj(X[N-k])) * tw[k]
+//
+template <bool INV>
+void separate(const cpx *tw, const cpx *in, cpx *out, unsigned ncfft)
+{
+    const float half = INV ? 1.f : .5f;
+    unsigned k = 1;
+    for (; k + 3 <= ncfft / 2; k += 4) {
+        __m256 a = Avx::load(in + k), b = Avx::conj(Avx::reverse(Avx::load(in + ncfft - k - 3)));
+        __m256 f1 = Avx::add(a, b), t = Avx::mul(Avx::sub(a, b), Avx::load(tw + k));
+        Avx::store(out + k, Avx::scale(Avx::add(f1, t), half));
+        Avx::store(out + ncfft - k - 3, Avx::reverse(Avx::conj(Avx::scale(Avx::sub(f1, t), half))));
+    }
+    for (; k <= ncfft / 2; k++) {
+        cpx a = in[k], b = {in[ncfft - k].r, -in[ncfft - k].i};
+        cpx f1 = Scalar::add(a, b), t = Scalar::mul(Scalar::sub(a, b), tw[k]);
+        out[k] = Scalar::scale(Scalar::add(f1, t), half);
+        cpx d = Scalar::scale(Scalar::sub(f1, t), half);
+        out[ncfft - k] = cpx{d.r, -d.i};
+    }
+}
+
+void forward(void *cfg, const kiss_fft_scalar *in, kiss_fft_cpx *out)
+{
+    const Plan *plan = (const Plan *)cfg;
+    const unsigned ncfft = plan->ncfft;
+    cpx *z = plan->work[0];
+    transform<false>(plan, (const cpx *)in, z, plan->work[1]);
+    separate<false>(plan->super_tw, z, out, ncfft);
+    out[0] = cpx{z[0].r + z[0].i, 0};
+    out[ncfft] = cpx{z[0].r - z[0].i, 0};
+}
+
+void inverse(void *cfg, const kiss_fft_cpx *in, kiss_fft_scalar *out)
+{
+    const Plan *plan = (const Plan *)cfg;
+    const unsigned ncfft = plan->ncfft;
+    cpx *z = plan->work[0];
+    separate<true>(plan->super_tw, in, z, ncfft);
+    z[0] = cpx{in[0].r + in[ncfft].r, in[0].r - in[ncfft].r};
+    transform<true>(plan, z, (cpx *)out, plan->work[1]);
+}
+
+void forward_batch(void *cfg, const kiss_fft_scalar *const in[], kiss_fft_cpx *const out[], unsigned count)
+{
+    for (unsigned n = 0; n < count; n++) {
+        forward(cfg, in[n], out[n]);
+    }
+}
+
+void inverse_batch(void *cfg, const kiss_fft_cpx *const in[], kiss_fft_scalar *const out[], unsigned count)
+{
+    for (unsigned n = 0; n < count; n++) {
+        inverse(cfg, in[n], out[n]);
+    }
+}
+
+void cexp(cpx *c, double phase)
+{
+    c->r = (float)cos(phase);
+    c->i = (float)sin(phase);
+}
+
+// ncfft = n1 * n2 with both factors multiples of 16 and n1 as close to sqrt(ncfft) as possible, 0 if none
+unsigned four_step_split(unsigned ncfft)
+{
+    unsigned n1 = 0;
+    for (unsigned d = 16; (unsigned long long)d * d <= ncfft; d += 16) {
+        if (ncfft % d == 0 && (ncfft / d) % 16 == 0) {
+            n1 = d;
+        }
+    }
+    return n1;
+}
+
+void plan_free(void *cfg);
+
+// 'batch' interleaved complex transforms, x[batch * n + b], when more than 1: the stages stride by batch
+Plan *plan_alloc(unsigned nfft, bool inverse, unsigned batch)
+{
+    if (nfft < 2 || nfft % 2) {
+        return NULL;
+    }
+    const unsigned ncfft = nfft / 2;
+    const double sign = inverse ? 1 : -1;
+    const unsigned min = fft_four_step_min(), n1 = batch == 1 && min && nfft >= min ? four_step_split(ncfft) : 0;
+    const unsigned n2 = n1 ? ncfft / n1 : 0, threads = thread_count();
+    const unsigned nslots = threads < n1 / TILE ? threads : n1 / TILE;
+    unsigned radix[MAX_STAGES], nstages = 0, n = n1 ? 1 : ncfft, twos = 0;
+    for (; n % 2 == 0; n /= 2) {
+        twos++;
+    }
+    for (; twos >= 3; twos -= 3) {
+        radix[nstages++] = 8;
+    }
+    if (twos == 2) {
+        radix[nstages++] = 4;
+    } else if (twos == 1) {
+        if (nstages > 0) { // 8 * 2 -> 4 * 4
+            radix[0] = 4;
+            radix[nstages++] = 4;
+        } else {
+            radix[nstages++] = 2;
+        }
+    }
+    if (nstages > 1 && (ncfft / radix[0]) % 4 && radix[0] == 8) { // prefer a vectorizable first stage
+        radix[0] = radix[nstages - 1];
+        radix[nstages - 1] = 8;
+    }
+    for (unsigned f = 3; n > 1; f += 2) {
+        for (; n % f == 0 && nstages < MAX_STAGES; n /= f) {
+            radix[nstages++] = f;
+        }
+    }
+
+    // one block: plan | stages twiddles and roots | super twiddles | work buffers | four-step twiddles and tiles
+    size_t num_cpx = ncfft / 2 + 1 + 2 * (size_t)ncfft * batch;
+    for (unsigned i = 0, len = ncfft; i < nstages; len /= radix[i], i++) {
+        num_cpx += len + radix[i];
+    }
+    if (n1) {
+        num_cpx += ncfft / TILE + n2 * TILE + (size_t)nslots * 3 * TILE * (n1 > n2 ? n1 : n2);
+    }
+    Plan *plan = (Plan *)malloc(sizeof(Plan) + 32 + num_cpx * sizeof(cpx));
+    if (!plan) {
+        return NULL;
+    }
+    memset(plan, 0, sizeof(Plan));
+    plan->nfft = nfft;
+    plan->ncfft = ncfft;
+    plan->inverse = inverse;
+    plan->nstages = nstages;
+
+    cpx *mem = (cpx *)(((uintptr_t)(plan + 1) + 31) & ~(uintptr_t)31);
+    for (unsigned i = 0, s = batch, len = ncfft; i < nstages; s *= radix[i], len /= radix[i], i++) {
+        Stage &st = plan->stage[i];
+        st.radix = radix[i];
+        st.s = s;
+        st.m = len / radix[i];
+        st.pvec = s == 1 && (st.radix == 4 || st.radix == 8) && st.m % 4 == 0;
+        st.tw = mem;
+        st.root = mem + (st.radix - 1) * st.m;
+        mem = st.root + st.radix;
+        for (unsigned p = 0; p < st.m; p++) {
+            for (unsigned j = 1; j < st.radix; j++) {
+                cpx *w = st.pvec ? st.tw + (j - 1) * st.m + p : st.tw + p * (st.radix - 1) + j - 1;
+                cexp(w, sign * 2 * M_PI * ((double)j * p) / len);
+            }
+        }
+        for (unsigned j = 0; j < st.radix; j++) {
+            cexp(st.root + j, sign * 2 * M_PI * j / st.radix);
+        }
+    }
+    plan->super_tw = mem;
+    for (unsigned k = 0; k <= ncfft / 2; k++) { // -i * exp(-i*pi*k/ncfft) forward, conjugated for inverse
+        cexp(plan->super_tw + k, sign * M_PI * ((double)k / ncfft + .5));
+    }
+    mem += ncfft / 2 + 1;
+    plan->work[0] = mem;
+    plan->work[1] = mem + (size_t)ncfft * batch;
+    mem += 2 * (size_t)ncfft * batch;
+    if (n1) {
+        plan->n1 = n1;
+        plan->n2 = n2;
+        plan->tw = mem;
+        plan->tw_tile = plan->tw + ncfft / TILE;
+        plan->nslots = nslots;
+        plan->tile_len = TILE * (n1 > n2 ? n1 : n2);
+        plan->tile = plan->tw_tile + n2 * TILE;
+        for (unsigned g = 0; g < n1 / TILE; g++) {
+            for (unsigned k = 0; k < n2; k++) {
+                const unsigned long long e = (unsigned long long)g * TILE * k % ncfft;
+                cexp(plan->tw + g * n2 + k, sign * 2 * M_PI * (double)e / ncfft);
+            }
+        }
+        for (unsigned k = 0; k < n2; k++) {
+            for (unsigned b = 0; b < TILE; b++) {
+                cexp(plan->tw_tile + k * TILE + b, sign * 2 * M_PI * ((double)b * k) / ncfft);
+            }
+        }
+        plan->sub[0] = plan_alloc(2 * n1, inverse, TILE);
+        plan->sub[1] = plan_alloc(2 * n2, inverse, TILE);
+        if (!plan->sub[0] || !plan->sub[1]) {
+            plan_free(plan);
+            return NULL;
+        }
+    }
+    return plan;
+}
+
+void *plan_alloc(unsigned nfft, bool inverse)
+{
+    return plan_alloc(nfft, inverse, 1);
+}
+
+void plan_free(void *cfg)
+{
+    Plan *plan = (Plan *)cfg;
+    if (plan && plan->n1) {
+        plan_free(plan->sub[0]);
+        plan_free(plan->sub[1]);
+    }
+    free(cfg);
+}
+
+// even nfft with nfft/2 = 2^a * 3^b * 5^c, a >= 4, so that all stages vectorize
+unsigned fast_size(unsigned n)
+{
+    unsigned m = n < 32 ? 16 : (n + 1) / 2;
+    for (;; m++) {
+        m = kiss_fft_next_fast_size(m);
+        if (m % 16 == 0) {
+            return 2 * m;
+        }
+    }
+}
+} // namespace
+
+const FftBackend fft_backend_avx2 = {
+    {plan_alloc, plan_free}, "avx2", fast_size, forward, inverse, forward_batch, inverse_batch,
+};
+
+#endif
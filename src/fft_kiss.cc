@@ -0,0 +1,129 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "fft.h"
+
+#include <_kiss_fft_guts.h>
+#include <kiss_fftr.h>
+
+namespace {
+struct KissPlan {
+    unsigned nfft;
+    bool inverse;
+    kiss_fftr_cfg real;
+    kiss_fft_cfg cpx; // two real signals per complex transform, allocated by the first batched call
+    kiss_fft_cpx *t, *T;
+};
+
+void *plan_alloc(unsigned nfft, bool inverse)
+{
+    KissPlan *plan = new KissPlan{nfft, inverse, kiss_fftr_alloc(nfft, inverse, NULL, NULL), NULL, NULL, NULL};
+    if (!plan->real) {
+        delete plan;
+        return NULL;
+    }
+    return plan;
+}
+
+void plan_free(void *cfg)
+{
+    KissPlan *plan = (KissPlan *)cfg;
+    kiss_fftr_free(plan->real);
+    if (plan->cpx) {
+        kiss_fft_free(plan->cpx);
+        delete[] plan->t;
+        delete[] plan->T;
+    }
+    delete plan;
+}
+
+bool alloc_cpx(KissPlan *plan)
+{
+    if (!plan->cpx) {
+        plan->cpx = kiss_fft_alloc(plan->nfft, plan->inverse, NULL, NULL);
+        if (plan->cpx) { // scratch buffers belong to a complex plan, freed with it
+            plan->t = new kiss_fft_cpx[plan->nfft];
+            plan->T = new kiss_fft_cpx[plan->nfft];
+        }
+    }
+    return plan->cpx != NULL;
+}
+
+unsigned fast_size(unsigned n)
+{
+    return kiss_fftr_next_fast_size_real(n);
+}
+
+void forward(void *cfg, const kiss_fft_scalar *in, kiss_fft_cpx *out)
+{
+    kiss_fftr(((KissPlan *)cfg)->real, in, out);
+}
+
+void inverse(void *cfg, const kiss_fft_cpx *in, kiss_fft_scalar *out)
+{
+    kiss_fftri(((KissPlan *)cfg)->real, in, out);
+}
+
+// u = a + i*b, spectra are separated with conjugate symmetry:
+//   A[k] = (U[k] + conj(U[N-k])) / 2, B[k] = -i * (U[k] - conj(U[N-k])) / 2
+void forward_batch(void *cfg, const kiss_fft_scalar *const in[], kiss_fft_cpx *const out[], unsigned count)
+{
+    KissPlan *plan = (KissPlan *)cfg;
+    const unsigned nfft = plan->nfft;
+    unsigned n = 0;
+    for (; count - n >= 2 && alloc_cpx(plan); n += 2) {
+        const kiss_fft_scalar *a = in[n], *b = in[n + 1];
+        kiss_fft_cpx *A = out[n], *B = out[n + 1], *t = plan->t, *U = plan->T;
+        for (unsigned j = 0; j < nfft; j++) {
+            t[j].r = a[j];
+            t[j].i = b[j];
+        }
+        kiss_fft(plan->cpx, t, U);
+        for (unsigned k = 0; k <= nfft / 2; k++) {
+            const kiss_fft_cpx u = U[k], un = U[k ? nfft - k : 0];
+            A[k].r = HALF_OF(u.r + un.r);
+            A[k].i = HALF_OF(u.i - un.i);
+            B[k].r = HALF_OF(u.i + un.i);
+            B[k].i = HALF_OF(un.r - u.r);
+        }
+    }
+    for (; n < count; n++) {
+        kiss_fftr(plan->real, in[n], out[n]);
+    }
+}
+
+// both outputs are real: transform W = A + i*B, where W[N-k] = conj(A[k]) + i*conj(B[k])
+void inverse_batch(void *cfg, const kiss_fft_cpx *const in[], kiss_fft_scalar *const out[], unsigned count)
+{
+    KissPlan *plan = (KissPlan *)cfg;
+    const unsigned nfft = plan->nfft;
+    unsigned n = 0;
+    for (; count - n >= 2 && alloc_cpx(plan); n += 2) {
+        const kiss_fft_cpx *A = in[n], *B = in[n + 1];
+        kiss_fft_cpx *W = plan->T, *t = plan->t;
+        for (unsigned k = 0; k <= nfft / 2; k++) {
+            W[k].r = A[k].r - B[k].i;
+            W[k].i = A[k].i + B[k].r;
+        }
+        for (unsigned k = 1; k < nfft / 2; k++) {
+            W[nfft - k].r = A[k].r + B[k].i;
+            W[nfft - k].i = B[k].r - A[k].i;
+        }
+        kiss_fft(plan->cpx, W, t);
+        kiss_fft_scalar *a = out[n], *b = out[n + 1];
+        for (unsigned j = 0; j < nfft; j++) {
+            a[j] = t[j].r;
+            b[j] = t[j].i;
+        }
+    }
+    for (; n < count; n++) {
+        kiss_fftri(plan->real, in[n], out[n]);
+    }
+}
+} // namespace
+
+const FftBackend fft_backend_kiss = {
+    {plan_alloc, plan_free}, "kiss", fast_size, forward, inverse, forward_batch, inverse_batch,
+};
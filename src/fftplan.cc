@@ -0,0 +1,184 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "fftplan.h"
+#include "threads.h"
+
+#include <atomic>
+#include <cassert>
+#include <mutex>
+#include <vector>
+
+namespace {
+struct Entry {
+    const FftPlanType *type;
+    unsigned nfft;
+    bool inverse;
+    void *cfg;
+};
+std::mutex g_lock;
+std::vector<Entry> g_idle; // most recently released last, the storage is kept: a release allocates nothing
+unsigned g_capacity = 8; // per thread
+std::atomic<unsigned> g_allocs(0);
+
+// every worker thread holds its own set of plans at once
+size_t capacity()
+{
+    return (size_t)g_capacity * thread_count();
+}
+
+void trim(std::vector<Entry> &evicted)
+{
+    if (g_idle.size() > capacity()) {
+        const size_t n = g_idle.size() - capacity();
+        evicted.assign(g_idle.begin(), g_idle.begin() + n);
+        g_idle.erase(g_idle.begin(), g_idle.begin() + n);
+    }
+}
+void release(const std::vector<Entry> &evicted)
+{
+    for (auto &e : evicted) {
+        e.type->free(e.cfg);
+    }
+}
+} // namespace
+
+FftPlanBase::FftPlanBase(const FftPlanType *type, unsigned nfft, bool inverse)
+    : type_(type), nfft_(nfft), inverse_(inverse), cfg_(NULL)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_lock);
+        for (size_t i = g_idle.size(); i-- > 0;) {
+            if (g_idle[i].type == type && g_idle[i].nfft == nfft && g_idle[i].inverse == inverse) {
+                cfg_ = g_idle[i].cfg;
+                g_idle.erase(g_idle.begin() + i);
+                return;
+            }
+        }
+    }
+    cfg_ = type->alloc(nfft, inverse);
+    g_allocs++;
+}
+
+FftPlanBase::~FftPlanBase()
+{
+    if (!cfg_) {
+        return;
+    }
+    Entry evicted = {NULL, 0, false, NULL}; // the least recently released one, past the capacity
+    {
+        std::lock_guard<std::mutex> lock(g_lock);
+        g_idle.push_back(Entry{type_, nfft_, inverse_, cfg_});
+        if (g_idle.size() > capacity()) {
+            evicted = g_idle.front();
+            g_idle.erase(g_idle.begin());
+        }
+    }
+    if (evicted.cfg) {
+        evicted.type->free(evicted.cfg);
+    }
+}
+
+void fft_plan_cache_capacity(unsigned num_plans)
+{
+    std::vector<Entry> evicted;
+    {
+        std::lock_guard<std::mutex> lock(g_lock);
+        g_capacity = num_plans;
+        trim(evicted);
+        g_idle.reserve(capacity() + 1); // a release pushes before it evicts
+    }
+    release(evicted);
+}
+
+unsigned fft_plan_allocs()
+{
+    return g_allocs.load();
+}
+
+void fft_plan_cache_flush()
+{
+    std::vector<Entry> evicted;
+    {
+        std::lock_guard<std::mutex> lock(g_lock);
+        evicted.swap(g_idle);
+    }
+    release(evicted);
+}
+
+namespace {
+void *test_alloc(unsigned nfft, bool)
+{
+    return new unsigned(nfft);
+}
+void test_free(void *cfg)
+{
+    delete (unsigned *)cfg;
+}
+const FftPlanType test_plan_type = {test_alloc, test_free};
+const FftPlanType test_plan_type2 = {test_alloc, test_free};
+
+class TestPlan : FftPlanBase
+{
+public:
+    TestPlan(unsigned nfft, bool inverse, const FftPlanType *type = &test_plan_type)
+        : FftPlanBase(type, nfft, inverse)
+    {
+    }
+    operator const void *() const { return cfg_; }
+};
+} // namespace
+
+bool test_fft_plan()
+{
+    fft_plan_cache_flush();
+    const void *cfg;
+    {
+        TestPlan plan(64, false);
+        cfg = plan;
+    }
+    bool success = true;
+    {
+        TestPlan plan(64, false);  // reused
+        TestPlan other(64, false); // busy, allocate new one
+        TestPlan inv(64, true);
+        TestPlan type2(64, false, &test_plan_type2);
+        success &= cfg == plan && cfg != other && cfg != inv && cfg != type2;
+        assert(success);
+    }
+    fft_plan_cache_capacity(2);
+    {
+        TestPlan plan(64, false); // the most recently released one survived
+        success &= cfg == plan;
+        assert(success);
+    }
+    fft_plan_cache_capacity(8);
+    // once warm, taking and releasing cached plans allocates no new ones
+    unsigned allocs = 0;
+    for (unsigned i = 0; i < 3; i++) {
+        allocs = i == 1 ? fft_plan_allocs() : allocs;
+        TestPlan plan(64, false), inv(64, true);
+    }
+    success &= fft_plan_allocs() == allocs;
+    assert(success);
+
+    // the capacity is per thread: one plan for each of two threads survives
+    const unsigned saved = thread_count();
+    thread_count(2);
+    fft_plan_cache_capacity(1);
+    {
+        TestPlan plan(64, false), inv(64, true);
+    }
+    allocs = fft_plan_allocs();
+    {
+        TestPlan plan(64, false), inv(64, true);
+    }
+    success &= fft_plan_allocs() == allocs;
+    assert(success);
+    thread_count(saved);
+    fft_plan_cache_capacity(8);
+    fft_plan_cache_flush();
+    return success;
+}
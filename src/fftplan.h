@@ -0,0 +1,40 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+//
+// Process-wide cache of FFT plans keyed by (type, nfft, direction).
+//
+// Plans may keep scratch buffers (kiss_fftr does), so a plan is never shared: the constructor
+// takes an idle plan from the cache (or allocates a new one) and the destructor returns it back.
+// The least recently used idle plans are freed once the cache exceeds its capacity.
+//
+struct FftPlanType {
+    void *(*alloc)(unsigned nfft, bool inverse);
+    void (*free)(void *cfg);
+};
+
+class FftPlanBase
+{
+protected:
+    FftPlanBase(const FftPlanType *type, unsigned nfft, bool inverse);
+    ~FftPlanBase();
+
+    const FftPlanType *type_;
+    unsigned nfft_;
+    bool inverse_;
+    void *cfg_;
+
+private:
+    FftPlanBase(const FftPlanBase &) = delete;
+    FftPlanBase &operator=(const FftPlanBase &) = delete;
+};
+
+void fft_plan_cache_capacity(unsigned num_plans); // idle plans to keep per thread_count() [default: 8]
+void fft_plan_cache_flush();
+unsigned fft_plan_allocs(); // plans allocated so far, i.e. cache misses
+
+bool test_fft_plan();
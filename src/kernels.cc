@@ -0,0 +1,267 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "kernels.h"
+
+#include <cassert>
+#include <cmath>
+#include <memory>
+
+#define SCOPE_ARRAY(type, name, len) \
+    std::unique_ptr<type[]> name##_buf(new type[len]); \
+    auto name = name##_buf.get();
+
+namespace {
+double sumsq(const double *x, unsigned n)
+{
+    double sum = 0;
+    for (unsigned i = 0; i < n; i++) {
+        sum += x[i] * x[i];
+    }
+    return sum;
+}
+
+double sqdist(const double *a, const double *b, unsigned n)
+{
+    double sum = 0;
+    for (unsigned i = 0; i < n; i++) {
+        sum += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return sum;
+}
+
+void sqdiff(double *out, const double *a, const double *b, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++) {
+        out[i] = a[i] * a[i] - b[i] * b[i];
+    }
+}
+
+void cmulc_acc(kiss_fft_cpx *z, const kiss_fft_cpx *a, const kiss_fft_cpx *b, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++) {
+        z[i].r += a[i].r * b[i].r + a[i].i * b[i].i;
+        z[i].i += a[i].i * b[i].r - a[i].r * b[i].i;
+    }
+}
+
+void halfband(double *out, const double *even, const double *odd, const double *taps, unsigned ntaps, unsigned n)
+{
+    for (unsigned k = 0; k < n; k++) {
+        const double *o = odd + k;
+        double acc = 0.5 * even[k];
+        for (unsigned i = 0; i < ntaps; i++) {
+            acc += taps[i] * (o[-1 - (int)i] + o[i]);
+        }
+        out[k] = acc;
+    }
+}
+
+double sumsq_f(const float *x, unsigned n)
+{
+    double sum = 0;
+    for (unsigned i = 0; i < n; i++) {
+        sum += (double)x[i] * x[i];
+    }
+    return sum;
+}
+
+double sqdist_f(const float *a, const float *b, unsigned n)
+{
+    double sum = 0;
+    for (unsigned i = 0; i < n; i++) {
+        const double d = (double)a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+void sqdiff_f(double *out, const float *a, const float *b, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++) {
+        out[i] = (double)a[i] * a[i] - (double)b[i] * b[i];
+    }
+}
+
+double sumsq_s16(const int16_t *x, unsigned n)
+{
+    int64_t sum = 0;
+    for (unsigned i = 0; i < n; i++) {
+        sum += x[i] * x[i];
+    }
+    return (double)sum;
+}
+
+double sqdist_s16(const int16_t *a, const int16_t *b, unsigned n)
+{
+    int64_t sum = 0;
+    for (unsigned i = 0; i < n; i++) {
+        const int64_t d = a[i] - b[i];
+        sum += d * d;
+    }
+    return (double)sum;
+}
+
+void sqdiff_s16(double *out, const int16_t *a, const int16_t *b, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++) {
+        out[i] = a[i] * a[i] - b[i] * b[i];
+    }
+}
+
+unsigned find_le(const double *x, unsigned n, double limit)
+{
+    unsigned i = 0;
+    for (; i < n && !(x[i] <= limit); i++) {
+    }
+    return i;
+}
+
+const Kernels *const g_kernels[] = {
+#ifdef WAVALIGN_AVX512
+    &kernels_avx512,
+#endif
+#ifdef WAVALIGN_AVX2
+    &kernels_avx2,
+#endif
+#ifdef WAVALIGN_SSE2
+    &kernels_sse2,
+#endif
+    &kernels_generic,
+};
+} // namespace
+
+const Kernels kernels_generic = {CPU_GENERIC, sumsq, sqdist, sqdiff, cmulc_acc, halfband, find_le, sumsq_f,
+                                 sqdist_f, sqdiff_f, sumsq_s16, sqdist_s16, sqdiff_s16};
+
+const Kernels *kernels_list(unsigned idx)
+{
+    for (auto k : g_kernels) {
+        if (k->level <= cpu_level() && idx-- == 0) {
+            return k;
+        }
+    }
+    return NULL;
+}
+
+const Kernels *kernels()
+{
+    static const Kernels *k = kernels_list(0);
+    return k;
+}
+
+static bool test_kernels(const Kernels *k, unsigned n)
+{
+    SCOPE_ARRAY(double, a, n)
+    SCOPE_ARRAY(double, b, n)
+    SCOPE_ARRAY(double, d0, n)
+    SCOPE_ARRAY(double, d1, n)
+    SCOPE_ARRAY(kiss_fft_cpx, z0, n)
+    SCOPE_ARRAY(kiss_fft_cpx, z1, n)
+    SCOPE_ARRAY(kiss_fft_cpx, x, n)
+    SCOPE_ARRAY(kiss_fft_cpx, y, n)
+    SCOPE_ARRAY(double, o, n + 8)
+    for (unsigned i = 0; i < n + 8; i++) {
+        o[i] = ((int)(i * 5 % 13) - 6) / 6.;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        a[i] = ((int)(i * i % 23) - 11) / 11.;
+        b[i] = ((int)(i * 7 % 19) - 9) / 9.;
+    }
+    for (unsigned i = 0; i < n; i++) { // y reads a and b backwards
+        x[i].r = (float)a[i];
+        x[i].i = (float)b[i];
+        y[i].r = (float)b[n - 1 - i];
+        y[i].i = (float)a[n - 1 - i];
+        z0[i].r = z1[i].r = (float)i;
+        z0[i].i = z1[i].i = -(float)i;
+    }
+    const Kernels &ref = kernels_generic;
+    bool success = fabs(k->sumsq(a, n) - ref.sumsq(a, n)) < 1e-9 * (n + 1);
+    success &= fabs(k->sqdist(a, b, n) - ref.sqdist(a, b, n)) < 1e-9 * (n + 1);
+    assert(success);
+    k->sqdiff(d0, a, b, n);
+    ref.sqdiff(d1, a, b, n);
+    k->cmulc_acc(z0, x, y, n);
+    ref.cmulc_acc(z1, x, y, n);
+    for (unsigned i = 0; i < n; i++) {
+        success &= fabs(d0[i] - d1[i]) < 1e-12;
+        assert(success);
+    }
+    static const double taps[4] = {0.3, -0.07, 0.02, -0.005};
+    k->halfband(d0, a, o + 4, taps, 4, n);
+    ref.halfband(d1, a, o + 4, taps, 4, n);
+    for (unsigned i = 0; i < n; i++) {
+        success &= fabs(d0[i] - d1[i]) < 1e-12;
+        success &= fabs(z0[i].r - z1[i].r) < 1e-4 * (i + 1) && fabs(z0[i].i - z1[i].i) < 1e-4 * (i + 1);
+        assert(success);
+    }
+    SCOPE_ARRAY(float, af, n)
+    SCOPE_ARRAY(float, bf, n)
+    for (unsigned i = 0; i < n; i++) {
+        af[i] = (float)a[i];
+        bf[i] = (float)b[i];
+    }
+    success &= fabs(k->sumsq_f(af, n) - ref.sumsq_f(af, n)) < 1e-6 * (n + 1);
+    success &= fabs(k->sqdist_f(af, bf, n) - ref.sqdist_f(af, bf, n)) < 1e-6 * (n + 1);
+    k->sqdiff_f(d0, af, bf, n);
+    ref.sqdiff_f(d1, af, bf, n);
+    for (unsigned i = 0; i < n; i++) {
+        success &= d0[i] == d1[i];
+        assert(success);
+    }
+    SCOPE_ARRAY(int16_t, as, n)
+    SCOPE_ARRAY(int16_t, bs, n)
+    for (unsigned i = 0; i < n; i++) { // full scale, (-32768 - 32767)^2 included
+        as[i] = (int16_t)(i % 3 ? a[i] * 32767 : -32768);
+        bs[i] = (int16_t)(i % 5 ? b[i] * 32767 : 32767);
+    }
+    success &= k->sumsq_s16(as, n) == ref.sumsq_s16(as, n);
+    success &= k->sqdist_s16(as, bs, n) == ref.sqdist_s16(as, bs, n);
+    k->sqdiff_s16(d0, as, bs, n);
+    ref.sqdiff_s16(d1, as, bs, n);
+    for (unsigned i = 0; i < n; i++) {
+        success &= d0[i] == d1[i];
+        assert(success);
+    }
+    for (unsigned i = 0; i <= n; i++) { // a[] minima are at multiples of 23
+        const double limit = -1 + i / (n + 1.);
+        success &= k->find_le(a + i, n - i, limit) == ref.find_le(a + i, n - i, limit);
+        assert(success);
+    }
+    return success;
+}
+
+// compensated float sums against the double sum of a long window
+static bool test_kernels_accuracy(const Kernels *k)
+{
+    const unsigned n = 1 << 20;
+    SCOPE_ARRAY(float, x, n)
+    SCOPE_ARRAY(float, y, n)
+    double sumsq = 0, sqdist = 0;
+    for (unsigned i = 0; i < n; i++) {
+        x[i] = (float)((int)(i * 7919 % 65536) - 32768) / 32768; // 16-bit PCM levels
+        y[i] = (float)((int)(i * 104729 % 65536) - 32768) / 32768;
+        sumsq += (double)x[i] * x[i];
+        sqdist += ((double)x[i] - y[i]) * ((double)x[i] - y[i]);
+    }
+    bool success = fabs(k->sumsq_f(x, n) - sumsq) < 1e-7 * sumsq;
+    success &= fabs(k->sqdist_f(x, y, n) - sqdist) < 1e-7 * sqdist;
+    assert(success);
+    return success;
+}
+
+bool test_kernels()
+{
+    static const unsigned sizes[] = {0, 1, 7, 16, 33, 1000};
+    bool success = kernels() == kernels_list(0);
+    for (unsigned i = 0; kernels_list(i); i++) {
+        for (unsigned n : sizes) {
+            success &= test_kernels(kernels_list(i), n);
+        }
+        success &= test_kernels_accuracy(kernels_list(i));
+    }
+    return success;
+}
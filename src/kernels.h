@@ -0,0 +1,77 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include "cpu.h"
+
+#include <kiss_fft.h>
+#include <stdint.h>
+
+//
+// Numeric kernels compiled for several SIMD levels, one table per level.
+//
+struct Kernels {
+    CpuLevel level;
+    double (*sumsq)(const double *x, unsigned n);                          // sum x[i]^2
+    double (*sqdist)(const double *a, const double *b, unsigned n);        // sum (a[i] - b[i])^2
+    void (*sqdiff)(double *out, const double *a, const double *b, unsigned n); // out[i] = a[i]^2 - b[i]^2
+    void (*cmulc_acc)(kiss_fft_cpx *z, const kiss_fft_cpx *a, const kiss_fft_cpx *b,
+                      unsigned n); // z[i] += a[i] * conj(b[i])
+    // half-band FIR on polyphase input, odd[] is read at [-ntaps, n + ntaps):
+    //   out[k] = even[k] / 2 + sum taps[i] * (odd[k - 1 - i] + odd[k + i]), i < ntaps
+    void (*halfband)(double *out, const double *even, const double *odd, const double *taps, unsigned ntaps,
+                     unsigned n);
+    unsigned (*find_le)(const double *x, unsigned n, double limit); // first i with x[i] <= limit, n if none
+
+    // single-precision input, sums of short blocks are compensated (Kahan) per vector lane, differences are exact
+    double (*sumsq_f)(const float *x, unsigned n);
+    double (*sqdist_f)(const float *a, const float *b, unsigned n);
+    void (*sqdiff_f)(double *out, const float *a, const float *b, unsigned n);
+
+    // 16-bit PCM input, sums are exact in double lanes for up to 2^21 samples (2^23 for sumsq)
+    double (*sumsq_s16)(const int16_t *x, unsigned n);
+    double (*sqdist_s16)(const int16_t *a, const int16_t *b, unsigned n);
+    void (*sqdiff_s16)(double *out, const int16_t *a, const int16_t *b, unsigned n);
+};
+
+// Overloads on the sample type for templated callers
+inline double sumsq(const Kernels *k, const double *x, unsigned n) { return k->sumsq(x, n); }
+inline double sumsq(const Kernels *k, const float *x, unsigned n) { return k->sumsq_f(x, n); }
+inline double sqdist(const Kernels *k, const double *a, const double *b, unsigned n) { return k->sqdist(a, b, n); }
+inline double sqdist(const Kernels *k, const float *a, const float *b, unsigned n) { return k->sqdist_f(a, b, n); }
+inline void sqdiff(const Kernels *k, double *out, const double *a, const double *b, unsigned n)
+{
+    k->sqdiff(out, a, b, n);
+}
+inline void sqdiff(const Kernels *k, double *out, const float *a, const float *b, unsigned n)
+{
+    k->sqdiff_f(out, a, b, n);
+}
+inline double sumsq(const Kernels *k, const int16_t *x, unsigned n) { return k->sumsq_s16(x, n); }
+inline double sqdist(const Kernels *k, const int16_t *a, const int16_t *b, unsigned n)
+{
+    return k->sqdist_s16(a, b, n);
+}
+inline void sqdiff(const Kernels *k, double *out, const int16_t *a, const int16_t *b, unsigned n)
+{
+    k->sqdiff_s16(out, a, b, n);
+}
+
+extern const Kernels kernels_generic;
+#ifdef WAVALIGN_SSE2
+extern const Kernels kernels_sse2;
+#endif
+#ifdef WAVALIGN_AVX2
+extern const Kernels kernels_avx2;
+#endif
+#ifdef WAVALIGN_AVX512
+extern const Kernels kernels_avx512;
+#endif
+
+const Kernels *kernels(); // for cpu_level()
+const Kernels *kernels_list(unsigned idx); // supported ones, NULL-terminated
+
+bool test_kernels();
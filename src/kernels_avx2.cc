@@ -0,0 +1,61 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#ifdef WAVALIGN_AVX2
+
+#include <immintrin.h>
+
+#include "kernels_impl.h"
+
+namespace {
+struct Avx2 {
+    typedef __m256d vd;
+    typedef __m256 vf;
+    static const unsigned ND = 4, NF = 8;
+
+    static vd zerod() { return _mm256_setzero_pd(); }
+    static vd set1d(double a) { return _mm256_set1_pd(a); }
+    static vd loadd(const double *p) { return _mm256_loadu_pd(p); }
+    static vd loadfd(const float *p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+    static vd loadsd(const int16_t *p)
+    {
+        return _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *)p)));
+    }
+    static void stored(double *p, vd a) { _mm256_storeu_pd(p, a); }
+    static vd addd(vd a, vd b) { return _mm256_add_pd(a, b); }
+    static vd subd(vd a, vd b) { return _mm256_sub_pd(a, b); }
+    static vd muld(vd a, vd b) { return _mm256_mul_pd(a, b); }
+    static vd fmad(vd a, vd b, vd c) { return _mm256_fmadd_pd(a, b, c); }
+    static double hsumd(vd a)
+    {
+        __m128d s = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+        return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+    }
+    static unsigned lemask(vd a, vd b) { return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ)); }
+
+    static vf zerof() { return _mm256_setzero_ps(); }
+    static vf loadf(const float *p) { return _mm256_loadu_ps(p); }
+    static void storef(float *p, vf a) { _mm256_storeu_ps(p, a); }
+    static vf addf(vf a, vf b) { return _mm256_add_ps(a, b); }
+    static vf subf(vf a, vf b) { return _mm256_sub_ps(a, b); }
+    static vf fmaf(vf a, vf b, vf c) { return _mm256_fmadd_ps(a, b, c); }
+    static double hsumf(vf a)
+    {
+        return hsumd(_mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(a)),
+                                   _mm256_cvtps_pd(_mm256_extractf128_ps(a, 1))));
+    }
+    static vf cmulc(vf a, vf b) // a * conj(b): re = ar*br + ai*bi, im = ai*br - ar*bi
+    {
+        vf t = _mm256_mul_ps(_mm256_permute_ps(a, 0xB1), _mm256_movehdup_ps(b));
+        return _mm256_fmsubadd_ps(a, _mm256_moveldup_ps(b), t);
+    }
+};
+} // namespace
+
+const Kernels kernels_avx2 = {CPU_AVX2, sumsq<Avx2>, sqdist<Avx2>, sqdiff<Avx2>, cmulc_acc<Avx2>, halfband<Avx2>,
+                              find_le<Avx2>, sumsq_f<Avx2>, sqdist_f<Avx2>, sqdiff_f<Avx2>, sumsq_s16<Avx2>,
+                              sqdist_s16<Avx2>, sqdiff_s16<Avx2>};
+
+#endif
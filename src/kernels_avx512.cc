@@ -0,0 +1,57 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#ifdef WAVALIGN_AVX512
+
+#include <immintrin.h>
+
+#include "kernels_impl.h"
+
+namespace {
+struct Avx512 {
+    typedef __m512d vd;
+    typedef __m512 vf;
+    static const unsigned ND = 8, NF = 16;
+
+    static vd zerod() { return _mm512_setzero_pd(); }
+    static vd set1d(double a) { return _mm512_set1_pd(a); }
+    static vd loadd(const double *p) { return _mm512_loadu_pd(p); }
+    static vd loadfd(const float *p) { return _mm512_cvtps_pd(_mm256_loadu_ps(p)); }
+    static vd loadsd(const int16_t *p)
+    {
+        return _mm512_cvtepi32_pd(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)p)));
+    }
+    static void stored(double *p, vd a) { _mm512_storeu_pd(p, a); }
+    static vd addd(vd a, vd b) { return _mm512_add_pd(a, b); }
+    static vd subd(vd a, vd b) { return _mm512_sub_pd(a, b); }
+    static vd muld(vd a, vd b) { return _mm512_mul_pd(a, b); }
+    static vd fmad(vd a, vd b, vd c) { return _mm512_fmadd_pd(a, b, c); }
+    static double hsumd(vd a) { return _mm512_reduce_add_pd(a); }
+    static unsigned lemask(vd a, vd b) { return _mm512_cmp_pd_mask(a, b, _CMP_LE_OQ); }
+
+    static vf zerof() { return _mm512_setzero_ps(); }
+    static vf loadf(const float *p) { return _mm512_loadu_ps(p); }
+    static void storef(float *p, vf a) { _mm512_storeu_ps(p, a); }
+    static vf addf(vf a, vf b) { return _mm512_add_ps(a, b); }
+    static vf subf(vf a, vf b) { return _mm512_sub_ps(a, b); }
+    static vf fmaf(vf a, vf b, vf c) { return _mm512_fmadd_ps(a, b, c); }
+    static double hsumf(vf a)
+    {
+        return hsumd(_mm512_add_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(a)),
+                                   _mm512_cvtps_pd(_mm512_extractf32x8_ps(a, 1))));
+    }
+    static vf cmulc(vf a, vf b) // a * conj(b): re = ar*br + ai*bi, im = ai*br - ar*bi
+    {
+        vf t = _mm512_mul_ps(_mm512_permute_ps(a, 0xB1), _mm512_movehdup_ps(b));
+        return _mm512_fmsubadd_ps(a, _mm512_moveldup_ps(b), t);
+    }
+};
+} // namespace
+
+const Kernels kernels_avx512 = {CPU_AVX512, sumsq<Avx512>, sqdist<Avx512>, sqdiff<Avx512>, cmulc_acc<Avx512>,
+                                halfband<Avx512>, find_le<Avx512>, sumsq_f<Avx512>, sqdist_f<Avx512>, sqdiff_f<Avx512>,
+                                sumsq_s16<Avx512>, sqdist_s16<Avx512>, sqdiff_s16<Avx512>};
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+//
+// Kernel bodies shared by kernels_<level>.cc. Each file defines an op set O for its target
+// flags before including this header, so everything here must stay local to the translation
+// unit (anonymous namespace, no non-inline externals).
+//
+#include "kernels.h"
+
+namespace {
+template <class O> double sumsq(const double *x, unsigned n)
+{
+    typename O::vd s0 = O::zerod(), s1 = O::zerod();
+    unsigned i = 0;
+    for (; i + 2 * O::ND <= n; i += 2 * O::ND) {
+        typename O::vd a = O::loadd(x + i), b = O::loadd(x + i + O::ND);
+        s0 = O::fmad(a, a, s0);
+        s1 = O::fmad(b, b, s1);
+    }
+    double sum = O::hsumd(O::addd(s0, s1));
+    for (; i < n; i++) {
+        sum += x[i] * x[i];
+    }
+    return sum;
+}
+
+template <class O> double sqdist(const double *a, const double *b, unsigned n)
+{
+    typename O::vd s0 = O::zerod(), s1 = O::zerod();
+    unsigned i = 0;
+    for (; i + 2 * O::ND <= n; i += 2 * O::ND) {
+        typename O::vd d0 = O::subd(O::loadd(a + i), O::loadd(b + i));
+        typename O::vd d1 = O::subd(O::loadd(a + i + O::ND), O::loadd(b + i + O::ND));
+        s0 = O::fmad(d0, d0, s0);
+        s1 = O::fmad(d1, d1, s1);
+    }
+    double sum = O::hsumd(O::addd(s0, s1));
+    for (; i < n; i++) {
+        sum += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return sum;
+}
+
+template <class O> void sqdiff(double *out, const double *a, const double *b, unsigned n)
+{
+    unsigned i = 0;
+    for (; i + O::ND <= n; i += O::ND) {
+        typename O::vd va = O::loadd(a + i), vb = O::loadd(b + i);
+        O::stored(out + i, O::subd(O::muld(va, va), O::muld(vb, vb)));
+    }
+    for (; i < n; i++) {
+        out[i] = a[i] * a[i] - b[i] * b[i];
+    }
+}
+
+template <class O> void cmulc_acc(kiss_fft_cpx *z, const kiss_fft_cpx *a, const kiss_fft_cpx *b, unsigned n)
+{
+    const unsigned NC = O::NF / 2;
+    unsigned i = 0;
+    for (; i + NC <= n; i += NC) {
+        O::storef(&z[i].r, O::addf(O::loadf(&z[i].r), O::cmulc(O::loadf(&a[i].r), O::loadf(&b[i].r))));
+    }
+    for (; i < n; i++) {
+        z[i].r += a[i].r * b[i].r + a[i].i * b[i].i;
+        z[i].i += a[i].i * b[i].r - a[i].r * b[i].i;
+    }
+}
+
+template <class O>
+void halfband(double *out, const double *even, const double *odd, const double *taps, unsigned ntaps, unsigned n)
+{
+    unsigned k = 0;
+    for (; k + O::ND <= n; k += O::ND) {
+        typename O::vd acc = O::muld(O::set1d(0.5), O::loadd(even + k));
+        for (unsigned i = 0; i < ntaps; i++) {
+            acc = O::fmad(O::set1d(taps[i]), O::addd(O::loadd(odd + k - 1 - i), O::loadd(odd + k + i)), acc);
+        }
+        O::stored(out + k, acc);
+    }
+    for (; k < n; k++) {
+        const double *o = odd + k;
+        double acc = 0.5 * even[k];
+        for (unsigned i = 0; i < ntaps; i++) {
+            acc += taps[i] * (o[-1 - (int)i] + o[i]);
+        }
+        out[k] = acc;
+    }
+}
+
+// Sum of squares of a[i] - b[i] (a[i] if b is NULL) over i += NF while i + 4 * NF <= n. Every lane of four
+// accumulators takes plain float sums for at most SUM_BLOCK iterations, the block sums are added with Kahan
+// compensation: the rounding error depends on the block length rather than on n, at about the cost of
+// a plain float sum.
+#define SUM_BLOCK 8
+template <class O, bool DIFF> inline typename O::vf term_f(const float *a, const float *b, unsigned i)
+{
+    return DIFF ? O::subf(O::loadf(a + i), O::loadf(b + i)) : O::loadf(a + i);
+}
+
+template <class O, bool DIFF> double sumsq_blocked(unsigned &i, unsigned n, const float *a, const float *b)
+{
+    typename O::vf s = O::zerof(), c = O::zerof();
+    while (i + 4 * O::NF <= n) {
+        typename O::vf b0 = O::zerof(), b1 = O::zerof(), b2 = O::zerof(), b3 = O::zerof();
+        for (unsigned k = 0; k < SUM_BLOCK && i + 4 * O::NF <= n; k++, i += 4 * O::NF) {
+            typename O::vf x0 = term_f<O, DIFF>(a, b, i), x1 = term_f<O, DIFF>(a, b, i + O::NF);
+            typename O::vf x2 = term_f<O, DIFF>(a, b, i + 2 * O::NF), x3 = term_f<O, DIFF>(a, b, i + 3 * O::NF);
+            b0 = O::fmaf(x0, x0, b0);
+            b1 = O::fmaf(x1, x1, b1);
+            b2 = O::fmaf(x2, x2, b2);
+            b3 = O::fmaf(x3, x3, b3);
+        }
+        typename O::vf y = O::subf(O::addf(O::addf(b0, b1), O::addf(b2, b3)), c), t = O::addf(s, y);
+        c = O::subf(O::subf(t, s), y);
+        s = t;
+    }
+    return O::hsumf(s) - O::hsumf(c);
+}
+
+template <class O> double sumsq_f(const float *x, unsigned n)
+{
+    unsigned i = 0;
+    double sum = sumsq_blocked<O, false>(i, n, x, NULL);
+    for (; i < n; i++) {
+        sum += (double)x[i] * x[i];
+    }
+    return sum;
+}
+
+template <class O> double sqdist_f(const float *a, const float *b, unsigned n)
+{
+    unsigned i = 0;
+    double sum = sumsq_blocked<O, true>(i, n, a, b);
+    for (; i < n; i++) {
+        const double d = (double)a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+template <class O> void sqdiff_f(double *out, const float *a, const float *b, unsigned n)
+{
+    unsigned i = 0;
+    for (; i + O::ND <= n; i += O::ND) { // products of floats are exact in double
+        typename O::vd va = O::loadfd(a + i), vb = O::loadfd(b + i);
+        O::stored(out + i, O::subd(O::muld(va, va), O::muld(vb, vb)));
+    }
+    for (; i < n; i++) {
+        out[i] = (double)a[i] * a[i] - (double)b[i] * b[i];
+    }
+}
+
+// 16-bit samples, their squares and the sums of squares are exact in double lanes
+template <class O> double sumsq_s16(const int16_t *x, unsigned n)
+{
+    typename O::vd s0 = O::zerod(), s1 = O::zerod();
+    unsigned i = 0;
+    for (; i + 2 * O::ND <= n; i += 2 * O::ND) {
+        typename O::vd a = O::loadsd(x + i), b = O::loadsd(x + i + O::ND);
+        s0 = O::fmad(a, a, s0);
+        s1 = O::fmad(b, b, s1);
+    }
+    double sum = O::hsumd(O::addd(s0, s1));
+    for (; i < n; i++) {
+        sum += x[i] * x[i];
+    }
+    return sum;
+}
+
+template <class O> double sqdist_s16(const int16_t *a, const int16_t *b, unsigned n)
+{
+    typename O::vd s0 = O::zerod(), s1 = O::zerod();
+    unsigned i = 0;
+    for (; i + 2 * O::ND <= n; i += 2 * O::ND) {
+        typename O::vd d0 = O::subd(O::loadsd(a + i), O::loadsd(b + i));
+        typename O::vd d1 = O::subd(O::loadsd(a + i + O::ND), O::loadsd(b + i + O::ND));
+        s0 = O::fmad(d0, d0, s0);
+        s1 = O::fmad(d1, d1, s1);
+    }
+    double sum = O::hsumd(O::addd(s0, s1));
+    for (; i < n; i++) {
+        const double d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+template <class O> void sqdiff_s16(double *out, const int16_t *a, const int16_t *b, unsigned n)
+{
+    unsigned i = 0;
+    for (; i + O::ND <= n; i += O::ND) {
+        typename O::vd va = O::loadsd(a + i), vb = O::loadsd(b + i);
+        O::stored(out + i, O::subd(O::muld(va, va), O::muld(vb, vb)));
+    }
+    for (; i < n; i++) {
+        out[i] = a[i] * a[i] - b[i] * b[i];
+    }
+}
+
+template <class O> unsigned find_le(const double *x, unsigned n, double limit)
+{
+    const typename O::vd lim = O::set1d(limit);
+    unsigned i = 0;
+    for (; i + 2 * O::ND <= n; i += 2 * O::ND) {
+        const unsigned mask = O::lemask(O::loadd(x + i), lim) | O::lemask(O::loadd(x + i + O::ND), lim) << O::ND;
+        if (mask) {
+            unsigned k = 0;
+            while (!(mask >> k & 1)) {
+                k++;
+            }
+            return i + k;
+        }
+    }
+    for (; i < n && !(x[i] <= limit); i++) {
+    }
+    return i;
+}
+} // namespace
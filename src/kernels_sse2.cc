@@ -0,0 +1,57 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#ifdef WAVALIGN_SSE2
+
+#include <emmintrin.h>
+
+#include "kernels_impl.h"
+
+namespace {
+struct Sse2 {
+    typedef __m128d vd;
+    typedef __m128 vf;
+    static const unsigned ND = 2, NF = 4;
+
+    static vd zerod() { return _mm_setzero_pd(); }
+    static vd set1d(double a) { return _mm_set1_pd(a); }
+    static vd loadd(const double *p) { return _mm_loadu_pd(p); }
+    static vd loadfd(const float *p) { return _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd((const double *)p))); }
+    static vd loadsd(const int16_t *p)
+    {
+        __m128i x = _mm_castps_si128(_mm_load_ss((const float *)p));
+        return _mm_cvtepi32_pd(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+    }
+    static void stored(double *p, vd a) { _mm_storeu_pd(p, a); }
+    static vd addd(vd a, vd b) { return _mm_add_pd(a, b); }
+    static vd subd(vd a, vd b) { return _mm_sub_pd(a, b); }
+    static vd muld(vd a, vd b) { return _mm_mul_pd(a, b); }
+    static vd fmad(vd a, vd b, vd c) { return _mm_add_pd(_mm_mul_pd(a, b), c); }
+    static double hsumd(vd a) { return _mm_cvtsd_f64(_mm_add_sd(a, _mm_unpackhi_pd(a, a))); }
+    static unsigned lemask(vd a, vd b) { return _mm_movemask_pd(_mm_cmple_pd(a, b)); }
+
+    static vf zerof() { return _mm_setzero_ps(); }
+    static vf loadf(const float *p) { return _mm_loadu_ps(p); }
+    static void storef(float *p, vf a) { _mm_storeu_ps(p, a); }
+    static vf addf(vf a, vf b) { return _mm_add_ps(a, b); }
+    static vf subf(vf a, vf b) { return _mm_sub_ps(a, b); }
+    static vf fmaf(vf a, vf b, vf c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+    static double hsumf(vf a) { return hsumd(_mm_add_pd(_mm_cvtps_pd(a), _mm_cvtps_pd(_mm_movehl_ps(a, a)))); }
+    static vf cmulc(vf a, vf b) // a * conj(b) for interleaved (re, im)
+    {
+        vf br = _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 2, 0, 0));
+        vf bi = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 3, 1, 1));
+        vf as = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+        vf t = _mm_xor_ps(_mm_mul_ps(as, bi), _mm_setr_ps(0.f, -0.f, 0.f, -0.f));
+        return _mm_add_ps(_mm_mul_ps(a, br), t);
+    }
+};
+} // namespace
+
+const Kernels kernels_sse2 = {CPU_SSE2, sumsq<Sse2>, sqdist<Sse2>, sqdiff<Sse2>, cmulc_acc<Sse2>, halfband<Sse2>,
+                              find_le<Sse2>, sumsq_f<Sse2>, sqdist_f<Sse2>, sqdiff_f<Sse2>, sumsq_s16<Sse2>,
+                              sqdist_s16<Sse2>, sqdiff_s16<Sse2>};
+
+#endif
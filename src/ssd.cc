@@ -4,43 +4,345 @@
  */
 
 #include "ssd.h"
+#include "fft.h"
+#include "kernels.h"
+#include "testsignal.h"
+#include "threads.h"
 #include "xcorr.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <memory>
+#include <new>
 
 #define SCOPE_ARRAY(type, name, len) \
     std::unique_ptr<type[]> name##_buf(new type[len]); \
     auto name = name##_buf.get();
 
-void ssd_x2(double *out[2],      // ncorr
-            const double *in[2], // ncorr + corr_len
-            unsigned channels, unsigned ncorr, unsigned corr_len)
+// Relative cost of one transform point against one direct multiply-add, see "direct" benchmark
+#define SSD_FFT_COST 2.0
+
+bool ssd_direct(unsigned nlags, unsigned corr_len, unsigned channels)
 {
-    SCOPE_ARRAY(kiss_fft_scalar, xcorr0, ncorr * channels)
-    SCOPE_ARRAY(kiss_fft_scalar, xcorr1, ncorr * channels)
-    kiss_fft_scalar *xcorr[2] = {xcorr0, xcorr1};
-    xcorr_x2(xcorr, in, ncorr * channels, corr_len * channels);
+    const unsigned partition = std::min(xcorr_partition(nlags, corr_len), corr_len);
+    const unsigned npart = (corr_len + partition - 1) / partition;
+    const double n = fft_backend()->fast_size(nlags + partition);
+    // per direction: forward transforms of the prefix and of the input for every channel and partition,
+    // one inverse transform
+    const double fft = (2. * channels * npart + 1) * n * log2(n);
+    return (double)nlags * corr_len * channels < SSD_FFT_COST * fft;
+}
 
-#define POW2(x) ((x) * (x))
-    const double *x0 = in[0], *x1 = in[1];
-    double en0 = 0, en1 = 0;
-    for (unsigned i = 0; i < corr_len * channels; i++) {
-        en0 += POW2(x0[i]);
-        en1 += POW2(x1[i]);
+template <class T>
+SsdSegments<T>::SsdSegments(const T *prefix[2], unsigned channels, unsigned corr_len, unsigned block,
+                            unsigned dirs, SsdEngine engine, AlignWorkspace *ws)
+    : channels_(channels), corr_len_(corr_len), block_(block), dirs_(dirs), scope_(ws)
+{
+    if (engine == SSD_DIRECT || (engine == SSD_AUTO && ssd_direct(block, corr_len, channels))) {
+        prefix_[0] = prefix[0];
+        prefix_[1] = prefix[1];
+        return;
+    }
+    xcorr_ = new (scope_.alloc<Xcorr>(1)) Xcorr(prefix, channels, corr_len, block, 0, dirs, scope_.workspace());
+    xc_ = scope_.alloc<kiss_fft_scalar>(2 * xcorr_->block());
+    d_ = scope_.alloc<double>(2 * xcorr_->block() * channels);
+    EN_[0] = sumsq(kernels(), prefix[0], corr_len * channels);
+    EN_[1] = sumsq(kernels(), prefix[1], corr_len * channels);
+}
+
+template <class T> SsdSegments<T>::~SsdSegments()
+{
+    if (xcorr_) { // releases xc_ and d_ as well, they were taken after it
+        xcorr_->~Xcorr();
+    }
+}
+
+template <class T> void SsdSegments<T>::direct(double *out, const T *x, const T *y, unsigned nlags)
+{
+    // the prefix is walked in chunks that stay in L1 while every lag of the block passes over them
+    const Kernels *k = kernels();
+    const unsigned n = corr_len_ * channels_, chunk = 2048;
+    std::fill(out, out + nlags, 0.);
+    for (unsigned j = 0; j < n; j += chunk) {
+        const unsigned len = std::min(chunk, n - j);
+        for (unsigned i = 0; i < nlags; i++) {
+            out[i] += sqdist(k, x + i * channels_ + j, y + j, len);
+        }
     }
+    for (unsigned i = 0; i < nlags; i++) {
+        out[i] *= SsdTraits<T>::scale();
+    }
+}
+
+// ssd[i] = (en_i + EN - xc[i]) * scale, en_i is the window energy at lag i, d holds its change per
+// sample. CH is the channel count known at compile time, 0 takes 'channels'.
+template <unsigned CH>
+static void ssd_running(double *ssd, const kiss_fft_scalar *xc, const double *d, double en, double EN, double scale,
+                        unsigned nlags, unsigned channels)
+{
+    const unsigned ch = CH ? CH : channels;
+    for (unsigned i = 0; i < nlags; i++) {
+        ssd[i] = (en + EN - xc[i]) * scale;
+        for (unsigned j = 0; j < ch; j++) {
+            en += d[i * ch + j];
+        }
+    }
+}
+
+template <class T> void SsdSegments<T>::run(double *out[2], const T *in[2], unsigned nlags)
+{
+    const unsigned n[2] = {dirs_ & 1 ? nlags : 0, dirs_ & 2 ? nlags : 0};
+    run(out, in, n);
+}
+
+template <class T> void SsdSegments<T>::run(double *out[2], const T *in[2], const unsigned nlags[2])
+{
+    assert(nlags[0] <= block() && nlags[1] <= block());
+    if (!xcorr_) {
+        for (unsigned dir = 0; dir < 2; dir++) {
+            direct(out[dir], in[dir], prefix_[1 - dir], nlags[dir]);
+        }
+        return;
+    }
+    kiss_fft_scalar *xcorr[2] = {xc_, xc_ + block()};
+    xcorr_->run(xcorr, in, nlags);
+
+    const Kernels *k = kernels();
+    const unsigned channels = channels_, corr_len = corr_len_;
+    for (unsigned dir = 0; dir < 2; dir++) {
+        if (!nlags[dir]) {
+            continue;
+        }
+        const T *x = in[dir];
+        double en = sumsq(k, x, corr_len * channels);
+
+        // energy change as the window slides by one frame
+        double *d = d_ + dir * block() * channels;
+        sqdiff(k, d, x + corr_len * channels, x, nlags[dir] * channels);
+
+        auto running = ssd_running<0>;
+        switch (channels) {
+            case 1:
+                running = ssd_running<1>;
+                break;
+            case 2:
+                running = ssd_running<2>;
+                break;
+            case 6:
+                running = ssd_running<6>;
+                break;
+            case 8:
+                running = ssd_running<8>;
+                break;
+        }
+        running(out[dir], xcorr[dir], d, en, EN_[1 - dir], SsdTraits<T>::scale(), nlags[dir], channels);
+    }
+}
+
+template class SsdSegments<double>;
+template class SsdSegments<float>;
+template class SsdSegments<int16_t>;
+
+template <class T>
+void ssd_x2(double *out[2], // ncorr
+            const T *in[2], // ncorr + corr_len
+            unsigned channels, unsigned ncorr, unsigned corr_len, AlignWorkspace *ws)
+{
+    SsdSegments<T> seg(in, channels, corr_len, xcorr_block(ncorr, corr_len), 3, SSD_AUTO, ws);
+    for (unsigned pos = 0; pos < ncorr; pos += seg.block()) {
+        double *dst[2] = {out[0] + pos, out[1] + pos};
+        const T *src[2] = {in[0] + pos * channels, in[1] + pos * channels};
+        seg.run(dst, src, std::min(seg.block(), ncorr - pos));
+    }
+}
+
+// blocks r, r + runs[dir], ... of one direction with transforms sized for its own lag range
+template <class T>
+static void ssd_run(unsigned run, const unsigned runs[2], SsdBlockFn fn, void *ctx, const T *in[2],
+                    unsigned channels, const unsigned ncorr[2], unsigned corr_len, AlignWorkspace *ws)
+{
+    const unsigned dir = run < runs[0] ? 0 : 1, first = dir ? run - runs[0] : run;
+    AlignScope scope(ws);
+    SsdSegments<T> seg(in, channels, corr_len, xcorr_block(ncorr[dir], corr_len), 1 << dir, SSD_AUTO,
+                       scope.workspace());
+    double *out = scope.alloc<double>(seg.block());
+    double *dst[2] = {out, out};
+    for (unsigned pos = first * seg.block(); pos < ncorr[dir]; pos += runs[dir] * seg.block()) {
+        const T *src[2] = {in[0] + pos * channels, in[1] + pos * channels};
+        unsigned nlags[2] = {0, 0};
+        nlags[dir] = std::min(seg.block(), ncorr[dir] - pos);
+        seg.run(dst, src, nlags);
+        fn(ctx, run, dir, pos, out, nlags[dir]);
+    }
+}
+
+template <class T>
+void ssd_blocks(const unsigned runs[2], SsdBlockFn fn, void *ctx, const T *in[2], unsigned channels,
+                const unsigned ncorr[2], unsigned corr_len, AlignWorkspace *ws)
+{
+    const unsigned count = runs[0] + runs[1];
+    if (thread_count() == 1 || count == 1) {
+        for (unsigned r = 0; r < count; r++) {
+            ssd_run(r, runs, fn, ctx, in, channels, ncorr, corr_len, ws);
+        }
+    } else {
+        AlignScope scope(ws);
+        AlignWorkspace **sub = scope.alloc<AlignWorkspace *>(count); // taken here, on the owning thread
+        for (unsigned r = 0; r < count; r++) {
+            sub[r] = scope.workspace()->worker(r);
+        }
+        parallel_for(count, [&](unsigned r) { ssd_run(r, runs, fn, ctx, in, channels, ncorr, corr_len, sub[r]); });
+    }
+}
 
-    double *ssd0 = out[0], *ssd1 = out[1];
-    double EN0 = en0, EN1 = en1;
+template <class T>
+void ssd_x2(double *out[2], const T *in[2], unsigned channels, const unsigned ncorr[2], unsigned corr_len,
+            AlignWorkspace *ws)
+{
+    unsigned runs[2];
+    xcorr_runs(runs, ncorr, corr_len);
+    auto copy = [](void *ctx, unsigned, unsigned dir, unsigned pos, const double *ssd, unsigned n) {
+        memcpy(static_cast<double **>(ctx)[dir] + pos, ssd, sizeof(double) * n);
+    };
+    ssd_blocks(runs, copy, out, in, channels, ncorr, corr_len, ws);
+}
+
+template void ssd_x2(double *[2], const double *[2], unsigned, unsigned, unsigned, AlignWorkspace *);
+template void ssd_x2(double *[2], const float *[2], unsigned, unsigned, unsigned, AlignWorkspace *);
+template void ssd_x2(double *[2], const int16_t *[2], unsigned, unsigned, unsigned, AlignWorkspace *);
+template void ssd_x2(double *[2], const double *[2], unsigned, const unsigned[2], unsigned, AlignWorkspace *);
+template void ssd_x2(double *[2], const float *[2], unsigned, const unsigned[2], unsigned, AlignWorkspace *);
+template void ssd_x2(double *[2], const int16_t *[2], unsigned, const unsigned[2], unsigned, AlignWorkspace *);
+template void ssd_blocks(const unsigned[2], SsdBlockFn, void *, const double *[2], unsigned, const unsigned[2],
+                         unsigned, AlignWorkspace *);
+template void ssd_blocks(const unsigned[2], SsdBlockFn, void *, const float *[2], unsigned, const unsigned[2],
+                         unsigned, AlignWorkspace *);
+template void ssd_blocks(const unsigned[2], SsdBlockFn, void *, const int16_t *[2], unsigned, const unsigned[2],
+                         unsigned, AlignWorkspace *);
+
+// both engines against the brute force SSD, for every direction mask
+template <class T>
+static bool test_ssd_segments(SsdEngine engine, unsigned channels, unsigned ncorr, unsigned corr_len, unsigned block)
+{
+    const unsigned len = (ncorr + corr_len) * channels;
+    const double scale = SsdTraits<T>::scale(), unit = scale < 1 ? 1000 : 1; // 16-bit samples near full scale
+    SCOPE_ARRAY(T, x_in, len)
+    SCOPE_ARRAY(T, y_in, len)
+    SCOPE_ARRAY(double, x, len)
+    SCOPE_ARRAY(double, y, len)
+    for (unsigned i = 0; i < len; i++) {
+        x_in[i] = (T)((i % 17 + 1) * unit);
+        y_in[i] = (T)((i * i % 23 + 1) * unit);
+        x[i] = x_in[i] * sqrt(scale);
+        y[i] = y_in[i] * sqrt(scale);
+    }
+    SCOPE_ARRAY(double, ssd0, ncorr)
+    SCOPE_ARRAY(double, ssd1, ncorr)
+    SCOPE_ARRAY(double, ssd2, ncorr)
+    SCOPE_ARRAY(double, ssd3, ncorr)
+    double en = 0;
+    for (unsigned i = 0; i < ncorr; i++) {
+        ssd2[i] = ssd3[i] = 0;
+        for (unsigned j = 0; j < corr_len * channels; j++) {
+            ssd2[i] += (x[i * channels + j] - y[j]) * (x[i * channels + j] - y[j]);
+            ssd3[i] += (y[i * channels + j] - x[j]) * (y[i * channels + j] - x[j]);
+            en += x[i * channels + j] * x[i * channels + j] + y[i * channels + j] * y[i * channels + j];
+        }
+    }
+
+    bool success = true;
+    // fixed-point transforms keep 30 bits of the largest bin, this input is dominated by DC
+    const double eps = std::max(scale, en / ncorr * (scale < 1 ? 1e-4 : 1e-6));
+    const T *in[2] = {x_in, y_in};
+    for (unsigned dirs = 1; dirs <= 3; dirs++) {
+        SsdSegments<T> seg(in, channels, corr_len, block, dirs, engine);
+        for (unsigned i = 0; i < ncorr; i++) {
+            ssd0[i] = ssd1[i] = -1;
+        }
+        for (unsigned pos = 0; pos < ncorr; pos += seg.block()) {
+            double *dst[2] = {ssd0 + pos, ssd1 + pos};
+            const T *src[2] = {x_in + pos * channels, y_in + pos * channels};
+            seg.run(dst, src, std::min(seg.block(), ncorr - pos));
+        }
+        for (unsigned i = 0; i < ncorr; i++) {
+            success &= dirs & 1 ? fabs(ssd0[i] - ssd2[i]) < eps : ssd0[i] == -1;
+            success &= dirs & 2 ? fabs(ssd1[i] - ssd3[i]) < eps : ssd1[i] == -1;
+            assert(success);
+        }
+    }
+    return success;
+}
+
+// float input against double input holding the same 16-bit samples on long windows: the transforms
+// are single precision either way, the energies and their running updates must not lose accuracy
+static bool test_ssd_precision()
+{
+    const unsigned channels = 2, ncorr = 1000, corr_len = 1 << 17, shift = 300, len = (ncorr + corr_len) * channels;
+    SCOPE_ARRAY(double, x, len + shift * channels)
+    SCOPE_ARRAY(float, y, len + shift * channels)
+    test_noise(x, ncorr + corr_len + shift, channels);
+    for (unsigned i = 0; i < len + shift * channels; i++) {
+        x[i] = y[i] = (float)(floor(x[i] * 32767) / 32768);
+    }
+    SCOPE_ARRAY(double, ssd0, ncorr)
+    SCOPE_ARRAY(double, ssd1, ncorr)
+    SCOPE_ARRAY(double, ssd2, ncorr)
+    SCOPE_ARRAY(double, ssd3, ncorr)
+    double *out_d[2] = {ssd0, ssd1}, *out_f[2] = {ssd2, ssd3};
+    const double *in_d[2] = {x + shift * channels, x};
+    const float *in_f[2] = {y + shift * channels, y};
+    ssd_x2(out_d, in_d, channels, ncorr, corr_len);
+    ssd_x2(out_f, in_f, channels, ncorr, corr_len);
+
+    const double eps = 1e-7 * (kernels()->sumsq(x, len) + kernels()->sumsq(x + shift * channels, len));
+    bool success = true;
     for (unsigned i = 0; i < ncorr; i++) {
-        ssd0[i] = en0 + EN1 - xcorr0[i * channels];
-        ssd1[i] = EN0 + en1 - xcorr1[i * channels];
-        for (unsigned j = 0; j < channels; j++) {
-            en0 += POW2(x0[(i + corr_len) * channels + j]) - POW2(x0[i * channels + j]);
-            en1 += POW2(x1[(i + corr_len) * channels + j]) - POW2(x1[i * channels + j]);
+        success &= fabs(ssd0[i] - ssd2[i]) < eps && fabs(ssd1[i] - ssd3[i]) < eps;
+        assert(success);
+    }
+    // the test signal is the reference delayed by 'shift': out[1] has the valley
+    success &= std::min_element(ssd1, ssd1 + ncorr) - ssd1 == std::min_element(ssd3, ssd3 + ncorr) - ssd3;
+    success &= std::min_element(ssd3, ssd3 + ncorr) - ssd3 == shift;
+    assert(success);
+    return success;
+}
+
+// per-direction lag ranges of several blocks on 1..4 threads: the same SSD for every lag
+static bool test_ssd_threads()
+{
+    const unsigned channels = 2, ncorr[2] = {150000, 200000}, corr_len = 2000, len = (200000 + corr_len) * channels;
+    const unsigned saved = thread_count();
+    SCOPE_ARRAY(float, x, len)
+    SCOPE_ARRAY(float, y, len)
+    for (unsigned i = 0; i < len; i++) {
+        x[i] = (float)(i % 17) / 17;
+        y[i] = (float)(i * i % 23) / 23;
+    }
+    SCOPE_ARRAY(double, ref, 2 * ncorr[1])
+    SCOPE_ARRAY(double, ssd, 2 * ncorr[1])
+    const float *in[2] = {x, y};
+    double *out[2] = {ref, ref + ncorr[1]};
+    thread_count(1);
+    ssd_x2(out, in, channels, ncorr, corr_len);
+    bool success = true;
+    for (unsigned threads = 2; threads <= 4; threads++) {
+        thread_count(threads);
+        out[0] = ssd;
+        out[1] = ssd + ncorr[1];
+        ssd_x2(out, in, channels, ncorr, corr_len);
+        for (unsigned i = 0; i < ncorr[0]; i++) {
+            success &= ssd[i] == ref[i];
+            assert(success);
+        }
+        for (unsigned i = 0; i < ncorr[1]; i++) {
+            success &= ssd[ncorr[1] + i] == ref[ncorr[1] + i];
+            assert(success);
         }
     }
+    thread_count(saved);
+    return success;
 }
 
 bool test_ssd_x2()
@@ -60,6 +362,7 @@ bool test_ssd_x2()
     const double *in[2] = {x, y};
     ssd_x2(out, in, 1, ncorr, corr_len);
 
+#define POW2(x) ((x) * (x))
     for (unsigned i = 0; i < ncorr; i++) {
         ssd2[i] = ssd3[i] = 0;
         for (unsigned j = 0; j < corr_len; j++) {
@@ -74,5 +377,28 @@ bool test_ssd_x2()
         success &= fabs(ssd1[i] - ssd3[i]) < 1;
         assert(success);
     }
+
+    // one direction only, the other one is left untouched
+    const unsigned nlags[2][2] = {{4, 0}, {0, ncorr}};
+    for (auto &n : nlags) {
+        for (unsigned i = 0; i < ncorr; i++) {
+            ssd0[i] = ssd1[i] = -1;
+        }
+        ssd_x2(out, in, 1, n, corr_len);
+        for (unsigned i = 0; i < ncorr; i++) {
+            success &= i < n[0] ? fabs(ssd0[i] - ssd2[i]) < 1 : ssd0[i] == -1;
+            success &= i < n[1] ? fabs(ssd1[i] - ssd3[i]) < 1 : ssd1[i] == -1;
+            assert(success);
+        }
+    }
+
+    static const SsdEngine engines[] = {SSD_FFT, SSD_DIRECT};
+    for (SsdEngine e : engines) {
+        success &= test_ssd_segments<double>(e, 1, 10, 6, 4) && test_ssd_segments<double>(e, 2, 100, 300, 32) &&
+                   test_ssd_segments<double>(e, 3, 70, 5000, 70);
+        success &= test_ssd_segments<int16_t>(e, 1, 10, 6, 4) && test_ssd_segments<int16_t>(e, 2, 100, 300, 32) &&
+                   test_ssd_segments<int16_t>(e, 3, 70, 5000, 70);
+    }
+    success &= test_ssd_precision() && test_ssd_threads();
     return success;
 }
@@ -5,7 +5,78 @@
 
 #pragma once
 
-void ssd_x2(double *out[2],      // ncorr
-            const double *in[2], // ncorr + corr_len
-            unsigned channels, unsigned ncorr, unsigned corr_len);
+#include "xcorr.h"
+#include "xcorr_fixed.h"
+
+// The input is double, float or int16_t (T), the output and the energies are double either way.
+// 16-bit samples are read as sample / 32768, so every input type gives the same SSD.
+template <class T>
+void ssd_x2(double *out[2], // ncorr
+            const T *in[2], // ncorr + corr_len
+            unsigned channels, unsigned ncorr, unsigned corr_len, AlignWorkspace *ws = NULL);
+template <class T>
+void ssd_x2(double *out[2], // ncorr[i]
+            const T *in[2], // ncorr[i] + corr_len
+            unsigned channels, const unsigned ncorr[2], unsigned corr_len, // 0 skips a direction
+            AlignWorkspace *ws = NULL);
 bool test_ssd_x2();
+
+// The second ssd_x2 block by block, the runs of xcorr_runs() spread over thread_count() threads.
+// fn(ctx, run, dir, pos, ssd, n) gets the SSD of lags [pos, pos + n) of one direction. Runs are
+// numbered from 0 to runs[0] + runs[1], the first direction first; the calls of a run are made in
+// order on one thread. Threaded runs take the worker workspaces of 'ws'.
+typedef void (*SsdBlockFn)(void *ctx, unsigned run, unsigned dir, unsigned pos, const double *ssd, unsigned n);
+template <class T>
+void ssd_blocks(const unsigned runs[2], SsdBlockFn fn, void *ctx, const T *in[2], unsigned channels,
+                const unsigned ncorr[2], unsigned corr_len, AlignWorkspace *ws = NULL);
+
+enum SsdEngine {
+    SSD_AUTO,   // ssd_direct() choice
+    SSD_FFT,    // XcorrSegments
+    SSD_DIRECT, // sum of (x - y)^2 for every lag, the prefix is read in place
+};
+
+// True if evaluating nlags lags one by one is estimated to be cheaper than correlation by FFT
+bool ssd_direct(unsigned nlags, unsigned corr_len, unsigned channels);
+
+// Correlator of SsdSegments<T> and the scale of its output: 16-bit samples are correlated in fixed
+// point, the energies and the correlation are in squared sample units until the output
+template <class T> struct SsdTraits {
+    typedef XcorrSegments Xcorr;
+    static double scale() { return 1; }
+};
+template <> struct SsdTraits<int16_t> {
+    typedef XcorrFixed Xcorr;
+    static double scale() { return 1. / (1 << 30); }
+};
+
+// ssd_x2 for lags [pos, pos + nlags), block by block, see XcorrSegments
+template <class T> // double, float or int16_t
+class SsdSegments
+{
+public:
+    SsdSegments(const T *prefix[2], // corr_len * channels
+                unsigned channels, unsigned corr_len, unsigned block,
+                unsigned dirs = 3, // bit i: out[i] is computed
+                SsdEngine engine = SSD_AUTO, AlignWorkspace *ws = NULL);
+    ~SsdSegments();
+    unsigned block() const { return xcorr_ ? xcorr_->block() : block_; }
+
+    void run(double *out[2], // nlags
+             const T *in[2], // (nlags + corr_len) * channels, starting at frame pos
+             unsigned nlags);
+    void run(double *out[2], const T *in[2],
+             const unsigned nlags[2]); // lags per direction, 0 skips it
+
+private:
+    const unsigned channels_, corr_len_, block_, dirs_;
+    AlignScope scope_;
+    typedef typename SsdTraits<T>::Xcorr Xcorr;
+    Xcorr *xcorr_ = NULL;          // in scope_, NULL for SSD_DIRECT
+    const T *prefix_[2];           // SSD_DIRECT only
+    double EN_[2];                 // prefix energies
+    kiss_fft_scalar *xc_ = NULL;   // 2 * block
+    double *d_ = NULL;             // 2 * block * channels
+
+    void direct(double *out, const T *x, const T *y, unsigned nlags);
+};
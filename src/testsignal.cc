@@ -0,0 +1,33 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "testsignal.h"
+
+#include <vector>
+
+namespace {
+// LCG step, white noise in [-1, 1]
+double white(unsigned &seed)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % 2001 / 1000. - 1;
+}
+} // namespace
+
+void test_noise(double *x, unsigned frames, unsigned channels, unsigned seed)
+{
+    std::vector<double> lp(channels, 0.);
+    for (unsigned i = 0; i < frames * channels; i++) {
+        x[i] = lp[i % channels] = 0.9 * lp[i % channels] + 0.1 * white(seed);
+    }
+}
+
+void test_delayed(double *y, const double *x, unsigned frames, unsigned channels, unsigned shift, double gain,
+                  double noise, unsigned seed)
+{
+    for (unsigned i = 0; i < frames * channels; i++) {
+        y[i] = (i < shift * channels ? 0 : gain * x[i - shift * channels]) + noise * white(seed);
+    }
+}
@@ -0,0 +1,18 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+//
+// Reproducible signals of the self-tests and the benchmark, the same for the same seed.
+//
+// test_noise(): low-passed white noise in (-1, 1), every channel of the interleaved frames filtered
+// separately, so that the SSD curve has one clear valley at the true offset.
+// test_delayed(): the reference delayed by 'shift' frames and scaled by 'gain', plus white noise of
+// 'noise' amplitude, white noise alone before the delayed signal starts.
+//
+void test_noise(double *x, unsigned frames, unsigned channels, unsigned seed = 1);
+void test_delayed(double *y, const double *x, unsigned frames, unsigned channels, unsigned shift, double gain,
+                  double noise, unsigned seed = 2);
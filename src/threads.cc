@@ -0,0 +1,189 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "threads.h"
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace {
+struct Job {
+    void (*fn)(void *ctx, unsigned i);
+    void *ctx;
+    unsigned count;
+    std::atomic<unsigned> next;
+    std::exception_ptr error; // the first one, under Pool::lock_
+};
+
+thread_local bool t_in_job = false;
+
+class Pool
+{
+public:
+    ~Pool() { resize(0); }
+
+    // 'workers' threads besides the caller, only with no job running
+    void resize(unsigned workers)
+    {
+        if (workers == threads_.size()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &t : threads_) {
+            t.join();
+        }
+        threads_.clear();
+        stop_ = false;
+        for (unsigned i = 0; i < workers; i++) {
+            threads_.emplace_back(&Pool::worker, this, generation_);
+        }
+    }
+
+    void run(Job *job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            job_ = job;
+            generation_++;
+            active_ = (unsigned)threads_.size();
+        }
+        wake_.notify_all();
+        work(job);
+        std::unique_lock<std::mutex> lock(lock_);
+        done_.wait(lock, [this] { return active_ == 0; });
+        job_ = NULL;
+    }
+
+private:
+    std::mutex lock_;
+    std::condition_variable wake_, done_;
+    std::vector<std::thread> threads_;
+    Job *job_ = NULL;
+    unsigned long long generation_ = 0;
+    unsigned active_ = 0;
+    bool stop_ = false;
+
+    void work(Job *job)
+    {
+        t_in_job = true;
+        for (unsigned i; (i = job->next++) < job->count;) {
+            try {
+                job->fn(job->ctx, i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(lock_);
+                if (!job->error) {
+                    job->error = std::current_exception();
+                }
+                job->next = job->count; // the rest are skipped
+            }
+        }
+        t_in_job = false;
+    }
+
+    void worker(unsigned long long seen)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        for (;;) {
+            wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+            if (stop_) {
+                return;
+            }
+            seen = generation_;
+            Job *job = job_;
+            lock.unlock();
+            work(job);
+            lock.lock();
+            if (--active_ == 0) {
+                done_.notify_one();
+            }
+        }
+    }
+};
+
+std::atomic<unsigned> g_threads(1);
+std::mutex g_busy; // one parallel_for() on the pool at a time
+Pool g_pool;
+} // namespace
+
+void thread_count(unsigned n)
+{
+    g_threads.store(n ? n : 1);
+}
+
+unsigned thread_count()
+{
+    return g_threads.load();
+}
+
+unsigned thread_count_max()
+{
+    const unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+void parallel_for(unsigned count, void (*fn)(void *ctx, unsigned i), void *ctx)
+{
+    const unsigned threads = thread_count();
+    std::unique_lock<std::mutex> busy(g_busy, std::defer_lock);
+    if (count < 2 || threads < 2 || t_in_job || !busy.try_lock()) {
+        for (unsigned i = 0; i < count; i++) {
+            fn(ctx, i);
+        }
+        return;
+    }
+    Job job;
+    job.fn = fn;
+    job.ctx = ctx;
+    job.count = count;
+    job.next = 0;
+    g_pool.resize(threads - 1);
+    g_pool.run(&job);
+    if (job.error) {
+        std::rethrow_exception(job.error);
+    }
+}
+
+bool test_threads()
+{
+    const unsigned saved = thread_count();
+    bool success = true;
+    for (unsigned threads : {1, 2, 5}) {
+        thread_count(threads);
+        for (unsigned count : {0, 1, 3, 100}) {
+            std::vector<unsigned> hits(count * count);
+            parallel_for(count, [&](unsigned i) {
+                parallel_for(count, [&](unsigned j) { hits[i * count + j]++; }); // nested: inline
+            });
+            for (unsigned h : hits) {
+                success &= h == 1;
+                assert(success);
+            }
+        }
+        bool thrown = false;
+        try {
+            parallel_for(10, [](unsigned i) {
+                if (i == 7) {
+                    throw std::runtime_error("test");
+                }
+            });
+        } catch (const std::runtime_error &) {
+            thrown = true;
+        }
+        success &= thrown;
+        assert(success);
+    }
+    thread_count(saved);
+    return success;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+//
+// Worker threads of the analysis path.
+//
+// parallel_for() runs fn(ctx, i) for every i < count on the calling thread and the pool workers,
+// and returns when all of them are done. Calls made from inside a job, or from another thread
+// while the pool is busy, run on the calling thread alone. Workers are started on first use.
+// An exception thrown by a job is rethrown to the caller once the others are finished.
+//
+void thread_count(unsigned n); // threads a parallel_for() may use, the caller included [default: 1]
+unsigned thread_count();
+unsigned thread_count_max(); // hardware threads
+
+void parallel_for(unsigned count, void (*fn)(void *ctx, unsigned i), void *ctx);
+
+template <class F> void parallel_for(unsigned count, const F &f) // f(i)
+{
+    parallel_for(count, [](void *ctx, unsigned i) { (*static_cast<const F *>(ctx))(i); }, (void *)&f);
+}
+
+bool test_threads();
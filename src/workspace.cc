@@ -0,0 +1,115 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "workspace.h"
+#include "aligned.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+
+#define ALIGN ALIGNED_BYTES
+
+AlignWorkspace::~AlignWorkspace()
+{
+    assert(used_ == 0 && overflow_.empty());
+    aligned_free(base_);
+}
+
+void AlignWorkspace::reserve(size_t bytes)
+{
+    assert(used_ == 0);
+    if (bytes <= capacity_) {
+        return;
+    }
+    aligned_free(base_);
+    base_ = NULL; // no dangling block if the allocation throws
+    capacity_ = 0;
+    base_ = static_cast<char *>(aligned_malloc(bytes));
+    capacity_ = bytes;
+    heap_allocs_++;
+}
+
+unsigned AlignWorkspace::heap_allocs() const
+{
+    unsigned n = heap_allocs_;
+    for (auto &w : workers_) {
+        n += w->heap_allocs();
+    }
+    return n;
+}
+
+AlignWorkspace *AlignWorkspace::worker(unsigned idx)
+{
+    while (workers_.size() <= idx) {
+        workers_.emplace_back(new AlignWorkspace);
+    }
+    return workers_[idx].get();
+}
+
+void *AlignWorkspace::alloc(size_t bytes)
+{
+    bytes = (bytes + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+    const size_t offset = used_;
+    used_ += bytes;
+    peak_ = std::max(peak_, used_);
+    if (used_ <= capacity_) {
+        return base_ + offset;
+    }
+    char *buf = static_cast<char *>(aligned_malloc(bytes));
+    overflow_.push_back(std::make_pair(offset, buf));
+    heap_allocs_++;
+    return buf;
+}
+
+void AlignWorkspace::release(size_t mark)
+{
+    assert(mark <= used_);
+    used_ = mark;
+    while (!overflow_.empty() && overflow_.back().first >= mark) {
+        aligned_free(overflow_.back().second);
+        overflow_.pop_back();
+    }
+    if (used_ == 0 && peak_ > capacity_) {
+        reserve(peak_);
+    }
+}
+
+bool test_workspace()
+{
+    AlignWorkspace ws;
+    bool success = true;
+    for (unsigned run = 0; run < 2; run++) {
+        AlignScope outer(&ws);
+        char *a = outer.alloc<char>(100);
+        {
+            AlignScope inner(&ws);
+            double *b = inner.alloc<double>(1000);
+            success &= (uintptr_t)a % ALIGN == 0 && (uintptr_t)b % ALIGN == 0 && (char *)b >= a + 100;
+            b[999] = 1;
+        }
+        char *c = outer.alloc<char>(10);
+        success &= run == 0 || c == a + ALIGN * 2; // inner buffers are back in the block
+        assert(success);
+    }
+    // the first run grew the block to the peak, the second one used it
+    success &= ws.capacity() == ws.peak() && ws.heap_allocs() == 4;
+    assert(success);
+
+    // worker workspaces persist and count with their owner
+    AlignWorkspace *w1 = ws.worker(1);
+    {
+        AlignScope scope(w1);
+        scope.alloc<char>(10);
+    }
+    success &= ws.worker(1) == w1 && ws.worker(0) != w1 && ws.heap_allocs() == 6; // overflow, regrown block
+    assert(success);
+
+    {
+        AlignScope scope(NULL); // private workspace
+        success &= scope.alloc<float>(10) != NULL;
+    }
+    return success;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+//
+// Scratch memory of the analysis path.
+//
+// Buffers are carved in stack order from one aligned block (see aligned.h) and go back when the AlignScope that took
+// them ends. A request that does not fit is served by a separate heap allocation, and once all
+// scopes are closed the block is regrown to the peak usage, so repeated runs with the same
+// geometry do not touch the heap. Not thread-safe: threaded jobs take the worker workspaces.
+//
+class AlignWorkspace
+{
+public:
+    AlignWorkspace() {}
+    ~AlignWorkspace();
+
+    void reserve(size_t bytes); // only with no open scopes
+    size_t capacity() const { return capacity_; }
+    size_t peak() const { return peak_; }                // max bytes in use so far
+    unsigned heap_allocs() const;                         // block and overflow allocations so far, workers' too
+
+    // Workspace of the parallel job 'idx', kept with this one for the next parallel runs.
+    // Only from the thread owning this workspace, before the jobs start.
+    AlignWorkspace *worker(unsigned idx);
+
+private:
+    friend class AlignScope;
+    char *base_ = NULL;
+    size_t capacity_ = 0, used_ = 0, peak_ = 0;
+    unsigned heap_allocs_ = 0;
+    std::vector<std::pair<size_t, char *>> overflow_; // offset, buffer
+    std::vector<std::unique_ptr<AlignWorkspace>> workers_;
+
+    void *alloc(size_t bytes);
+    void release(size_t mark);
+
+    AlignWorkspace(const AlignWorkspace &) = delete;
+    AlignWorkspace &operator=(const AlignWorkspace &) = delete;
+};
+
+// Buffers taken from a workspace (a private one if NULL), released at the end of the scope
+class AlignScope
+{
+public:
+    explicit AlignScope(AlignWorkspace *ws) : ws_(ws ? *ws : own_), mark_(ws_.used_) {}
+    ~AlignScope() { ws_.release(mark_); }
+
+    template <class T> T *alloc(size_t n) { return static_cast<T *>(ws_.alloc(n * sizeof(T))); } // uninitialized
+    AlignWorkspace *workspace() const { return &ws_; }
+
+private:
+    AlignWorkspace own_;
+    AlignWorkspace &ws_;
+    const size_t mark_;
+
+    AlignScope(const AlignScope &) = delete;
+    AlignScope &operator=(const AlignScope &) = delete;
+};
+
+bool test_workspace();
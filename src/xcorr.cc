@@ -4,68 +4,208 @@
  */
 
 #include "xcorr.h"
-
-#include <_kiss_fft_guts.h>
-#include <kiss_fftr.h>
+#include "fft.h"
+#include "kernels.h"
+#include "threads.h"
 
 #include <cassert>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <memory>
 
 #define SCOPE_ARRAY(type, name, len) \
     std::unique_ptr<type[]> name##_buf(new type[len]); \
     auto name = name##_buf.get();
 
-void xcorr_x2(kiss_fft_scalar *out[2], // ncorr
-              const double *in[2],     // ncorr + corr_len
-              unsigned ncorr, unsigned corr_len)
+#define XCORR_MIN_BLOCK (1 << 16)
+
+unsigned xcorr_block(unsigned ncorr, unsigned corr_len)
+{
+    const unsigned block = std::max(2 * corr_len, (unsigned)XCORR_MIN_BLOCK);
+    return ncorr > 2 * block ? block : ncorr;
+}
+
+unsigned xcorr_fft_size(unsigned ncorr, unsigned corr_len)
+{
+    const unsigned block = xcorr_block(ncorr, corr_len);
+    return fft_backend()->fast_size(block + xcorr_partition(block, corr_len));
+}
+
+void xcorr_runs(unsigned runs[2], const unsigned ncorr[2], unsigned corr_len)
+{
+    unsigned blocks[2];
+    for (unsigned i = 0; i < 2; i++) {
+        const unsigned block = ncorr[i] ? xcorr_block(ncorr[i], corr_len) : 1;
+        blocks[i] = (ncorr[i] + block - 1) / block;
+    }
+    // threads are shared in proportion to the blocks, every non-empty direction gets one
+    const unsigned threads = thread_count(), total = blocks[0] + blocks[1];
+    for (unsigned i = 0; i < 2; i++) {
+        const unsigned share = total ? (unsigned)((unsigned long long)threads * blocks[i] / total) : 0;
+        runs[i] = std::min(blocks[i], std::max(share, blocks[i] ? 1u : 0u));
+    }
+}
+
+#define XCORR_PARTITION_RATIO 2
+#define XCORR_MIN_PARTITION (1 << 12)
+
+unsigned xcorr_partition(unsigned block, unsigned corr_len)
+{
+    const unsigned partition = std::max(4 * block, (unsigned)XCORR_MIN_PARTITION);
+    if (corr_len <= XCORR_PARTITION_RATIO * partition) {
+        return corr_len;
+    }
+    const unsigned npart = (corr_len + partition - 1) / partition;
+    return (corr_len + npart - 1) / npart; // equal partitions
+}
+
+template <class T>
+XcorrSegments::XcorrSegments(const T *prefix[2], unsigned channels, unsigned corr_len, unsigned block,
+                             unsigned partition, unsigned dirs, AlignWorkspace *ws)
+    : channels_(channels), corr_len_(corr_len),
+      partition_(std::min(partition ? partition : xcorr_partition(block, corr_len), corr_len)),
+      npart_((corr_len + partition_ - 1) / partition_), fftr_size_(fft_backend()->fast_size(block + partition_)),
+      freq_len_(fftr_size_ / 2 + 1), block_(fftr_size_ - partition_), dirs_(dirs), fwd_(fftr_size_, false),
+      inv_(fftr_size_, true), scope_(ws), time_(scope_.alloc<kiss_fft_scalar>(2 * fftr_size_)),
+      prefix_(scope_.alloc<kiss_fft_cpx>(channels * npart_ * 2 * freq_len_)),
+      freq_(scope_.alloc<kiss_fft_cpx>(4 * freq_len_))
 {
-    unsigned fftr_size = 4;
-    while (ncorr + corr_len > fftr_size) {
-        fftr_size <<= 1;
-    }
-    kiss_fftr_cfg fftr_cfg_fwd = kiss_fftr_alloc(fftr_size, 0, NULL, NULL);
-    kiss_fftr_cfg fftr_cfg_inv = kiss_fftr_alloc(fftr_size, 1, NULL, NULL);
-    SCOPE_ARRAY(kiss_fft_scalar, x, fftr_size)
-    SCOPE_ARRAY(kiss_fft_scalar, y, fftr_size)
-    SCOPE_ARRAY(kiss_fft_scalar, z, fftr_size)
-
-    unsigned freq_len = fftr_size / 2 + 1;
-    SCOPE_ARRAY(kiss_fft_cpx, X, freq_len)
-    SCOPE_ARRAY(kiss_fft_cpx, Y, freq_len)
-    SCOPE_ARRAY(kiss_fft_cpx, Z, freq_len)
-    for (auto i = 0; i < 2; i++) {
-        const double *left = in[i], *right = in[(i + 1) & 0x1];
-        for (unsigned j = 0; j < corr_len + ncorr; j++) {
-            x[j] = (kiss_fft_scalar)left[j];
+    const T *other[2] = {prefix[1], prefix[0]}; // out[i] correlates in[i] with the other prefix
+    for (unsigned ch = 0; ch < channels; ch++) {
+        for (unsigned p = 0; p < npart_; p++) {
+            const unsigned pos = p * partition_, len = std::min(partition_, corr_len - pos);
+            const unsigned frames[2] = {dirs & 1 ? len : 0, dirs & 2 ? len : 0};
+            forward(other, frames, ch, pos, &prefix_[(ch * npart_ + p) * 2 * freq_len_]);
         }
-        for (unsigned j = 0; j < corr_len; j++) {
-            y[j] = (kiss_fft_scalar)right[j];
+    }
+}
+
+// spectra of in[i][offset, offset + frames[i]) of one channel, zero-padded, to freq[i * freq_len]
+template <class T>
+void XcorrSegments::forward(const T *in[2], const unsigned frames[2], unsigned ch, unsigned offset,
+                            kiss_fft_cpx *freq)
+{
+    const kiss_fft_scalar *time[2];
+    kiss_fft_cpx *spec[2];
+    unsigned count = 0;
+    for (unsigned i = 0; i < 2; i++) {
+        if (!frames[i]) {
+            continue;
         }
-        memset(x + corr_len + ncorr, 0, sizeof(kiss_fft_scalar) * (fftr_size - corr_len - ncorr));
-        memset(y + corr_len, 0, sizeof(kiss_fft_scalar) * (fftr_size - corr_len));
-        kiss_fftr(fftr_cfg_fwd, x, X);
-        kiss_fftr(fftr_cfg_fwd, y, Y);
-        const float fac = 1.f / (fftr_size / 2);
-        for (unsigned j = 0; j < freq_len; j++) {
-            Y[j].i = -Y[j].i;
-            C_MUL(Z[j], X[j], Y[j]);
-            C_MULBYSCALAR(Z[j], fac); // scale to 2*(x,y)
+        kiss_fft_scalar *t = time_ + i * fftr_size_;
+        const T *src = in[i] + offset * channels_ + ch;
+        for (unsigned j = 0; j < frames[i]; j++) {
+            t[j] = (kiss_fft_scalar)src[j * channels_];
         }
-        kiss_fftri(fftr_cfg_inv, Z, z); // xcorr(A,B)[k]=sum A[i+k]B[i]
-        memcpy(out[i], z, sizeof(kiss_fft_scalar) * ncorr);
+        memset(t + frames[i], 0, sizeof(kiss_fft_scalar) * (fftr_size_ - frames[i]));
+        time[count] = t;
+        spec[count++] = freq + i * freq_len_;
+    }
+    if (count) {
+        fwd_.forward(time, spec, count);
     }
-    free(fftr_cfg_fwd);
-    free(fftr_cfg_inv);
 }
 
-bool test_xcorr_x2()
+template <class T> void XcorrSegments::run(kiss_fft_scalar *out[2], const T *in[2], unsigned nlags)
+{
+    const unsigned n[2] = {dirs_ & 1 ? nlags : 0, dirs_ & 2 ? nlags : 0};
+    run(out, in, n);
+}
+
+template <class T> void XcorrSegments::run(kiss_fft_scalar *out[2], const T *in[2], const unsigned nlags[2])
 {
-    const unsigned ncorr = 10, corr_len = 6;
-    SCOPE_ARRAY(double, x, ncorr + corr_len)
-    SCOPE_ARRAY(double, y, ncorr + corr_len)
-    for (unsigned i = 0; i < ncorr + corr_len; i++) {
-        x[i] = i + 1;
-        y[i] = i * i + 1;
+    assert(nlags[0] <= block_ && nlags[1] <= block_);
+    assert((!nlags[0] || (dirs_ & 1)) && (!nlags[1] || (dirs_ & 2)));
+    kiss_fft_cpx *W = freq_, *Z = W + 2 * freq_len_;
+
+    memset(Z, 0, sizeof(kiss_fft_cpx) * 2 * freq_len_);
+    // frame-aligned lags only: correlate channels and partitions separately and sum cross-spectra
+    for (unsigned ch = 0; ch < channels_; ch++) {
+        for (unsigned p = 0; p < npart_; p++) {
+            const unsigned pos = p * partition_, len = std::min(partition_, corr_len_ - pos);
+            const unsigned frames[2] = {nlags[0] ? nlags[0] + len : 0, nlags[1] ? nlags[1] + len : 0};
+            const kiss_fft_cpx *P = &prefix_[(ch * npart_ + p) * 2 * freq_len_];
+            forward(in, frames, ch, pos, W);
+            for (unsigned i = 0; i < 2; i++) {
+                if (nlags[i]) {
+                    kernels()->cmulc_acc(Z + i * freq_len_, W + i * freq_len_, P + i * freq_len_, freq_len_);
+                }
+            }
+        }
+    }
+    const kiss_fft_cpx *spec[2];
+    kiss_fft_scalar *time[2];
+    unsigned count = 0;
+    for (unsigned i = 0; i < 2; i++) {
+        if (nlags[i]) {
+            spec[count] = Z + i * freq_len_;
+            time[count++] = time_ + i * fftr_size_;
+        }
+    }
+    if (count) {
+        inv_.inverse(spec, time, count); // xcorr(A,B)[k]=sum A[i+k]B[i], no wrap-around for k < nlags
+    }
+    const float fac = 1.f / (fftr_size_ / 2); // scale to 2*(x,y)
+    for (unsigned i = 0; i < 2; i++) {
+        const kiss_fft_scalar *z = time_ + i * fftr_size_;
+        for (unsigned k = 0; k < nlags[i]; k++) {
+            out[i][k] = z[k] * fac;
+        }
+    }
+}
+
+template XcorrSegments::XcorrSegments(const double *[2], unsigned, unsigned, unsigned, unsigned, unsigned,
+                                      AlignWorkspace *);
+template XcorrSegments::XcorrSegments(const float *[2], unsigned, unsigned, unsigned, unsigned, unsigned,
+                                      AlignWorkspace *);
+template void XcorrSegments::run(kiss_fft_scalar *[2], const double *[2], unsigned);
+template void XcorrSegments::run(kiss_fft_scalar *[2], const float *[2], unsigned);
+template void XcorrSegments::run(kiss_fft_scalar *[2], const double *[2], const unsigned[2]);
+template void XcorrSegments::run(kiss_fft_scalar *[2], const float *[2], const unsigned[2]);
+
+void xcorr_x2(kiss_fft_scalar *out[2], // ncorr
+              const double *in[2],     // (ncorr + corr_len) * channels
+              unsigned channels, unsigned ncorr, unsigned corr_len, AlignWorkspace *ws)
+{
+    if (thread_count() == 1) { // both directions share the transforms
+        XcorrSegments seg(in, channels, corr_len, xcorr_block(ncorr, corr_len), 0, 3, ws);
+        for (unsigned pos = 0; pos < ncorr; pos += seg.block()) {
+            kiss_fft_scalar *dst[2] = {out[0] + pos, out[1] + pos};
+            const double *src[2] = {in[0] + pos * channels, in[1] + pos * channels};
+            seg.run(dst, src, std::min(seg.block(), ncorr - pos));
+        }
+        return;
+    }
+    const unsigned n[2] = {ncorr, ncorr};
+    unsigned runs[2];
+    xcorr_runs(runs, n, corr_len);
+    AlignScope scope(ws);
+    AlignWorkspace **sub = scope.alloc<AlignWorkspace *>(runs[0] + runs[1]); // taken here, on the owning thread
+    for (unsigned r = 0; r < runs[0] + runs[1]; r++) {
+        sub[r] = scope.workspace()->worker(r);
+    }
+    parallel_for(runs[0] + runs[1], [&](unsigned r) {
+        const unsigned dir = r < runs[0] ? 0 : 1, first = dir ? r - runs[0] : r;
+        XcorrSegments seg(in, channels, corr_len, xcorr_block(ncorr, corr_len), 0, 1 << dir, sub[r]);
+        for (unsigned pos = first * seg.block(); pos < ncorr; pos += runs[dir] * seg.block()) {
+            kiss_fft_scalar *dst[2] = {out[0] + pos, out[1] + pos};
+            const double *src[2] = {in[0] + pos * channels, in[1] + pos * channels};
+            unsigned nlags[2] = {0, 0};
+            nlags[dir] = std::min(seg.block(), ncorr - pos);
+            seg.run(dst, src, nlags);
+        }
+    });
+}
+
+static bool test_xcorr_x2(unsigned channels, unsigned ncorr, unsigned corr_len, unsigned block = 0,
+                          unsigned partition = 0)
+{
+    SCOPE_ARRAY(double, x, (ncorr + corr_len) * channels)
+    SCOPE_ARRAY(double, y, (ncorr + corr_len) * channels)
+    for (unsigned i = 0; i < (ncorr + corr_len) * channels; i++) {
+        x[i] = i % 17 + 1;
+        y[i] = i * i % 23 + 1;
     }
     SCOPE_ARRAY(kiss_fft_scalar, xcorr0, ncorr)
     SCOPE_ARRAY(kiss_fft_scalar, xcorr1, ncorr)
@@ -73,21 +213,71 @@ bool test_xcorr_x2()
     SCOPE_ARRAY(double, xcorr3, ncorr)
     kiss_fft_scalar *out[2] = {xcorr0, xcorr1};
     const double *in[2] = {x, y};
-    xcorr_x2(out, in, ncorr, corr_len);
+    if (!block) {
+        xcorr_x2(out, in, channels, ncorr, corr_len);
+    } else {
+        XcorrSegments seg(in, channels, corr_len, block, partition);
+        for (unsigned pos = 0; pos < ncorr; pos += block) {
+            kiss_fft_scalar *dst[2] = {xcorr0 + pos, xcorr1 + pos};
+            const double *src[2] = {x + pos * channels, y + pos * channels};
+            seg.run(dst, src, std::min(block, ncorr - pos));
+        }
+    }
 
+    double en = 0;
     for (unsigned i = 0; i < ncorr; i++) {
         xcorr2[i] = xcorr3[i] = 0;
-        for (unsigned j = 0; j < corr_len; j++) {
-            xcorr2[i] += 2 * x[i + j] * y[j];
-            xcorr3[i] += 2 * y[i + j] * x[j];
+        for (unsigned j = 0; j < corr_len * channels; j++) {
+            xcorr2[i] += 2 * x[i * channels + j] * y[j];
+            xcorr3[i] += 2 * y[i * channels + j] * x[j];
         }
+        en = std::max(en, std::max(xcorr2[i], xcorr3[i]));
     }
 
     bool success = true;
+    const double eps = std::max(1., en * 1e-6);
     for (unsigned i = 0; i < ncorr; i++) {
-        success &= fabs(xcorr0[i] - xcorr2[i]) < 1;
-        success &= fabs(xcorr1[i] - xcorr3[i]) < 1;
+        success &= fabs(xcorr0[i] - xcorr2[i]) < eps;
+        success &= fabs(xcorr1[i] - xcorr3[i]) < eps;
         assert(success);
     }
     return success;
 }
+
+// the same lags on 1..4 threads, several blocks per direction
+static bool test_xcorr_x2_threads()
+{
+    const unsigned channels = 2, ncorr = 200000, corr_len = 1000, len = (ncorr + corr_len) * channels;
+    const unsigned saved = thread_count();
+    SCOPE_ARRAY(double, x, len)
+    SCOPE_ARRAY(double, y, len)
+    for (unsigned i = 0; i < len; i++) {
+        x[i] = i % 17 / 17. - .5;
+        y[i] = i * i % 23 / 23. - .5;
+    }
+    SCOPE_ARRAY(kiss_fft_scalar, ref, 2 * ncorr)
+    SCOPE_ARRAY(kiss_fft_scalar, xcorr, 2 * ncorr)
+    const double *in[2] = {x, y};
+    kiss_fft_scalar *out[2] = {ref, ref + ncorr};
+    thread_count(2);
+    xcorr_x2(out, in, channels, ncorr, corr_len);
+    bool success = true;
+    for (unsigned threads = 1; threads <= 4; threads++) {
+        thread_count(threads);
+        out[0] = xcorr;
+        out[1] = xcorr + ncorr;
+        xcorr_x2(out, in, channels, ncorr, corr_len);
+        for (unsigned i = 0; i < 2 * ncorr; i++) { // one thread runs the directions in one batch
+            success &= threads == 1 ? fabs(xcorr[i] - ref[i]) < 1e-5 * corr_len * channels : xcorr[i] == ref[i];
+            assert(success);
+        }
+    }
+    thread_count(saved);
+    return success;
+}
+
+bool test_xcorr_x2()
+{
+    return test_xcorr_x2(1, 10, 6) && test_xcorr_x2(3, 10, 6) && test_xcorr_x2(2, 1000, 300) &&
+           test_xcorr_x2(2, 1000, 300, 70) && test_xcorr_x2(2, 100, 1000, 100, 64) && test_xcorr_x2_threads();
+}
@@ -5,8 +5,81 @@
 
 #pragma once
 
+#include "fft.h"
+#include "workspace.h"
+
+// Lags per overlap-save block: ncorr if one transform is cheaper, otherwise a block size that
+// depends on corr_len only
+unsigned xcorr_block(unsigned ncorr, unsigned corr_len);
+
+// Transform size xcorr_x2 runs with (the backend fast size for one block)
+unsigned xcorr_fft_size(unsigned ncorr, unsigned corr_len);
+
+// Split of lags [0, ncorr[i]) of both directions for thread_count() threads: runs[i] runs of whole
+// blocks, run r takes blocks r, r + runs[i], ... Every run sets up its own correlator, a lag gets
+// the same value for any split. At most one run per block, 0 for an empty direction.
+void xcorr_runs(unsigned runs[2], const unsigned ncorr[2], unsigned corr_len);
+
+// Frame-aligned cross-correlation of interleaved signals, summed over channels:
+//   out[0][k] = 2 * sum(in[0][k * channels + j] * in[1][j]), j < corr_len * channels
+//   out[1][k] = 2 * sum(in[1][k * channels + j] * in[0][j])
+// The directions and blocks are spread over thread_count() threads (xcorr_runs), threaded runs
+// take the worker workspaces of 'ws'.
 void xcorr_x2(kiss_fft_scalar *out[2], // ncorr
-              const double *in[2],     // ncorr + corr_len
-              unsigned ncorr, unsigned corr_len);
+              const double *in[2],     // (ncorr + corr_len) * channels
+              unsigned channels, unsigned ncorr, unsigned corr_len, AlignWorkspace *ws = NULL);
 
 bool test_xcorr_x2();
+
+// Partition length for a uniformly partitioned correlation: corr_len if it is comparable with
+// the block, otherwise about four blocks, so the transform size does not depend on corr_len
+unsigned xcorr_partition(unsigned block, unsigned corr_len);
+
+// Overlap-save xcorr_x2 for lags [pos, pos + nlags), block by block. The transform size depends
+// on the block and the partition length only: corr_len is split into equal partitions (the last
+// one may be shorter) correlated separately, their cross-spectra are summed before the inverse
+// transform. The spectra of the prefix partitions are computed once.
+// Only the directions in 'dirs' are prepared (bit i for out[i]), run() may skip any of them.
+// The input is double or float (T), the transforms run in kiss_fft_scalar either way.
+class XcorrSegments
+{
+public:
+    template <class T>
+    XcorrSegments(const T *prefix[2], // corr_len * channels
+                  unsigned channels, unsigned corr_len, unsigned block,
+                  unsigned partition = 0, // [default: xcorr_partition()]
+                  unsigned dirs = 3, AlignWorkspace *ws = NULL);
+    unsigned block() const { return block_; } // max nlags, at least the requested block
+
+    template <class T>
+    void run(kiss_fft_scalar *out[2], // nlags
+             const T *in[2],          // (nlags + corr_len) * channels, starting at frame pos
+             unsigned nlags);
+    template <class T>
+    void run(kiss_fft_scalar *out[2], const T *in[2],
+             const unsigned nlags[2]); // lags per direction, 0 skips it
+
+private:
+    const unsigned channels_, corr_len_, partition_, npart_, fftr_size_, freq_len_, block_, dirs_;
+    RfftPlan fwd_, inv_;
+    AlignScope scope_;
+    kiss_fft_scalar *const time_; // 2 * fftr_size
+    kiss_fft_cpx *const prefix_;  // channels * npart * 2 * freq_len: per partition Yp, Xp
+    kiss_fft_cpx *const freq_;    // 4 * freq_len: X, Y, Z0, Z1
+
+    template <class T>
+    void forward(const T *in[2], const unsigned frames[2], unsigned ch, unsigned offset, kiss_fft_cpx *freq);
+};
+
+// Independent mono correlations of the same geometry:
+//   out[k] = 2 * sum(x[(k + j) * stride] * y[j * stride]), j < corr_len
+// Built with kissfft_simd, every four of them share one transform (SSE lanes). Use it to run
+// both directions, separate channels (sum the outputs) or several test files at once.
+struct XcorrJob {
+    float *out;      // ncorr
+    const double *x; // ncorr + corr_len
+    const double *y; // corr_len
+    unsigned stride;
+};
+void xcorr_batch(const XcorrJob *jobs, unsigned count, unsigned ncorr, unsigned corr_len);
+bool test_xcorr_batch();
@@ -0,0 +1,129 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "fftplan.h"
+#include "xcorr.h"
+
+#ifdef KISSFFT_SIMD
+#include <kiss_fft_simd.h> // kissfft names below refer to the SSE build
+#define BATCH 4
+#else
+#include "fft.h"
+#define BATCH 1
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <memory>
+
+#define SCOPE_ARRAY(type, name, len) \
+    std::unique_ptr<type[]> name##_buf(new type[len]); \
+    auto name = name##_buf.get();
+
+namespace {
+#ifdef KISSFFT_SIMD
+void *fftr_simd_alloc(unsigned nfft, bool inverse)
+{
+    return kiss_fftr_alloc(nfft, inverse, NULL, NULL);
+}
+void fftr_simd_free(void *cfg)
+{
+    kiss_fftr_free(cfg);
+}
+const FftPlanType fftr_simd_plan_type = {fftr_simd_alloc, fftr_simd_free};
+
+class BatchPlan : FftPlanBase
+{
+public:
+    BatchPlan(unsigned nfft, bool inverse) : FftPlanBase(&fftr_simd_plan_type, nfft, inverse) {}
+    void forward(const kiss_fft_scalar *in, kiss_fft_cpx *out) const { kiss_fftr((kiss_fftr_cfg)cfg_, in, out); }
+    void inverse(const kiss_fft_cpx *in, kiss_fft_scalar *out) const { kiss_fftri((kiss_fftr_cfg)cfg_, in, out); }
+};
+unsigned batch_fast_size(unsigned n)
+{
+    return kiss_fftr_next_fast_size_real(n);
+}
+#else
+typedef RfftPlan BatchPlan;
+unsigned batch_fast_size(unsigned n)
+{
+    return fft_backend()->fast_size(n);
+}
+#endif
+} // namespace
+
+void xcorr_batch(const XcorrJob *jobs, unsigned count, unsigned ncorr, unsigned corr_len)
+{
+    unsigned fftr_size = batch_fast_size(ncorr + corr_len);
+    BatchPlan fftr_cfg_fwd(fftr_size, false);
+    BatchPlan fftr_cfg_inv(fftr_size, true);
+    SCOPE_ARRAY(float, xs, fftr_size * BATCH) // lane l of sample j is at [j * BATCH + l]
+    SCOPE_ARRAY(float, ys, fftr_size * BATCH)
+    SCOPE_ARRAY(float, zs, fftr_size * BATCH)
+    kiss_fft_scalar *x = (kiss_fft_scalar *)xs, *y = (kiss_fft_scalar *)ys, *z = (kiss_fft_scalar *)zs;
+
+    unsigned freq_len = fftr_size / 2 + 1;
+    SCOPE_ARRAY(kiss_fft_cpx, X, freq_len)
+    SCOPE_ARRAY(kiss_fft_cpx, Y, freq_len)
+    const float fac = 2.f / fftr_size; // scale to 2*(x,y)
+    for (unsigned g = 0; g < count; g += BATCH) {
+        const unsigned lanes = std::min(count - g, (unsigned)BATCH);
+        memset(xs, 0, sizeof(float) * fftr_size * BATCH);
+        memset(ys, 0, sizeof(float) * fftr_size * BATCH);
+        for (unsigned l = 0; l < lanes; l++) {
+            const XcorrJob &job = jobs[g + l];
+            for (unsigned j = 0; j < corr_len + ncorr; j++) {
+                xs[j * BATCH + l] = (float)job.x[j * job.stride];
+            }
+            for (unsigned j = 0; j < corr_len; j++) {
+                ys[j * BATCH + l] = (float)job.y[j * job.stride];
+            }
+        }
+        fftr_cfg_fwd.forward(x, X);
+        fftr_cfg_fwd.forward(y, Y);
+        for (unsigned k = 0; k < freq_len; k++) { // X * conj(Y)
+            const kiss_fft_cpx a = X[k], b = Y[k];
+            X[k].r = a.r * b.r + a.i * b.i;
+            X[k].i = a.i * b.r - a.r * b.i;
+        }
+        fftr_cfg_inv.inverse(X, z);
+        for (unsigned l = 0; l < lanes; l++) {
+            float *out = jobs[g + l].out;
+            for (unsigned k = 0; k < ncorr; k++) {
+                out[k] = zs[k * BATCH + l] * fac;
+            }
+        }
+    }
+}
+
+bool test_xcorr_batch()
+{
+    const unsigned ncorr = 40, corr_len = 25, stride = 2, count = 5;
+    SCOPE_ARRAY(double, x, (ncorr + corr_len) * stride * count)
+    SCOPE_ARRAY(float, xcorr, ncorr * count)
+    for (unsigned i = 0; i < (ncorr + corr_len) * stride * count; i++) {
+        x[i] = i * i % 23 + 1.;
+    }
+    XcorrJob jobs[count];
+    for (unsigned n = 0; n < count; n++) { // correlate each window with the next one
+        const double *w = x + (ncorr + corr_len) * stride * n;
+        jobs[n] = XcorrJob{xcorr + ncorr * n, w, w + (n + 1 < count ? (ncorr + corr_len) * stride : 1), stride};
+    }
+    xcorr_batch(jobs, count, ncorr, corr_len);
+
+    bool success = true;
+    for (unsigned n = 0; n < count; n++) {
+        for (unsigned i = 0; i < ncorr; i++) {
+            double ref = 0;
+            for (unsigned j = 0; j < corr_len; j++) {
+                ref += 2 * jobs[n].x[(i + j) * stride] * jobs[n].y[j * stride];
+            }
+            success &= fabs(jobs[n].out[i] - ref) < std::max(1., ref * 1e-6);
+            assert(success);
+        }
+    }
+    return success;
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "xcorr_fixed.h"
+#include "xcorr.h"
+
+#include <kiss_fft_fixed.h> // kissfft names refer to the fixed-point build from here on
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <memory>
+
+#define SCOPE_ARRAY(type, name, len) \
+    std::unique_ptr<type[]> name##_buf(new type[len]); \
+    auto name = name##_buf.get();
+
+namespace {
+void *plan_alloc(unsigned nfft, bool inverse)
+{
+    return kiss_fftr_fixed_alloc(nfft, inverse, NULL, NULL);
+}
+
+void plan_free(void *cfg)
+{
+    kiss_fftr_free(cfg);
+}
+
+const FftPlanType g_plan_type = {plan_alloc, plan_free};
+
+unsigned bit_length(uint64_t x)
+{
+    unsigned n = 0;
+    for (; x; x >>= 1) {
+        n++;
+    }
+    return n;
+}
+
+int64_t max_abs(const int64_t *x, unsigned n)
+{
+    int64_t m = 0;
+    for (unsigned i = 0; i < n; i++) {
+        m = std::max(m, x[i] < 0 ? -x[i] : x[i]);
+    }
+    return m;
+}
+} // namespace
+
+RfftPlanFixed::RfftPlanFixed(unsigned nfft, bool inverse) : FftPlanBase(&g_plan_type, nfft, inverse) {}
+
+unsigned RfftPlanFixed::fast_size(unsigned n)
+{
+    return kiss_fftr_next_fast_size_real(n);
+}
+
+void RfftPlanFixed::forward(const int32_t *in, int32_t *out) const
+{
+    kiss_fftr_fixed((kiss_fftr_fixed_cfg)cfg_, in, (kiss_fft_fixed_cpx *)out);
+}
+
+void RfftPlanFixed::inverse(const int32_t *in, int32_t *out) const
+{
+    kiss_fftri_fixed((kiss_fftr_fixed_cfg)cfg_, (const kiss_fft_fixed_cpx *)in, out);
+}
+
+XcorrFixed::XcorrFixed(const int16_t *prefix[2], unsigned channels, unsigned corr_len, unsigned block,
+                       unsigned partition, unsigned dirs, AlignWorkspace *ws)
+    : channels_(channels), corr_len_(corr_len),
+      partition_(std::min(partition ? partition : xcorr_partition(block, corr_len), corr_len)),
+      npart_((corr_len + partition_ - 1) / partition_), fftr_size_(RfftPlanFixed::fast_size(block + partition_)),
+      freq_len_(fftr_size_ / 2 + 1), block_(fftr_size_ - partition_), dirs_(dirs), fwd_(fftr_size_, false),
+      inv_(fftr_size_, true), scope_(ws), time_(scope_.alloc<int32_t>(fftr_size_)),
+      prefix_(scope_.alloc<int32_t>(channels * npart_ * 4 * freq_len_)),
+      spec_(scope_.alloc<int32_t>(channels * npart_ * 4 * freq_len_)),
+      prefix_exp_(scope_.alloc<int>(channels * npart_ * 2)), spec_exp_(scope_.alloc<int>(channels * npart_ * 2)),
+      acc_(scope_.alloc<int64_t>(2 * freq_len_)), z_(scope_.alloc<int32_t>(2 * freq_len_))
+{
+    const int16_t *other[2] = {prefix[1], prefix[0]}; // out[i] correlates in[i] with the other prefix
+    for (unsigned ch = 0; ch < channels; ch++) {
+        for (unsigned p = 0; p < npart_; p++) {
+            const unsigned pos = p * partition_, len = std::min(partition_, corr_len - pos);
+            for (unsigned i = 0; i < 2; i++) {
+                const unsigned idx = (ch * npart_ + p) * 2 + i;
+                if (dirs & (1 << i)) {
+                    prefix_exp_[idx] = forward(other[i], len, ch, pos, &prefix_[idx * 2 * freq_len_]);
+                }
+            }
+        }
+    }
+}
+
+// spectrum of in[offset, offset + frames) of one channel, zero-padded, normalized to 30 bits,
+// returns the normalization exponent: spec = F(in) * 2^(15 + exp) / fftr_size
+int XcorrFixed::forward(const int16_t *in, unsigned frames, unsigned ch, unsigned offset, int32_t *spec)
+{
+    const int16_t *src = in + offset * channels_ + ch;
+    for (unsigned j = 0; j < frames; j++) {
+        time_[j] = src[j * channels_] * 32768; // Q30: pairs of samples make |re + i*im| < 2^31
+    }
+    memset(time_ + frames, 0, sizeof(int32_t) * (fftr_size_ - frames));
+    fwd_.forward(time_, spec);
+
+    int32_t m = 0;
+    for (unsigned k = 0; k < 2 * freq_len_; k++) {
+        m = std::max(m, spec[k] < 0 ? -spec[k] : spec[k]);
+    }
+    const int exp = m ? 30 - (int)bit_length(m) : 0;
+    for (unsigned k = 0; k < 2 * freq_len_; k++) {
+        spec[k] = exp >= 0 ? spec[k] * (1 << exp) : spec[k] >> -exp;
+    }
+    return exp;
+}
+
+void XcorrFixed::run(float *out[2], const int16_t *in[2], const unsigned nlags[2])
+{
+    assert(nlags[0] <= block_ && nlags[1] <= block_);
+    assert((!nlags[0] || (dirs_ & 1)) && (!nlags[1] || (dirs_ & 2)));
+    const unsigned count = channels_ * npart_;
+    int guard = 1; // 64-bit sums of 'count' products below 2^61 each can not overflow
+    while ((1u << (guard - 1)) < count) {
+        guard++;
+    }
+    for (unsigned ch = 0; ch < channels_; ch++) {
+        for (unsigned p = 0; p < npart_; p++) {
+            const unsigned pos = p * partition_, len = std::min(partition_, corr_len_ - pos);
+            for (unsigned i = 0; i < 2; i++) {
+                const unsigned idx = (ch * npart_ + p) * 2 + i;
+                if (nlags[i]) {
+                    spec_exp_[idx] = forward(in[i], nlags[i] + len, ch, pos, &spec_[idx * 2 * freq_len_]);
+                }
+            }
+        }
+    }
+    for (unsigned i = 0; i < 2; i++) {
+        if (!nlags[i]) {
+            continue;
+        }
+        // frame-aligned lags only: sum cross-spectra of channels and partitions at the smallest exponent
+        int exp = INT_MAX;
+        for (unsigned j = 0; j < count; j++) {
+            exp = std::min(exp, spec_exp_[2 * j + i] + prefix_exp_[2 * j + i]);
+        }
+        memset(acc_, 0, sizeof(int64_t) * 2 * freq_len_);
+        for (unsigned j = 0; j < count; j++) {
+            const int shift = spec_exp_[2 * j + i] + prefix_exp_[2 * j + i] - exp + guard;
+            if (shift >= 62) { // below one unit
+                continue;
+            }
+            const int32_t *a = &spec_[(2 * j + i) * 2 * freq_len_], *b = &prefix_[(2 * j + i) * 2 * freq_len_];
+            for (unsigned k = 0; k < 2 * freq_len_; k += 2) { // a * conj(b)
+                acc_[k] += ((int64_t)a[k] * b[k] + (int64_t)a[k + 1] * b[k + 1]) >> shift;
+                acc_[k + 1] += ((int64_t)a[k + 1] * b[k] - (int64_t)a[k] * b[k + 1]) >> shift;
+            }
+        }
+        // 29 bits: the first pass of the inverse adds up to 2 * sqrt(2) of them
+        const int64_t m = max_abs(acc_, 2 * freq_len_);
+        const int norm = m ? (int)bit_length(m) - 29 : 0;
+        for (unsigned k = 0; k < 2 * freq_len_; k++) {
+            z_[k] = (int32_t)(norm >= 0 ? acc_[k] >> norm : acc_[k] * ((int64_t)1 << -norm));
+        }
+        inv_.inverse(z_, time_); // time = F'(acc) * 2^(30 + exp - guard - norm) / fftr_size^3
+
+        const double fac = ldexp(2. * fftr_size_ * fftr_size_, -(30 + exp - guard - norm)); // scale to 2*(x,y)
+        for (unsigned k = 0; k < nlags[i]; k++) {
+            out[i][k] = (float)(time_[k] * fac);
+        }
+    }
+}
+
+static bool test_xcorr_fixed(unsigned channels, unsigned ncorr, unsigned corr_len, unsigned block,
+                             unsigned partition = 0)
+{
+    const unsigned len = (ncorr + corr_len) * channels;
+    SCOPE_ARRAY(int16_t, x, len)
+    SCOPE_ARRAY(int16_t, y, len)
+    unsigned seed = 1;
+    for (unsigned i = 0; i < len; i++) { // full scale noise, every tenth sample clipped
+        seed = seed * 1103515245 + 12345;
+        x[i] = (int16_t)(i % 10 ? (int)(seed >> 16) % 65536 - 32768 : -32768);
+        y[i] = (int16_t)(i * i % 23 * 1000 - 11000);
+    }
+    SCOPE_ARRAY(float, xcorr0, ncorr)
+    SCOPE_ARRAY(float, xcorr1, ncorr)
+    SCOPE_ARRAY(double, xcorr2, ncorr)
+    SCOPE_ARRAY(double, xcorr3, ncorr)
+    const int16_t *in[2] = {x, y};
+    XcorrFixed seg(in, channels, corr_len, block, partition);
+    for (unsigned pos = 0; pos < ncorr; pos += seg.block()) {
+        float *dst[2] = {xcorr0 + pos, xcorr1 + pos};
+        const int16_t *src[2] = {x + pos * channels, y + pos * channels};
+        const unsigned n = std::min(seg.block(), ncorr - pos), nlags[2] = {n, n};
+        seg.run(dst, src, nlags);
+    }
+
+    double en = 0;
+    for (unsigned i = 0; i < ncorr; i++) {
+        xcorr2[i] = xcorr3[i] = 0;
+        for (unsigned j = 0; j < corr_len * channels; j++) {
+            xcorr2[i] += 2. * x[i * channels + j] * y[j];
+            xcorr3[i] += 2. * y[i * channels + j] * x[j];
+        }
+    }
+    for (unsigned j = 0; j < len; j++) {
+        en += (double)x[j] * x[j] + (double)y[j] * y[j];
+    }
+
+    bool success = true;
+    const double eps = 1e-5 * en * corr_len / (ncorr + corr_len); // of the window energy
+    for (unsigned i = 0; i < ncorr; i++) {
+        success &= fabs(xcorr0[i] - xcorr2[i]) < eps && fabs(xcorr1[i] - xcorr3[i]) < eps;
+        assert(success);
+    }
+    return success;
+}
+
+bool test_xcorr_fixed()
+{
+    return test_xcorr_fixed(1, 10, 6, 10) && test_xcorr_fixed(3, 10, 6, 4) && test_xcorr_fixed(2, 1000, 300, 70) &&
+           test_xcorr_fixed(2, 100, 1000, 100, 64) && test_xcorr_fixed(1, 3000, 20000, 1000);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include "fftplan.h"
+#include "workspace.h"
+
+#include <stdint.h>
+
+// Real transforms of the 32-bit fixed-point kissfft build (kissfft_fixed), spectra are nfft/2+1
+// (re, im) pairs. Both directions are scaled by 1/nfft:
+//   inverse(forward(x)) = x / nfft
+class RfftPlanFixed : FftPlanBase
+{
+public:
+    RfftPlanFixed(unsigned nfft, bool inverse);
+    static unsigned fast_size(unsigned n); // smallest supported even nfft >= n
+
+    void forward(const int32_t *in, int32_t *out) const;
+    void inverse(const int32_t *in, int32_t *out) const;
+};
+
+// XcorrSegments for 16-bit PCM: samples enter the fixed-point transforms as Q30 without conversion
+// to float. Every spectrum is normalized to 30 bits with its own exponent (block floating point),
+// the cross-spectra are accumulated in 64 bits and normalized again before the inverse transform.
+// The output is 2*(x,y) in squared sample units.
+class XcorrFixed
+{
+public:
+    XcorrFixed(const int16_t *prefix[2], // corr_len * channels
+               unsigned channels, unsigned corr_len, unsigned block,
+               unsigned partition = 0, // [default: xcorr_partition()]
+               unsigned dirs = 3, AlignWorkspace *ws = NULL);
+    unsigned block() const { return block_; } // max nlags, at least the requested block
+
+    void run(float *out[2],         // nlags
+             const int16_t *in[2],  // (nlags + corr_len) * channels, starting at frame pos
+             const unsigned nlags[2]); // lags per direction, 0 skips it
+
+private:
+    const unsigned channels_, corr_len_, partition_, npart_, fftr_size_, freq_len_, block_, dirs_;
+    RfftPlanFixed fwd_, inv_;
+    AlignScope scope_;
+    int32_t *const time_;   // fftr_size
+    int32_t *const prefix_; // channels * npart * 2 spectra: per partition Yp, Xp
+    int32_t *const spec_;   // channels * npart * 2 spectra: per partition X, Y
+    int *const prefix_exp_; // channels * npart * 2
+    int *const spec_exp_;   // channels * npart * 2
+    int64_t *const acc_;    // 2 * freq_len: cross-spectrum of one direction
+    int32_t *const z_;      // 2 * freq_len
+
+    int forward(const int16_t *in, unsigned frames, unsigned ch, unsigned offset, int32_t *spec);
+};
+
+bool test_xcorr_fixed();
@@ -0,0 +1,659 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "aligned.h"
+#include "bestoffset.h"
+#include "cpu.h"
+#include "fft.h"
+#include "kernels.h"
+#include "ssd.h"
+#include "testsignal.h"
+#include "threads.h"
+#include "xcorr.h"
+
+#include "wavreader.h"
+#include "pcm_conv.h"
+#include "pcm_kernels.h"
+
+#include <kiss_fftr.h>
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <memory>
+
+#define SCOPE_ARRAY(type, name, len) \
+    std::unique_ptr<type[]> name##_buf(new type[len]); \
+    auto name = name##_buf.get();
+
+#define SAMPLE_RATE 48000
+#define CHANNELS 2
+
+static double now_ms()
+{
+    using namespace std::chrono;
+    return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+// one transform covering the whole window, as xcorr_x2 ran before partitioning: 4 * channels forward
+// and 2 inverse real transforms of the same size
+static double fft_ms(unsigned fft_size, unsigned channels, unsigned repeat)
+{
+    RfftPlan fwd(fft_size, false);
+    RfftPlan inv(fft_size, true);
+    const unsigned freq_len = fft_size / 2 + 1;
+    SCOPE_ARRAY(kiss_fft_scalar, x, 4 * fft_size)
+    SCOPE_ARRAY(kiss_fft_cpx, X, 4 * freq_len)
+    const kiss_fft_scalar *in[4] = {x, x + fft_size, x + 2 * fft_size, x + 3 * fft_size};
+    kiss_fft_cpx *out[4] = {X, X + freq_len, X + 2 * freq_len, X + 3 * freq_len};
+    for (unsigned i = 0; i < 4 * fft_size; i++) {
+        x[i] = (kiss_fft_scalar)(i % 97);
+    }
+    double t = now_ms();
+    for (unsigned r = 0; r < repeat; r++) {
+        for (unsigned ch = 0; ch < channels; ch++) {
+            fwd.forward(in, out, 4);
+        }
+        inv.inverse(out, (kiss_fft_scalar *const *)in, 2);
+    }
+    return (now_ms() - t) / repeat;
+}
+
+static void bench_fft_size()
+{
+    static const unsigned corrlen_ms[] = {1000, 3000, 10000, 30000};
+    static const unsigned numcorr_ms[] = {100, 500, 2000};
+    printf("single-window transform size, %u Hz, %u channels: power of 2 vs. 2^a*3^b*5^c\n", SAMPLE_RATE, CHANNELS);
+    printf("%8s %8s | %9s %8s %9s | %9s %8s %9s | %6s\n", "-l ms", "-n ms", "pow2", "MiB", "ms", "fast", "MiB", "ms",
+           "gain");
+    for (unsigned l : corrlen_ms) {
+        for (unsigned n : numcorr_ms) {
+            unsigned corr_len = SAMPLE_RATE / 1000 * l, ncorr = SAMPLE_RATE / 1000 * n;
+            unsigned pow2 = 4;
+            while (ncorr + corr_len > pow2) {
+                pow2 <<= 1;
+            }
+            unsigned fast = fft_backend()->fast_size(ncorr + corr_len); // like-for-like with pow2
+            unsigned repeat = 1 + (1 << 23) / pow2;
+            double mib = 4. * (sizeof(kiss_fft_scalar) + 1.5 * sizeof(kiss_fft_cpx)) / (1 << 20); // 4 real, 6 half
+            double t_pow2 = fft_ms(pow2, CHANNELS, repeat);
+            double t_fast = fft_ms(fast, CHANNELS, repeat);
+            printf("%8u %8u | %9u %8.1f %9.2f | %9u %8.1f %9.2f | %5.2fx\n", l, n, pow2, pow2 * mib, t_pow2, fast,
+                   fast * mib, t_fast, t_pow2 / t_fast);
+        }
+    }
+    fft_plan_cache_flush();
+}
+
+// four mono correlations: two xcorr_x2 calls vs. one batched call
+static void bench_batch()
+{
+    static const unsigned corrlen_ms[] = {1000, 3000, 10000};
+    const unsigned ncorr = SAMPLE_RATE / 2;
+    printf("4 mono correlations, %u Hz, -n %u: 2 x xcorr_x2 vs. xcorr_batch\n", SAMPLE_RATE, ncorr);
+    printf("%8s | %9s %9s | %6s\n", "-l ms", "x2 ms", "batch ms", "gain");
+    for (unsigned l : corrlen_ms) {
+        unsigned corr_len = SAMPLE_RATE / 1000 * l, len = ncorr + corr_len;
+        SCOPE_ARRAY(double, x, 4 * len)
+        SCOPE_ARRAY(float, xcorr, 4 * ncorr)
+        for (unsigned i = 0; i < 4 * len; i++) {
+            x[i] = (i * i % 23) / 23.;
+        }
+        const double *in[2][2] = {{x, x + len}, {x + 2 * len, x + 3 * len}};
+        float *out[2][2] = {{xcorr, xcorr + ncorr}, {xcorr + 2 * ncorr, xcorr + 3 * ncorr}};
+        XcorrJob jobs[4] = {
+            {out[0][0], in[0][0], in[0][1], 1},
+            {out[0][1], in[0][1], in[0][0], 1},
+            {out[1][0], in[1][0], in[1][1], 1},
+            {out[1][1], in[1][1], in[1][0], 1},
+        };
+        const unsigned repeat = 5;
+        xcorr_batch(jobs, 4, ncorr, corr_len); // warm up plan cache
+        xcorr_x2(out[0], in[0], 1, ncorr, corr_len);
+        double t = now_ms();
+        for (unsigned r = 0; r < repeat; r++) {
+            xcorr_x2(out[0], in[0], 1, ncorr, corr_len);
+            xcorr_x2(out[1], in[1], 1, ncorr, corr_len);
+        }
+        double t_x2 = (now_ms() - t) / repeat;
+        t = now_ms();
+        for (unsigned r = 0; r < repeat; r++) {
+            xcorr_batch(jobs, 4, ncorr, corr_len);
+        }
+        double t_batch = (now_ms() - t) / repeat;
+        printf("%8u | %9.2f %9.2f | %5.2fx\n", l, t_x2, t_batch, t_x2 / t_batch);
+    }
+    fft_plan_cache_flush();
+}
+
+// xcorr_x2 with every FFT backend supported by this CPU
+static void bench_backend()
+{
+    static const unsigned corrlen_ms[] = {1000, 3000, 10000, 30000};
+    const unsigned ncorr = SAMPLE_RATE / 2;
+    const FftBackend *saved = fft_backend();
+    printf("xcorr_x2 per FFT backend, %u Hz, %u channels, -n %u\n", SAMPLE_RATE, CHANNELS, ncorr);
+    printf("%8s", "-l ms");
+    for (unsigned b = 0; fft_backend_list(b); b++) {
+        printf(" | %9s %9s", fft_backend_list(b)->name, "ms");
+    }
+    printf("\n");
+    for (unsigned l : corrlen_ms) {
+        unsigned corr_len = SAMPLE_RATE / 1000 * l, len = ncorr + corr_len;
+        SCOPE_ARRAY(double, x, 2 * len * CHANNELS)
+        SCOPE_ARRAY(float, xcorr, 2 * ncorr)
+        for (unsigned i = 0; i < 2 * len * CHANNELS; i++) {
+            x[i] = (i * i % 23) / 23.;
+        }
+        const double *in[2] = {x, x + len * CHANNELS};
+        float *out[2] = {xcorr, xcorr + ncorr};
+        printf("%8u", l);
+        for (unsigned b = 0; fft_backend_list(b); b++) {
+            const unsigned repeat = 3;
+            fft_backend_select(fft_backend_list(b)->name);
+            xcorr_x2(out, in, CHANNELS, ncorr, corr_len); // warm up plan cache
+            double t = now_ms();
+            for (unsigned r = 0; r < repeat; r++) {
+                xcorr_x2(out, in, CHANNELS, ncorr, corr_len);
+            }
+            printf(" | %9u %9.2f", xcorr_fft_size(ncorr, corr_len), (now_ms() - t) / repeat);
+        }
+        printf("\n");
+    }
+    fft_backend_select(saved->name);
+    fft_plan_cache_flush();
+}
+
+// numeric kernels for every SIMD level supported by this CPU
+static void bench_kernels()
+{
+    const unsigned n = 1 << 16, repeat = 200;
+    SCOPE_ARRAY(double, a, n)
+    SCOPE_ARRAY(double, d, n)
+    SCOPE_ARRAY(kiss_fft_cpx, x, n)
+    SCOPE_ARRAY(kiss_fft_cpx, z, n)
+    for (unsigned i = 0; i < n; i++) {
+        a[i] = (i * i % 23) / 23.;
+        d[i] = 0;
+        x[i].r = z[i].r = (float)a[i];
+        x[i].i = z[i].i = (float)-a[i];
+    }
+    printf("kernels, %u elements\n", n);
+    printf("%8s | %9s %9s %9s\n", "level", "sumsq us", "sqdiff us", "cmulc us");
+    for (unsigned l = 0; kernels_list(l); l++) {
+        const Kernels *k = kernels_list(l);
+        volatile double sink = 0;
+        double t = now_ms();
+        for (unsigned r = 0; r < repeat; r++) {
+            sink = sink + k->sumsq(a, n);
+        }
+        double t_sumsq = (now_ms() - t) / repeat;
+        t = now_ms();
+        for (unsigned r = 0; r < repeat; r++) {
+            k->sqdiff(d, a, d, n);
+        }
+        double t_sqdiff = (now_ms() - t) / repeat;
+        t = now_ms();
+        for (unsigned r = 0; r < repeat; r++) {
+            k->cmulc_acc(z, x, x, n);
+        }
+        double t_cmulc = (now_ms() - t) / repeat;
+        printf("%8s | %9.1f %9.1f %9.1f\n", cpu_level_name(k->level), t_sumsq * 1000, t_sqdiff * 1000, t_cmulc * 1000);
+    }
+}
+
+static double partition_ms(const double *in[2], unsigned ncorr, unsigned corr_len, unsigned partition)
+{
+    SCOPE_ARRAY(float, xcorr, 2 * ncorr)
+    float *out[2] = {xcorr, xcorr + ncorr};
+    const unsigned repeat = 3;
+    double t = now_ms();
+    for (unsigned r = 0; r < repeat; r++) {
+        XcorrSegments seg(in, CHANNELS, corr_len, ncorr, partition);
+        seg.run(out, in, ncorr);
+    }
+    return (now_ms() - t) / repeat;
+}
+
+// long SSD window, short search: one transform vs. uniformly partitioned corr_len
+static void bench_partition()
+{
+    static const unsigned corrlen_ms[] = {3000, 10000, 30000, 60000};
+    static const unsigned numcorr_ms[] = {100, 500};
+    printf("xcorr_x2 partitioned, %u Hz, %u channels\n", SAMPLE_RATE, CHANNELS);
+    printf("%8s %8s | %9s %9s | %9s %9s | %6s\n", "-l ms", "-n ms", "single", "ms", "partition", "ms", "gain");
+    for (unsigned l : corrlen_ms) {
+        for (unsigned n : numcorr_ms) {
+            unsigned corr_len = SAMPLE_RATE / 1000 * l, ncorr = SAMPLE_RATE / 1000 * n, len = ncorr + corr_len;
+            SCOPE_ARRAY(double, x, 2 * len * CHANNELS)
+            for (unsigned i = 0; i < 2 * len * CHANNELS; i++) {
+                x[i] = (i * i % 23) / 23.;
+            }
+            const double *in[2] = {x, x + len * CHANNELS};
+            const unsigned partition = xcorr_partition(ncorr, corr_len);
+            partition_ms(in, ncorr, corr_len, partition); // warm up plan cache
+            double t_single = partition_ms(in, ncorr, corr_len, corr_len);
+            double t_part = partition_ms(in, ncorr, corr_len, partition);
+            printf("%8u %8u | %9u %9.2f | %9u %9.2f | %5.2fx\n", l, n, corr_len, t_single, partition, t_part,
+                   t_single / t_part);
+            fft_plan_cache_flush();
+        }
+    }
+}
+
+// SsdSegments setup and one run, both directions
+static double ssd_ms(const double *in[2], unsigned nlags, unsigned corr_len, SsdEngine engine, unsigned repeat)
+{
+    SCOPE_ARRAY(double, ssd, 2 * nlags)
+    double *out[2] = {ssd, ssd + nlags};
+    double t = now_ms();
+    for (unsigned r = 0; r < repeat; r++) {
+        SsdSegments<double> seg(in, CHANNELS, corr_len, nlags, 3, engine);
+        seg.run(out, in, nlags);
+    }
+    return (now_ms() - t) / repeat;
+}
+
+static void bench_direct()
+{
+    static const unsigned nlags_[] = {4, 16, 64, 256, 1024, 4096};
+    static const unsigned corr_len_ms[] = {100, 3000};
+    printf("SsdSegments FFT vs. direct, %u Hz, %u channels\n", SAMPLE_RATE, CHANNELS);
+    printf("%8s %8s | %9s %9s | %6s\n", "-l ms", "nlags", "fft ms", "direct ms", "auto");
+    for (unsigned l : corr_len_ms) {
+        for (unsigned nlags : nlags_) {
+            const unsigned corr_len = SAMPLE_RATE / 1000 * l, len = nlags + corr_len;
+            SCOPE_ARRAY(double, x, len * CHANNELS)
+            SCOPE_ARRAY(double, y, len * CHANNELS)
+            for (unsigned i = 0; i < len * CHANNELS; i++) {
+                x[i] = (i * i % 23) / 23.;
+                y[i] = (i * 7 % 19) / 19.;
+            }
+            const double *in[2] = {x, y};
+            const unsigned repeat = 3;
+            double t_fft = ssd_ms(in, nlags, corr_len, SSD_FFT, repeat);
+            double t_direct = ssd_ms(in, nlags, corr_len, SSD_DIRECT, repeat);
+            printf("%8u %8u | %9.2f %9.2f | %6s\n", l, nlags, t_fft, t_direct,
+                   ssd_direct(nlags, corr_len, CHANNELS) ? "direct" : "fft");
+        }
+        fft_plan_cache_flush();
+    }
+}
+
+// full-rate search vs. coarse-to-fine search, the test signal is the reference delayed by 'shift'
+static void bench_coarse()
+{
+    static const unsigned numcorr_ms[] = {500, 5000, 20000};
+    const unsigned corr_len = SAMPLE_RATE * 3, shift = SAMPLE_RATE / 3;
+    printf("bestOffset vs. bestOffsetCoarse(8), %u Hz, %u channels, -l %u\n", SAMPLE_RATE, CHANNELS, corr_len);
+    printf("%8s | %9s %9s | %9s %9s | %6s\n", "-n ms", "full", "ms", "coarse", "ms", "gain");
+    for (unsigned n : numcorr_ms) {
+        const unsigned ncorr = SAMPLE_RATE / 1000 * n, len = ncorr + corr_len + shift;
+        SCOPE_ARRAY(double, x, len * CHANNELS)
+        test_noise(x, len, CHANNELS);
+        float ssd[1];
+        int offsets[2][1];
+        double t = now_ms();
+        bestOffset(ssd, offsets[0], 1, x + shift * CHANNELS, x, CHANNELS, ncorr, corr_len, 0);
+        double t_full = now_ms() - t;
+        t = now_ms();
+        bestOffsetCoarse(ssd, offsets[1], 1, x + shift * CHANNELS, x, CHANNELS, ncorr, corr_len, 0, 8);
+        double t_coarse = now_ms() - t;
+        printf("%8u | %9d %9.2f | %9d %9.2f | %5.2fx\n", n, offsets[0][0], t_full, offsets[1][0], t_coarse,
+               t_full / t_coarse);
+        fft_plan_cache_flush();
+    }
+}
+
+// repeated searches with a fresh vs. a reused workspace
+static void bench_workspace()
+{
+    static const unsigned numcorr_ms[] = {500, 5000};
+    const unsigned corr_len = SAMPLE_RATE * 3, shift = SAMPLE_RATE / 3, repeat = 5;
+    printf("bestOffset x %u, fresh vs. reused AlignWorkspace, %u Hz, %u channels, -l %u\n", repeat, SAMPLE_RATE,
+           CHANNELS, corr_len);
+    printf("%8s | %9s %9s | %6s\n", "-n ms", "fresh ms", "reused ms", "gain");
+    for (unsigned n : numcorr_ms) {
+        const unsigned ncorr = SAMPLE_RATE / 1000 * n, len = ncorr + corr_len + shift;
+        SCOPE_ARRAY(double, x, len * CHANNELS)
+        for (unsigned i = 0; i < len * CHANNELS; i++) {
+            x[i] = (i * i % 23) / 23.;
+        }
+        float ssd[1];
+        int offset;
+        double t = now_ms();
+        for (unsigned r = 0; r < repeat; r++) {
+            AlignWorkspace ws;
+            bestOffset(ssd, &offset, 1, x + shift * CHANNELS, x, CHANNELS, ncorr, corr_len, 0, &ws);
+        }
+        double t_fresh = (now_ms() - t) / repeat;
+        AlignWorkspace ws;
+        bestOffset(ssd, &offset, 1, x + shift * CHANNELS, x, CHANNELS, ncorr, corr_len, 0, &ws);
+        t = now_ms();
+        for (unsigned r = 0; r < repeat; r++) {
+            bestOffset(ssd, &offset, 1, x + shift * CHANNELS, x, CHANNELS, ncorr, corr_len, 0, &ws);
+        }
+        double t_reused = (now_ms() - t) / repeat;
+        printf("%8u | %9.2f %9.2f | %5.2fx\n", n, t_fresh, t_reused, t_fresh / t_reused);
+        fft_plan_cache_flush();
+    }
+}
+
+// PCM buffers and workspace with 4 KiB pages vs. transparent huge pages, fresh for every search
+static double huge_ms(unsigned ncorr, unsigned corr_len, size_t threshold, unsigned repeat)
+{
+    const unsigned shift = SAMPLE_RATE / 3, len = ncorr + corr_len + shift;
+    aligned_huge_threshold(threshold);
+    double t = now_ms();
+    for (unsigned r = 0; r < repeat; r++) {
+        AlignedArray<double> x = aligned_array<double>(len * CHANNELS);
+        for (unsigned i = 0; i < len * CHANNELS; i++) {
+            x[i] = (i * i % 23) / 23.;
+        }
+        AlignWorkspace ws;
+        float ssd[1];
+        int offset;
+        bestOffset(ssd, &offset, 1, x.get() + shift * CHANNELS, x.get(), CHANNELS, ncorr, corr_len, 0, &ws);
+    }
+    return (now_ms() - t) / repeat;
+}
+
+static void bench_hugepages()
+{
+    static const struct {
+        unsigned l_ms, n_ms;
+    } sizes[] = {{3000, 500}, {10000, 5000}, {30000, 20000}};
+    const size_t threshold = aligned_huge_threshold();
+    printf("bestOffset with fresh buffers, 4 KiB vs. huge pages (threshold %zu), %u Hz, %u channels\n", threshold,
+           SAMPLE_RATE, CHANNELS);
+    printf("%8s %8s | %9s %9s | %6s\n", "-l ms", "-n ms", "4k ms", "huge ms", "gain");
+    for (auto &s : sizes) {
+        const unsigned ncorr = SAMPLE_RATE / 1000 * s.n_ms, corr_len = SAMPLE_RATE / 1000 * s.l_ms;
+        huge_ms(ncorr, corr_len, threshold, 1); // warm up the plan cache
+        double t_4k = huge_ms(ncorr, corr_len, 0, 3);
+        double t_huge = huge_ms(ncorr, corr_len, threshold, 3);
+        printf("%8u %8u | %9.2f %9.2f | %5.2fx\n", s.l_ms, s.n_ms, t_4k, t_huge, t_4k / t_huge);
+        fft_plan_cache_flush();
+    }
+    aligned_huge_threshold(threshold);
+}
+
+// best of three searches, after one that warms up the plan cache and the workspace
+template <class T> static double search_ms(const T *x, unsigned ncorr, unsigned corr_len, unsigned shift, bool coarse)
+{
+    AlignWorkspace ws;
+    float ssd[1];
+    int offset;
+    double best = 0;
+    for (unsigned r = 0; r < 4; r++) {
+        double t = now_ms();
+        if (coarse) {
+            bestOffsetCoarse(ssd, &offset, 1, x + shift * CHANNELS, x, CHANNELS, ncorr, corr_len, 0, 8, &ws);
+        } else {
+            bestOffset(ssd, &offset, 1, x + shift * CHANNELS, x, CHANNELS, ncorr, corr_len, 0, &ws);
+        }
+        t = now_ms() - t;
+        best = r == 1 ? t : std::min(best, t);
+    }
+    return best;
+}
+
+static void bench_precision()
+{
+    static const unsigned numcorr_ms[] = {500, 5000, 20000};
+    const unsigned corr_len = SAMPLE_RATE * 3, shift = SAMPLE_RATE / 3;
+    printf("bestOffset / bestOffsetCoarse(8), double vs. float vs. int16 samples, %u Hz, %u channels, -l %u\n",
+           SAMPLE_RATE, CHANNELS, corr_len);
+    printf("%8s | %9s %9s %9s | %9s %9s %9s\n", "-n ms", "double ms", "float ms", "int16 ms", "double ms", "float ms",
+           "int16 ms");
+    for (unsigned n : numcorr_ms) {
+        const unsigned ncorr = SAMPLE_RATE / 1000 * n, len = ncorr + corr_len + shift;
+        AlignedArray<double> x = aligned_array<double>(len * CHANNELS);
+        AlignedArray<float> y = aligned_array<float>(len * CHANNELS);
+        AlignedArray<int16_t> z = aligned_array<int16_t>(len * CHANNELS);
+        test_noise(x.get(), len, CHANNELS);
+        for (unsigned i = 0; i < len * CHANNELS; i++) { // the same 16-bit samples
+            z[i] = (int16_t)floor(x[i] * 32767);
+            x[i] = y[i] = z[i] / 32768.f;
+        }
+        double t[6];
+        for (unsigned coarse = 0; coarse < 2; coarse++) {
+            t[3 * coarse] = search_ms(x.get(), ncorr, corr_len, shift, coarse);
+            t[3 * coarse + 1] = search_ms(y.get(), ncorr, corr_len, shift, coarse);
+            t[3 * coarse + 2] = search_ms(z.get(), ncorr, corr_len, shift, coarse);
+        }
+        printf("%8u | %9.2f %9.2f %9.2f | %9.2f %9.2f %9.2f\n", n, t[0], t[1], t[2], t[3], t[4], t[5]);
+        fft_plan_cache_flush();
+    }
+}
+
+// one real transform, Stockham vs. four-step plans of the default backend
+static void bench_four_step()
+{
+    const unsigned saved = fft_four_step_min();
+    printf("forward + inverse real FFT, %s backend: Stockham vs. four-step\n", fft_backend()->name);
+    printf("%9s %8s | %9s %9s | %6s\n", "nfft", "MiB", "stockham", "4-step", "gain");
+    for (unsigned nfft = 1 << 16; nfft <= 1 << 25; nfft <<= 1) {
+        const unsigned freq_len = nfft / 2 + 1, repeat = 1 + (1 << 25) / nfft;
+        SCOPE_ARRAY(kiss_fft_scalar, x, nfft)
+        SCOPE_ARRAY(kiss_fft_scalar, y, nfft)
+        SCOPE_ARRAY(kiss_fft_cpx, X, freq_len)
+        for (unsigned i = 0; i < nfft; i++) {
+            x[i] = (kiss_fft_scalar)(i % 97);
+        }
+        double t[2];
+        for (unsigned mode = 0; mode < 2; mode++) {
+            fft_four_step_min(mode ? nfft : 0);
+            fft_plan_cache_flush();
+            RfftPlan fwd(nfft, false);
+            RfftPlan inv(nfft, true);
+            fwd.forward(x, X); // warm up
+            t[mode] = now_ms();
+            for (unsigned r = 0; r < repeat; r++) {
+                fwd.forward(x, X);
+                inv.inverse(X, y);
+            }
+            t[mode] = (now_ms() - t[mode]) / repeat;
+        }
+        printf("%9u %8.1f | %9.3f %9.3f | %5.2fx\n", nfft, nfft * 3. * sizeof(kiss_fft_scalar) / (1 << 20), t[0], t[1],
+               t[0] / t[1]);
+    }
+    fft_four_step_min(saved);
+    fft_plan_cache_flush();
+}
+
+// every backend with four-step plans enabled (avx2 has them) vs. a kiss_fftr plan at large sizes and on
+// 1..4 threads, max. error relative to the largest bin; the self-test only checks one small size
+static void bench_four_step_check()
+{
+    static const unsigned sizes[] = {1 << 16, 3 << 16, 1 << 20, 5 << 20, 1 << 23};
+    const unsigned saved_min = fft_four_step_min(), saved_threads = thread_count();
+    printf("four-step forward/inverse real FFT vs. kiss_fftr, max. relative error\n");
+    printf("%8s %9s %7s | %9s %9s\n", "backend", "nfft", "threads", "forward", "inverse");
+    for (unsigned b = 0; fft_backend_list(b); b++) {
+        const FftBackend *backend = fft_backend_list(b);
+        for (unsigned n : sizes) {
+            const unsigned nfft = backend->fast_size(n), freq_len = nfft / 2 + 1;
+            SCOPE_ARRAY(kiss_fft_scalar, x, nfft)
+            SCOPE_ARRAY(kiss_fft_scalar, y, nfft)
+            SCOPE_ARRAY(kiss_fft_cpx, X, freq_len)
+            SCOPE_ARRAY(kiss_fft_cpx, R, freq_len)
+            for (unsigned i = 0; i < nfft; i++) {
+                x[i] = (kiss_fft_scalar)((int)(i * i % 23) - 11) / 11;
+            }
+            kiss_fftr_cfg cfg = kiss_fftr_alloc(nfft, 0, NULL, NULL);
+            kiss_fftr(cfg, x, R);
+            kiss_fftr_free(cfg);
+            double peak = 0;
+            for (unsigned k = 0; k < freq_len; k++) {
+                peak = std::max(peak, (double)std::max(fabs(R[k].r), fabs(R[k].i)));
+            }
+            fft_four_step_min(nfft);
+            for (unsigned t = 1; t <= 4; t++) {
+                thread_count(t);
+                fft_plan_cache_flush();
+                RfftPlan fwd(nfft, false, backend);
+                RfftPlan inv(nfft, true, backend);
+                fwd.forward(x, X);
+                inv.inverse(X, y);
+                double err_fwd = 0, err_inv = 0;
+                for (unsigned k = 0; k < freq_len; k++) {
+                    err_fwd = std::max(err_fwd, (double)std::max(fabs(X[k].r - R[k].r), fabs(X[k].i - R[k].i)));
+                }
+                for (unsigned i = 0; i < nfft; i++) {
+                    err_inv = std::max(err_inv, (double)fabs(y[i] / nfft - x[i]));
+                }
+                printf("%8s %9u %7u | %9.2e %9.2e\n", backend->name, nfft, t, err_fwd / peak, err_inv);
+            }
+        }
+    }
+    fft_four_step_min(saved_min);
+    thread_count(saved_threads);
+    fft_plan_cache_flush();
+}
+
+// PCM to float/double: pcmconv_*() per sample vs. the loop picked for the file layout
+static void bench_decode()
+{
+    static const struct {
+        const char *name;
+        unsigned format, bits_per_sample, sample_block;
+    } layouts[] = {
+        {"int16", WAVE_FORMAT_PCM, 16, 2},
+        {"int24", WAVE_FORMAT_PCM, 24, 3},
+        {"float", WAVE_FORMAT_IEEE_FLOAT, 32, 4},
+    };
+    const unsigned n = 1 << 22, repeat = 5;
+    printf("decode %u samples, MB/s of the file data: per sample vs. per layout\n", n);
+    printf("%6s %6s | %9s %9s | %6s\n", "file", "to", "sample", "layout", "gain");
+    SCOPE_ARRAY(unsigned char, pcm, 4 * n)
+    SCOPE_ARRAY(double, out, n)
+    for (auto &l : layouts) {
+        for (unsigned i = 0; i < n; i++) {
+            float x = (float)((i * 7919 % 65536) / 32768. - 1);
+            memcpy(pcm + i * l.sample_block, &x, l.sample_block); // any bits for integer PCM
+        }
+        for (SmplFmt smpl_fmt : {SMPL_FMT_FLOAT, SMPL_FMT_DOUBLE}) {
+            volatile unsigned format = l.format, bits_per_sample = l.bits_per_sample; // no constant folding
+            double t = now_ms();
+            for (unsigned r = 0; r < repeat; r++) {
+                int err_sticky = 0;
+                for (unsigned i = 0; i < n; i++) {
+                    double x = pcmconv_to_double(pcm + i * l.sample_block, format, bits_per_sample, &err_sticky);
+                    if (smpl_fmt == SMPL_FMT_FLOAT) {
+                        ((float *)out)[i] = (float)x;
+                    } else {
+                        out[i] = x;
+                    }
+                }
+            }
+            double t_sample = (now_ms() - t) / repeat;
+            PcmDecodeFn decode = pcm_decoder(l.format, l.bits_per_sample, l.sample_block, smpl_fmt);
+            t = now_ms();
+            for (unsigned r = 0; r < repeat; r++) {
+                decode(pcm, out, n);
+            }
+            double t_layout = (now_ms() - t) / repeat;
+            const double mb = n * l.sample_block / 1e3;
+            printf("%6s %6s | %9.0f %9.0f | %5.2fx\n", l.name, smpl_fmt == SMPL_FMT_FLOAT ? "float" : "double",
+                   mb / t_sample, mb / t_layout, t_sample / t_layout);
+        }
+    }
+}
+
+// float to the file format: pcmconv_*() per sample vs. the loop picked for the pair
+static void bench_encode()
+{
+    static const struct {
+        const char *name;
+        unsigned format, bits_per_sample;
+    } layouts[] = {
+        {"int16", WAVE_FORMAT_PCM, 16},
+        {"int24", WAVE_FORMAT_PCM, 24},
+        {"int32", WAVE_FORMAT_PCM, 32},
+        {"float", WAVE_FORMAT_IEEE_FLOAT, 32},
+    };
+    const unsigned n = 1 << 22, repeat = 5;
+    printf("encode %u float samples, MB/s of the file data: per sample vs. per pair\n", n);
+    printf("%6s | %9s %9s | %6s\n", "file", "sample", "pair", "gain");
+    SCOPE_ARRAY(float, in, n)
+    SCOPE_ARRAY(unsigned char, pcm, 4 * n)
+    for (unsigned i = 0; i < n; i++) {
+        in[i] = (float)((i * 7919 % 65536) / 30000. - 1.1); // some clipped
+    }
+    for (auto &l : layouts) {
+        volatile unsigned format = l.format, bits_per_sample = l.bits_per_sample; // no constant folding
+        const unsigned block = l.bits_per_sample >> 3;
+        double t = now_ms();
+        for (unsigned r = 0; r < repeat; r++) {
+            int err_sticky = 0;
+            unsigned char *out = pcm;
+            for (unsigned i = 0; i < n; i++) {
+                const unsigned char *x = (const unsigned char *)(in + i);
+                if (format == WAVE_FORMAT_PCM) {
+                    int32_t y = pcmconv_to_int32(x, WAVE_FORMAT_IEEE_FLOAT, 32, &err_sticky);
+                    if (bits_per_sample == 16) {
+                        *(short *)out = (short)(y >> 16);
+                        out += 2;
+                    } else if (bits_per_sample == 24) {
+                        *out++ = (unsigned char)(y >> 8);
+                        *out++ = (unsigned char)(y >> 16);
+                        *out++ = (unsigned char)(y >> 24);
+                    } else {
+                        *(int32_t *)out = y;
+                        out += 4;
+                    }
+                } else {
+                    *(float *)out = (float)pcmconv_to_double(x, WAVE_FORMAT_IEEE_FLOAT, 32, &err_sticky);
+                    out += 4;
+                }
+            }
+        }
+        double t_sample = (now_ms() - t) / repeat;
+        PcmEncodeFn encode = pcm_encoder(SMPL_FMT_FLOAT, l.format, l.bits_per_sample);
+        t = now_ms();
+        for (unsigned r = 0; r < repeat; r++) {
+            encode((const unsigned char *)in, pcm, n);
+        }
+        double t_pair = (now_ms() - t) / repeat;
+        const double mb = n * block / 1e3;
+        printf("%6s | %9.0f %9.0f | %5.2fx\n", l.name, mb / t_sample, mb / t_pair, t_sample / t_pair);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*run)();
+} benchmarks[] = {
+    {"fft_size", bench_fft_size},
+    {"batch", bench_batch},
+    {"backend", bench_backend},
+    {"kernels", bench_kernels},
+    {"partition", bench_partition},
+    {"coarse", bench_coarse},
+    {"direct", bench_direct},
+    {"workspace", bench_workspace},
+    {"hugepages", bench_hugepages},
+    {"precision", bench_precision},
+    {"four_step", bench_four_step},
+    {"four_step_check", bench_four_step_check},
+    {"decode", bench_decode},
+    {"encode", bench_encode},
+};
+
+int main(int argc, char *argv[])
+{
+    pcm_kernels_avx2(cpu_level() >= CPU_AVX2);
+    for (auto &b : benchmarks) {
+        if (argc > 1 && strcmp(argv[1], b.name)) {
+            continue;
+        }
+        b.run();
+        printf("\n");
+    }
+    return 0;
+}
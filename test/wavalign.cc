@@ -5,10 +5,20 @@
 
 #include <wavreader.h>
 #include <wavwriter.h>
+#include <pcm_kernels.h>
 
+#include "aligned.h"
 #include "bestoffset.h"
+#include "cpu.h"
+#include "decimate.h"
+#include "fft.h"
+#include "fftplan.h"
+#include "kernels.h"
 #include "ssd.h"
+#include "threads.h"
+#include "workspace.h"
 #include "xcorr.h"
+#include "xcorr_fixed.h"
 
 #include <getopt.h>
 #include <stdio.h>
@@ -19,6 +29,10 @@
 
 #define DEFAUL_CORRLEN_MS 3000
 #define DEFAUL_NUMCORR_MS 500
+#define DEFAULT_COARSE 8
+#define DEFAULT_BEST 3
+#define COARSE_MIN_NUMCORR (1 << 17)
+#define MAX_INMEMORY_FRAMES (1 << 22) // coarse search needs the whole window in memory
 static void usage(void)
 {
     printf(
@@ -40,6 +54,15 @@ static void usage(void)
         "                   the beginning of tst.wav. Usually, the negative offset\n"
         "                   indicates error.\n"
         "                   The negative value of N allows unlimited backward offset.\n"
+        "  --coarse N       Search at 1/N rate first (N is 1, 2, 4, 8 or 16), then refine\n"
+        "                   the best candidates at full rate. 1 disables it.\n"
+        "                   [default: %d for -n over %d samples, 1 otherwise].\n"
+        "  --best K         Number of best offsets to print (1..%d) [default: %d].\n"
+        "  --double         Analyze in double precision (single precision with\n"
+        "                   compensated energy sums by default).\n"
+        "  --int            Analyze 16-bit PCM in fixed point, as read from the files.\n"
+        "                   Other formats are analyzed in single precision.\n"
+        "  --threads N      Search on N threads, 0 for one per CPU [default: 1].\n"
         "  -o file          Output file name.\n"
         "\n"
         "Options to control output file format:\n"
@@ -48,10 +71,13 @@ static void usage(void)
         "  --bps N          Integer with 16, 24 or 32 bits per sample.\n"
         "  --float          Float, 32 bits per samples.\n"
         "\n"
+        "Environment:\n"
+        "  WAVALIGN_CPU=X   Limit SIMD code to generic, sse2, avx2 or avx512.\n"
+        "\n"
         "Note, setting a search interval far beyond the length of the SSD increases the\n"
         "likelihood of finding a minimum SSD that does not align files.\n"
         "\n",
-        DEFAUL_CORRLEN_MS, DEFAUL_NUMCORR_MS);
+        DEFAUL_CORRLEN_MS, DEFAUL_NUMCORR_MS, DEFAULT_COARSE, COARSE_MIN_NUMCORR, MAX_BEST, DEFAULT_BEST);
 }
 
 #ifdef NDEBUG
@@ -71,12 +97,89 @@ static void usage(void)
     std::unique_ptr<type[]> name##_buf(new type[len]); \
     auto name = name##_buf.get();
 
-static void readInput(WavReader* wr, double* pcmBuf, unsigned spcRequired, unsigned& numZeros, unsigned& numLow,
-                      unsigned& numSamples)
+static int readSamples(WavReader* wr, double* buf, unsigned spc)
+{
+    return WR_readDouble(wr, buf, spc);
+}
+static int readSamples(WavReader* wr, float* buf, unsigned spc)
+{
+    return WR_readFloat(wr, buf, spc);
+}
+static int readSamples(WavReader* wr, int16_t* buf, unsigned spc)
+{
+    return WR_readInt16(wr, buf, spc);
+}
+
+// Sample type the analysis runs on
+enum SampleType {
+    SAMPLE_FLOAT,
+    SAMPLE_DOUBLE, // --double
+    SAMPLE_INT16,  // --int, both files are 16-bit PCM
+};
+
+#define POW2(x) ((x) * (x))
+
+// First sample index past the low-energy start: the moving energy of 'ma_len' samples is compared
+// with the average energy 'en' of that many samples. CH is the channel count known at compile time,
+// 0 takes 'channels'.
+template <unsigned CH, class T>
+static unsigned lowEnergyEnd(const T* pcmBuf, unsigned numSamples, unsigned channels, unsigned ma_len, double ma,
+                             double en)
+{
+    const unsigned ch = CH ? CH : channels, n = numSamples * ch, lag = ma_len * ch;
+    for (unsigned i = lag; i < n; i += ch) {
+        for (unsigned j = 0; j < ch; j++) {
+            if (ma * POW2(16) > en) {
+                return i + j;
+            }
+            ma += POW2((double)pcmBuf[i + j]) - POW2((double)pcmBuf[i + j - lag]);
+        }
+    }
+    return n;
+}
+
+// Sum of squares of up to 'spc' samples per channel past the first 'skip' ones, read by a reader of
+// its own; returns the number of samples per channel summed
+#define ENERGY_CHUNK 65536
+template <class T>
+static unsigned sumsqAhead(const char* filename, unsigned skip, unsigned spc, double& sum)
+{
+    WavReader* wr = WR_openMapped(filename);
+    if (!wr) {
+        return 0;
+    }
+    SCOPE_ARRAY(T, buf, ENERGY_CHUNK * wr->channels)
+    unsigned done = 0;
+    while (skip > 0) {
+        unsigned spcRead = readSamples(wr, buf, std::min(skip, (unsigned)ENERGY_CHUNK));
+        if (spcRead == 0) {
+            break;
+        }
+        skip -= spcRead;
+    }
+    while (skip == 0 && done < spc) {
+        unsigned spcRead = readSamples(wr, buf, std::min(spc - done, (unsigned)ENERGY_CHUNK));
+        if (spcRead == 0) {
+            break;
+        }
+        sum += sumsq(kernels(), buf, spcRead * wr->channels);
+        done += spcRead;
+    }
+    WR_close(wr);
+    return done;
+}
+
+// Skips the leading zeros and the low-energy start, then fills pcmBuf with up to spcRequired
+// samples per channel. The average energy the start is compared with covers spcEnergy samples
+// per channel, read ahead from 'filename' past the buffer if needed (segmented mode), so the
+// trimming does not depend on how much of the window is kept in memory.
+template <class T>
+static void readInput(WavReader* wr, const char* filename, T* pcmBuf, unsigned spcRequired, unsigned spcEnergy,
+                      unsigned& numZeros, unsigned& numLow, unsigned& numSamples)
 {
     numZeros = numLow = numSamples = 0;
     while (true) {
-        unsigned spcRead = WR_readDouble(wr, pcmBuf, spcRequired);
+        unsigned spcRead = readSamples(wr, pcmBuf, spcRequired);
         if (spcRead == 0) {
             return;
         }
@@ -95,7 +198,7 @@ static void readInput(WavReader* wr, double* pcmBuf, unsigned spcRequired, unsig
         }
     }
     if (numSamples < spcRequired) {
-        unsigned spcRead = WR_readDouble(wr, pcmBuf + numSamples * wr->channels, spcRequired - numSamples);
+        unsigned spcRead = readSamples(wr, pcmBuf + numSamples * wr->channels, spcRequired - numSamples);
         numSamples += spcRead;
     }
 #define MA_LEN 128
@@ -105,33 +208,84 @@ static void readInput(WavReader* wr, double* pcmBuf, unsigned spcRequired, unsig
 
     // only search within [0, spcRequired) region
     {
-#define POW2(x) ((x) * (x))
-        double en = 0, ma;
-        for (unsigned i = 0; i < numSamples * wr->channels; i++) {
-            en += POW2(pcmBuf[i]);
-            if (i == MA_LEN * wr->channels) {
-                ma = en;
-            }
+        double en = sumsq(kernels(), pcmBuf, numSamples * wr->channels);
+        double ma = sumsq(kernels(), pcmBuf, std::min(MA_LEN * wr->channels + 1, numSamples * wr->channels));
+        unsigned spcEn = numSamples;
+        if (numSamples == spcRequired && spcEnergy > spcRequired) {
+            spcEn += sumsqAhead<T>(filename, numZeros + numSamples, spcEnergy - numSamples, en);
         }
-        en /= numSamples;
+        en /= spcEn;
         en *= MA_LEN;
-        unsigned i = MA_LEN * wr->channels;
-        for (; i < numSamples * wr->channels; i++) {
-            if (ma * POW2(16) > en) {
+        auto end = lowEnergyEnd<0, T>;
+        switch (wr->channels) {
+            case 1:
+                end = lowEnergyEnd<1, T>;
+                break;
+            case 2:
+                end = lowEnergyEnd<2, T>;
+                break;
+            case 6:
+                end = lowEnergyEnd<6, T>;
+                break;
+            case 8:
+                end = lowEnergyEnd<8, T>;
                 break;
-            }
-            ma += POW2(pcmBuf[i]) - POW2(pcmBuf[i - MA_LEN * wr->channels]);
         }
+        unsigned i = end(pcmBuf, numSamples, wr->channels, MA_LEN, ma, en);
         numLow = (i - MA_LEN) / wr->channels;
         numSamples -= numLow;
         memmove(pcmBuf, pcmBuf + numLow * wr->channels, numSamples * wr->channels * sizeof(*pcmBuf));
     }
     if (numSamples < spcRequired) {
-        unsigned spcRead = WR_readDouble(wr, pcmBuf + numSamples * wr->channels, spcRequired - numSamples);
+        unsigned spcRead = readSamples(wr, pcmBuf + numSamples * wr->channels, spcRequired - numSamples);
         numSamples += spcRead;
     }
 }
 
+// -n beyond one overlap-save block: keep both files open and feed bestOffsetSegmented from them
+struct SegmentedInput {
+    WavReader* wr[2];
+    const void* pending[2]; // read by readInput() but not consumed yet, SampleType
+    unsigned numPending[2];
+};
+
+template <class T>
+static unsigned readSegmented(void* ctx, T* buf[2], unsigned frames)
+{
+    SegmentedInput* in = (SegmentedInput*)ctx;
+    unsigned n = frames;
+    for (auto i = 0; i < 2; i++) {
+        const unsigned channels = in->wr[i]->channels;
+        unsigned m = std::min(frames, in->numPending[i]);
+        const T* pending = (const T*)in->pending[i];
+        memcpy(buf[i], pending, m * channels * sizeof(T));
+        in->pending[i] = pending + m * channels;
+        in->numPending[i] -= m;
+        if (m < frames) {
+            int spcRead = readSamples(in->wr[i], buf[i] + m * channels, frames - m);
+            m += std::max(spcRead, 0);
+        }
+        n = std::min(n, m);
+    }
+    return n;
+}
+
+// Search with the samples of pcmBuf[] being T (double, float or int16_t)
+template <class T>
+static void searchOffsets(float ssd[], int offsets[], unsigned num_best, const void* pcmBuf[2], SegmentedInput* seg,
+                          unsigned channels, unsigned numcorr, unsigned corrlen, int bias, unsigned coarse,
+                          AlignWorkspace* ws)
+{
+    const T *left = (const T*)pcmBuf[0], *right = (const T*)pcmBuf[1];
+    if (seg) {
+        bestOffsetSegmented(ssd, offsets, num_best, readSegmented<T>, seg, channels, numcorr, corrlen, bias, ws);
+    } else if (coarse > 1) {
+        bestOffsetCoarse(ssd, offsets, num_best, left, right, channels, numcorr, corrlen, bias, coarse, ws);
+    } else {
+        bestOffset(ssd, offsets, num_best, left, right, channels, numcorr, corrlen, bias, ws);
+    }
+}
+
 static int writeOutput(int offset, const char* namein, const char* nameout, int format, unsigned bps)
 {
     WavReader* wr = WR_open(namein);
@@ -140,17 +294,32 @@ static int writeOutput(int offset, const char* namein, const char* nameout, int
     WavWriter* ww = WW_open(nameout, format, wr->channels, wr->sample_rate, bps);
     TRACE_ERR(!ww, "can't open for writing: %s", nameout)
 
-    if (offset != 0) {
+    // same format: the data chunk past the removed samples is copied as is
+    const WavChunk* data = WR_findChunk(wr, WR_TAG('d', 'a', 't', 'a'));
+    const bool passthrough = data && wr->format == ww->format && wr->bits_per_sample == ww->bits_per_sample &&
+                             wr->block_align == ww->block_align;
+    if (passthrough && offset > 0) {
+        TRACE_ERR(unsigned(offset) > wr->samples_per_channel, "can't remove %d samples from %s", offset, namein)
+    } else if (offset != 0) {
         SCOPE_ARRAY(short, buf, wr->channels*(offset > 0 ? offset : -offset))
         if (offset < 0) {
             offset = -offset;
             memset(buf, 0, sizeof(short) * wr->channels * offset);
             WW_writeInt16(ww, reinterpret_cast<short*>(buf), offset);
+            offset = 0;
         } else {
             int n = WR_readInt16(wr, buf, offset);
             TRACE_ERR(n != offset, "can't remove %d samples from %s", offset, namein)
         }
     }
+    if (passthrough) {
+        const unsigned spc = wr->samples_per_channel - offset;
+        int n = WW_copyRaw(ww, namein, data->offset + uint64_t(offset) * wr->block_align, spc);
+        TRACE_ERR(n != int(spc), "%d samples of %d copied from %s", n, spc, namein)
+        WW_close(ww);
+        WR_close(wr);
+        return 0;
+    }
     unsigned len = 8192;
     SCOPE_ARRAY(float, buf, wr->channels* len);
     while (true) {
@@ -172,9 +341,20 @@ static int writeOutput(int offset, const char* namein, const char* nameout, int
 int main(int argc, char* argv[])
 {
 #ifndef NDEBUG
+    test_kernels();
+    test_fft_plan();
+    test_aligned();
+    test_workspace();
+    test_threads();
+    test_fft();
     test_xcorr_x2();
+    test_xcorr_batch();
+    test_xcorr_fixed();
+    test_decimate();
     test_ssd_x2();
+    test_bestoffset();
 #endif
+    pcm_kernels_avx2(cpu_level() >= CPU_AVX2);
     if (argc <= 1) {
         usage();
         return 1;
@@ -188,9 +368,16 @@ int main(int argc, char* argv[])
         {"bps", required_argument, 0, 'Z' + 1},
         {"float", no_argument, 0, 'Z' + 2},
         {"back", required_argument, 0, 'Z' + 3},
+        {"coarse", required_argument, 0, 'Z' + 4},
+        {"best", required_argument, 0, 'Z' + 5},
+        {"double", no_argument, 0, 'Z' + 6},
+        {"int", no_argument, 0, 'Z' + 7},
+        {"threads", required_argument, 0, 'Z' + 8},
         {0, 0, 0, 0},
     };
-    int ch, corrlen = 0, numcorr = 0, format_id = 1, quiet = 0, backward_max = 1;
+    int ch, corrlen = 0, numcorr = 0, format_id = 1, quiet = 0, backward_max = 1, coarse = 0;
+    unsigned num_best = DEFAULT_BEST;
+    SampleType sampleType = SAMPLE_FLOAT;
     const char *wavname[2] =
         {
             NULL,
@@ -241,6 +428,30 @@ int main(int argc, char* argv[])
                 }
                 backward_max = std::max(backward_max, -1);
                 break;
+            case 'Z' + 4:
+                if (sscanf(optarg, "%u", &coarse) != 1 || coarse < 1 || coarse > 16 || (coarse & (coarse - 1))) {
+                    TRACE_ERR(1, "invalid arg for '--coarse' option: %s", optarg)
+                }
+                break;
+            case 'Z' + 5:
+                if (sscanf(optarg, "%u", &num_best) != 1 || num_best < 1 || num_best > MAX_BEST) {
+                    TRACE_ERR(1, "invalid arg for '--best' option: %s. Must be integer from 1 to %d", optarg, MAX_BEST)
+                }
+                break;
+            case 'Z' + 6:
+                sampleType = SAMPLE_DOUBLE;
+                break;
+            case 'Z' + 7:
+                sampleType = SAMPLE_INT16;
+                break;
+            case 'Z' + 8: {
+                unsigned threads;
+                if (sscanf(optarg, "%u", &threads) != 1) {
+                    TRACE_ERR(1, "invalid arg for '--threads' option: %s", optarg)
+                }
+                thread_count(threads ? threads : thread_count_max());
+                break;
+            }
             default:
                 usage();
                 return 1;
@@ -262,16 +473,16 @@ int main(int argc, char* argv[])
     TRACE_ERR(wavname[0] == NULL, "reference file name required")
     TRACE_ERR(wavname[1] == NULL, "test file name required")
     unsigned format[2], channels[2], bits_per_sample[2];
-    std::unique_ptr<double[]> pcmBuf[2] = {
-        nullptr,
-    };
+    AlignedArray<unsigned char> pcmBuf[2]; // SampleType samples
     int bias;
+    bool segmented;
+    SegmentedInput segInput;
     {
         WavReader* wrs[2] = {
             NULL,
         };
         for (auto i = 0; i < 2; i++) {
-            wrs[i] = WR_open(wavname[i]);
+            wrs[i] = WR_openMapped(wavname[i]);
             TRACE_ERR(!wrs[i], "can't open for reading: %s", wavname[i])
             format[i] = wrs[i]->format;
             channels[i] = wrs[i]->channels;
@@ -281,14 +492,29 @@ int main(int argc, char* argv[])
                   wrs[1]->channels)
         TRACE_ERR(wrs[0]->sample_rate != wrs[1]->sample_rate, "different sampling rate %u vs. %u", wrs[0]->sample_rate,
                   wrs[1]->sample_rate)
+        for (auto i = 0; i < 2; i++) {
+            if (sampleType == SAMPLE_INT16 && (format[i] != WAVE_FORMAT_PCM || bits_per_sample[i] != 16)) {
+                sampleType = SAMPLE_FLOAT;
+            }
+        }
+        const size_t sampleSize = sampleType == SAMPLE_DOUBLE ? sizeof(double)
+                                  : sampleType == SAMPLE_INT16 ? sizeof(int16_t)
+                                                               : sizeof(float);
         if (corrlen == 0) {
             corrlen = wrs[0]->sample_rate * DEFAUL_CORRLEN_MS / 1000;
         }
         if (numcorr == 0) {
             numcorr = wrs[0]->sample_rate * DEFAUL_NUMCORR_MS / 1000;
         }
+        if (coarse == 0) {
+            coarse = numcorr > COARSE_MIN_NUMCORR ? DEFAULT_COARSE : 1;
+        }
+        // only the reference prefix and one block of lags are kept in memory for a huge -n
+        const unsigned block = xcorr_block(numcorr, corrlen);
+        segmented = coarse == 1 ? block < unsigned(numcorr) : numcorr + corrlen > MAX_INMEMORY_FRAMES;
+        const unsigned spcRequired = segmented ? block + corrlen : numcorr + corrlen;
         for (auto i = 0; i < 2; i++) {
-            pcmBuf[i].reset(new double[wrs[0]->channels * (numcorr + corrlen)]);
+            pcmBuf[i] = aligned_array<unsigned char>(sampleSize * wrs[0]->channels * spcRequired);
         }
         unsigned numZeros[2] =
             {
@@ -304,11 +530,28 @@ int main(int argc, char* argv[])
                      },
                  spcAvail = (unsigned)-1;
         for (auto i = 0; i < 2; i++) {
-            readInput(wrs[i], pcmBuf[i].get(), numcorr + corrlen, numZeros[i], numLow[i], numSamples[i]);
+            WR_willneed(wrs[i], spcRequired);
+            if (sampleType == SAMPLE_DOUBLE) {
+                readInput(wrs[i], wavname[i], (double*)pcmBuf[i].get(), spcRequired, numcorr + corrlen, numZeros[i],
+                          numLow[i], numSamples[i]);
+            } else if (sampleType == SAMPLE_INT16) {
+                readInput(wrs[i], wavname[i], (int16_t*)pcmBuf[i].get(), spcRequired, numcorr + corrlen, numZeros[i],
+                          numLow[i], numSamples[i]);
+            } else {
+                readInput(wrs[i], wavname[i], (float*)pcmBuf[i].get(), spcRequired, numcorr + corrlen, numZeros[i],
+                          numLow[i], numSamples[i]);
+            }
             TRACE_ERR(numSamples[i] < MIN_NUMCORR + MIN_CORRLEN,
                       "%d zeros removed, not enough samples (%d) to align: %s", numZeros[i], numSamples[i], wavname[i])
-            spcAvail = std::min(spcAvail, numSamples[i]);
-            WR_close(wrs[i]);
+            if (segmented) {
+                spcAvail = std::min(spcAvail, wrs[i]->samples_per_channel - numZeros[i] - numLow[i]);
+                segInput.wr[i] = wrs[i];
+                segInput.pending[i] = pcmBuf[i].get();
+                segInput.numPending[i] = numSamples[i];
+            } else {
+                spcAvail = std::min(spcAvail, numSamples[i]);
+                WR_close(wrs[i]);
+            }
         }
         if (spcAvail < unsigned(numcorr + corrlen)) {
             float r = float(corrlen) / (numcorr + corrlen);
@@ -327,12 +570,27 @@ int main(int argc, char* argv[])
         bias = numZeros[1] + numLow[1] - numZeros[0] - numLow[0];
     }
 
-    float ssd[NUM_BEST];
-    int offsets[NUM_BEST];
-    bestOffset(ssd, offsets, pcmBuf[0].get(), pcmBuf[1].get(), channels[0], numcorr, corrlen, bias);
+    float ssd[MAX_BEST];
+    int offsets[MAX_BEST];
+    AlignWorkspace ws;
+    {
+        const void* pcm[2] = {pcmBuf[0].get(), pcmBuf[1].get()};
+        SegmentedInput* seg = segmented ? &segInput : NULL;
+        if (sampleType == SAMPLE_DOUBLE) {
+            searchOffsets<double>(ssd, offsets, num_best, pcm, seg, channels[0], numcorr, corrlen, bias, coarse, &ws);
+        } else if (sampleType == SAMPLE_INT16) {
+            searchOffsets<int16_t>(ssd, offsets, num_best, pcm, seg, channels[0], numcorr, corrlen, bias, coarse, &ws);
+        } else {
+            searchOffsets<float>(ssd, offsets, num_best, pcm, seg, channels[0], numcorr, corrlen, bias, coarse, &ws);
+        }
+        if (segmented) {
+            WR_close(segInput.wr[0]);
+            WR_close(segInput.wr[1]);
+        }
+    }
     const int offset = offsets[0];
     if (!quiet) {
-        for (unsigned i = 0; i < NUM_BEST; i++) {
+        for (unsigned i = 0; i < num_best; i++) {
             printf("offset=%d ssd=%f\n", offsets[i], ssd[i]);
         }
     } else {
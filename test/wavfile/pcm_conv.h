@@ -13,7 +13,7 @@
 __inline static int32_t pcmconv_to_int32(const unsigned char* pcm, int format, unsigned bits_per_sample,
                                          int* err_sticky)
 {
-    int32_t x;
+    int32_t x = 0;
     if (format == WAVE_FORMAT_PCM) {
         if (bits_per_sample == 16) {
             x = *((short*)pcm);
@@ -85,9 +85,9 @@ __inline static int32_t pcmconv_to_int32(const unsigned char* pcm, int format, u
 __inline static double pcmconv_to_double(const unsigned char* pcm, int format, unsigned bits_per_sample,
                                          int* err_sticky)
 {
-    double x;
+    double x = 0;
     if (format == WAVE_FORMAT_PCM) {
-        int32_t y;
+        int32_t y = 0;
         if (bits_per_sample == 16) {
             y = *((short*)pcm);
             y <<= 16;
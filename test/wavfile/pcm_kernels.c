@@ -0,0 +1,359 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#include "pcm_kernels.h"
+#include "wavreader.h" // WAVE_FORMAT_*
+#include "pcm_conv.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// AVX2 loops are compiled with a target attribute and picked at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PCM_AVX2
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#define PCM_INT_SCALE ((1UL << 31) - 1) // pcmconv_to_double() of integer PCM
+
+static int g_avx2 = 1;
+
+void pcm_kernels_avx2(int enable)
+{
+    g_avx2 = enable;
+}
+
+//
+// Scalar loops: pcmconv_*() with a constant layout, the per-sample branches fold away
+//
+#define DECODE_LOOPS(name, format, bits, block) \
+    static void name##_16(const unsigned char* pcm, void* data, unsigned n) \
+    { \
+        int err_sticky = 0; \
+        int16_t* out = (int16_t*)data; \
+        for (unsigned i = 0; i < n; i++) { \
+            out[i] = (int16_t)(pcmconv_to_int32(pcm + i * (block), format, bits, &err_sticky) >> 16); \
+        } \
+    } \
+    static void name##_24(const unsigned char* pcm, void* data, unsigned n) \
+    { \
+        int err_sticky = 0; \
+        unsigned char* out = (unsigned char*)data; \
+        for (unsigned i = 0; i < n; i++) { \
+            int32_t x = pcmconv_to_int32(pcm + i * (block), format, bits, &err_sticky); \
+            out[3 * i + 0] = (unsigned char)(x >> 8); \
+            out[3 * i + 1] = (unsigned char)(x >> 16); \
+            out[3 * i + 2] = (unsigned char)(x >> 24); \
+        } \
+    } \
+    static void name##_32(const unsigned char* pcm, void* data, unsigned n) \
+    { \
+        int err_sticky = 0; \
+        int32_t* out = (int32_t*)data; \
+        for (unsigned i = 0; i < n; i++) { \
+            out[i] = pcmconv_to_int32(pcm + i * (block), format, bits, &err_sticky); \
+        } \
+    } \
+    static void name##_float(const unsigned char* pcm, void* data, unsigned n) \
+    { \
+        int err_sticky = 0; \
+        float* out = (float*)data; \
+        for (unsigned i = 0; i < n; i++) { \
+            out[i] = (float)pcmconv_to_double(pcm + i * (block), format, bits, &err_sticky); \
+        } \
+    } \
+    static void name##_double(const unsigned char* pcm, void* data, unsigned n) \
+    { \
+        int err_sticky = 0; \
+        double* out = (double*)data; \
+        for (unsigned i = 0; i < n; i++) { \
+            out[i] = pcmconv_to_double(pcm + i * (block), format, bits, &err_sticky); \
+        } \
+    } \
+    static const PcmDecodeFn name[SMPL_FMT_NUM] = {name##_16, name##_24, name##_32, name##_float, name##_double};
+
+DECODE_LOOPS(decode_pcm16, WAVE_FORMAT_PCM, 16, 2)
+DECODE_LOOPS(decode_pcm24, WAVE_FORMAT_PCM, 24, 3)
+DECODE_LOOPS(decode_pcm32, WAVE_FORMAT_PCM, 32, 4)
+DECODE_LOOPS(decode_ieee32, WAVE_FORMAT_IEEE_FLOAT, 32, 4)
+DECODE_LOOPS(decode_audition24, WAVE_FORMAT_FLOAT_AUDITION, 24, 4)
+DECODE_LOOPS(decode_audition32, WAVE_FORMAT_FLOAT_AUDITION, 32, 4)
+
+static void copy_pcm16(const unsigned char* pcm, void* data, unsigned n)
+{
+    memcpy(data, pcm, 2 * (size_t)n);
+}
+static void copy_ieee32(const unsigned char* pcm, void* data, unsigned n)
+{
+    memcpy(data, pcm, 4 * (size_t)n);
+}
+
+#ifdef PCM_AVX2
+//
+// 8 samples per iteration, to double then to float as the scalar code does
+//
+static TARGET_AVX2 __inline void store_pcm_avx2(__m256i x, float* out)
+{
+    const __m256d scale = _mm256_set1_pd((double)PCM_INT_SCALE);
+    __m256d lo = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(x)), scale);
+    __m256d hi = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(x, 1)), scale);
+    _mm_storeu_ps(out, _mm256_cvtpd_ps(lo));
+    _mm_storeu_ps(out + 4, _mm256_cvtpd_ps(hi));
+}
+static TARGET_AVX2 __inline void store_pcm_avx2_double(__m256i x, double* out)
+{
+    const __m256d scale = _mm256_set1_pd((double)PCM_INT_SCALE);
+    _mm256_storeu_pd(out, _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(x)), scale));
+    _mm256_storeu_pd(out + 4, _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(x, 1)), scale));
+}
+static TARGET_AVX2 __inline __m256i load_pcm16_avx2(const unsigned char* pcm)
+{
+    return _mm256_slli_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)pcm)), 16);
+}
+// Reads 4 bytes past the 8 samples
+static TARGET_AVX2 __inline __m256i load_pcm24_avx2(const unsigned char* pcm)
+{
+    const __m256i shuffle = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, //
+                                             -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    __m256i x = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)pcm));
+    x = _mm256_inserti128_si256(x, _mm_loadu_si128((const __m128i*)(pcm + 12)), 1);
+    return _mm256_shuffle_epi8(x, shuffle);
+}
+
+static TARGET_AVX2 void decode_pcm16_float_avx2(const unsigned char* pcm, void* data, unsigned n)
+{
+    float* out = (float*)data;
+    unsigned i = 0;
+    for (; i + 8 <= n; i += 8) {
+        store_pcm_avx2(load_pcm16_avx2(pcm + 2 * i), out + i);
+    }
+    decode_pcm16_float(pcm + 2 * i, out + i, n - i);
+}
+static TARGET_AVX2 void decode_pcm16_double_avx2(const unsigned char* pcm, void* data, unsigned n)
+{
+    double* out = (double*)data;
+    unsigned i = 0;
+    for (; i + 8 <= n; i += 8) {
+        store_pcm_avx2_double(load_pcm16_avx2(pcm + 2 * i), out + i);
+    }
+    decode_pcm16_double(pcm + 2 * i, out + i, n - i);
+}
+static TARGET_AVX2 void decode_pcm24_float_avx2(const unsigned char* pcm, void* data, unsigned n)
+{
+    float* out = (float*)data;
+    unsigned i = 0;
+    for (; i + 10 <= n; i += 8) { // 28 bytes read
+        store_pcm_avx2(load_pcm24_avx2(pcm + 3 * i), out + i);
+    }
+    decode_pcm24_float(pcm + 3 * i, out + i, n - i);
+}
+static TARGET_AVX2 void decode_pcm24_double_avx2(const unsigned char* pcm, void* data, unsigned n)
+{
+    double* out = (double*)data;
+    unsigned i = 0;
+    for (; i + 10 <= n; i += 8) {
+        store_pcm_avx2_double(load_pcm24_avx2(pcm + 3 * i), out + i);
+    }
+    decode_pcm24_double(pcm + 3 * i, out + i, n - i);
+}
+static TARGET_AVX2 void decode_ieee32_double_avx2(const unsigned char* pcm, void* data, unsigned n)
+{
+    double* out = (double*)data;
+    unsigned i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_pd(out + i, _mm256_cvtps_pd(_mm_loadu_ps((const float*)(pcm + 4 * i))));
+        _mm256_storeu_pd(out + i + 4, _mm256_cvtps_pd(_mm_loadu_ps((const float*)(pcm + 4 * i + 16))));
+    }
+    decode_ieee32_double(pcm + 4 * i, out + i, n - i);
+}
+#endif
+
+PcmDecodeFn pcm_decoder(unsigned format, unsigned bits_per_sample, unsigned sample_block, SmplFmt smpl_fmt)
+{
+    const PcmDecodeFn* loops = NULL;
+    if (format == WAVE_FORMAT_PCM && bits_per_sample == 16 && sample_block == 2) {
+        loops = decode_pcm16;
+    } else if (format == WAVE_FORMAT_PCM && (bits_per_sample == 24 || bits_per_sample == 20) && sample_block == 3) {
+        loops = decode_pcm24;
+    } else if (format == WAVE_FORMAT_PCM && bits_per_sample == 32 && sample_block == 4) {
+        loops = decode_pcm32;
+    } else if (format == WAVE_FORMAT_IEEE_FLOAT && bits_per_sample == 32 && sample_block == 4) {
+        loops = decode_ieee32;
+    } else if (format == WAVE_FORMAT_FLOAT_AUDITION && bits_per_sample == 24 && sample_block == 4) {
+        loops = decode_audition24;
+    } else if (format == WAVE_FORMAT_FLOAT_AUDITION && bits_per_sample == 32 && sample_block == 4) {
+        loops = decode_audition32;
+    }
+    if (!loops || smpl_fmt >= SMPL_FMT_NUM) {
+        return NULL;
+    }
+    if (loops == decode_pcm16 && smpl_fmt == SMPL_FMT_16) {
+        return copy_pcm16;
+    }
+    if (loops == decode_ieee32 && smpl_fmt == SMPL_FMT_FLOAT) {
+        return copy_ieee32;
+    }
+#ifdef PCM_AVX2
+    if (g_avx2 && __builtin_cpu_supports("avx2")) {
+        if (loops == decode_pcm16 && smpl_fmt == SMPL_FMT_FLOAT) {
+            return decode_pcm16_float_avx2;
+        } else if (loops == decode_pcm16 && smpl_fmt == SMPL_FMT_DOUBLE) {
+            return decode_pcm16_double_avx2;
+        } else if (loops == decode_pcm24 && smpl_fmt == SMPL_FMT_FLOAT) {
+            return decode_pcm24_float_avx2;
+        } else if (loops == decode_pcm24 && smpl_fmt == SMPL_FMT_DOUBLE) {
+            return decode_pcm24_double_avx2;
+        } else if (loops == decode_ieee32 && smpl_fmt == SMPL_FMT_DOUBLE) {
+            return decode_ieee32_double_avx2;
+        }
+    }
+#endif
+    return loops[smpl_fmt];
+}
+
+//
+// Encode loops, user samples to the file format, one macro per file format: same format pairs are copies
+//
+#define ENCODE_PCM16(name, format, bits) \
+    static void name##_pcm16(const unsigned char* data, unsigned char* pcm, unsigned n) \
+    { \
+        int err_sticky = 0; \
+        for (unsigned i = 0; i < n; i++) { \
+            int16_t x = (int16_t)(pcmconv_to_int32(data + i * ((bits) >> 3), format, bits, &err_sticky) >> 16); \
+            memcpy(pcm + 2 * i, &x, sizeof(x)); \
+        } \
+    }
+#define ENCODE_PCM24(name, format, bits) \
+    static void name##_pcm24(const unsigned char* data, unsigned char* pcm, unsigned n) \
+    { \
+        int err_sticky = 0; \
+        for (unsigned i = 0; i < n; i++) { \
+            int32_t x = pcmconv_to_int32(data + i * ((bits) >> 3), format, bits, &err_sticky); \
+            pcm[3 * i + 0] = (unsigned char)(x >> 8); \
+            pcm[3 * i + 1] = (unsigned char)(x >> 16); \
+            pcm[3 * i + 2] = (unsigned char)(x >> 24); \
+        } \
+    }
+#define ENCODE_PCM32(name, format, bits) \
+    static void name##_pcm32(const unsigned char* data, unsigned char* pcm, unsigned n) \
+    { \
+        int err_sticky = 0; \
+        for (unsigned i = 0; i < n; i++) { \
+            int32_t x = pcmconv_to_int32(data + i * ((bits) >> 3), format, bits, &err_sticky); \
+            memcpy(pcm + 4 * i, &x, sizeof(x)); \
+        } \
+    }
+#define ENCODE_IEEE32(name, format, bits) \
+    static void name##_ieee32(const unsigned char* data, unsigned char* pcm, unsigned n) \
+    { \
+        int err_sticky = 0; \
+        for (unsigned i = 0; i < n; i++) { \
+            float x = (float)pcmconv_to_double(data + i * ((bits) >> 3), format, bits, &err_sticky); \
+            memcpy(pcm + 4 * i, &x, sizeof(x)); \
+        } \
+    }
+
+ENCODE_PCM24(encode_int16, WAVE_FORMAT_PCM, 16)
+ENCODE_PCM32(encode_int16, WAVE_FORMAT_PCM, 16)
+ENCODE_IEEE32(encode_int16, WAVE_FORMAT_PCM, 16)
+ENCODE_PCM16(encode_int24, WAVE_FORMAT_PCM, 24)
+ENCODE_PCM32(encode_int24, WAVE_FORMAT_PCM, 24)
+ENCODE_IEEE32(encode_int24, WAVE_FORMAT_PCM, 24)
+ENCODE_PCM16(encode_int32, WAVE_FORMAT_PCM, 32)
+ENCODE_PCM24(encode_int32, WAVE_FORMAT_PCM, 32)
+ENCODE_IEEE32(encode_int32, WAVE_FORMAT_PCM, 32)
+ENCODE_PCM16(encode_float, WAVE_FORMAT_IEEE_FLOAT, 32)
+ENCODE_PCM24(encode_float, WAVE_FORMAT_IEEE_FLOAT, 32)
+ENCODE_PCM32(encode_float, WAVE_FORMAT_IEEE_FLOAT, 32)
+
+static void copy_int24(const unsigned char* data, unsigned char* pcm, unsigned n)
+{
+    memcpy(pcm, data, 3 * (size_t)n);
+}
+static void copy_32(const unsigned char* data, unsigned char* pcm, unsigned n)
+{
+    memcpy(pcm, data, 4 * (size_t)n);
+}
+static void copy_int16(const unsigned char* data, unsigned char* pcm, unsigned n)
+{
+    memcpy(pcm, data, 2 * (size_t)n);
+}
+
+#ifdef PCM_AVX2
+// pcmconv_to_int32() of 8 floats: scaled by 2^31 and truncated, clipped to [-1, 1)
+static TARGET_AVX2 __inline __m256i load_float_avx2(const unsigned char* data)
+{
+    const __m256 y = _mm256_loadu_ps((const float*)data);
+    const __m256i x = _mm256_cvttps_epi32(_mm256_mul_ps(y, _mm256_set1_ps(2147483648.f))); // INT32_MIN outside
+    const __m256 y_max = _mm256_cmp_ps(y, _mm256_set1_ps(1.f), _CMP_GE_OQ);
+    return _mm256_blendv_epi8(x, _mm256_set1_epi32(0x7fffffff), _mm256_castps_si256(y_max));
+}
+
+static TARGET_AVX2 void encode_float_pcm16_avx2(const unsigned char* data, unsigned char* pcm, unsigned n)
+{
+    unsigned i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i lo = _mm256_srai_epi32(load_float_avx2(data + 4 * i), 16);
+        __m256i hi = _mm256_srai_epi32(load_float_avx2(data + 4 * i + 32), 16);
+        __m256i x = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i*)(pcm + 2 * i), x);
+    }
+    encode_float_pcm16(data + 4 * i, pcm + 2 * i, n - i);
+}
+// Writes 4 bytes past the 8 samples
+static TARGET_AVX2 void encode_float_pcm24_avx2(const unsigned char* data, unsigned char* pcm, unsigned n)
+{
+    const __m256i shuffle = _mm256_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1, //
+                                             1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+    unsigned i = 0;
+    for (; i + 10 <= n; i += 8) { // 28 bytes written
+        __m256i x = _mm256_shuffle_epi8(load_float_avx2(data + 4 * i), shuffle);
+        _mm_storeu_si128((__m128i*)(pcm + 3 * i), _mm256_castsi256_si128(x));
+        _mm_storeu_si128((__m128i*)(pcm + 3 * i + 12), _mm256_extracti128_si256(x, 1));
+    }
+    encode_float_pcm24(data + 4 * i, pcm + 3 * i, n - i);
+}
+static TARGET_AVX2 void encode_float_pcm32_avx2(const unsigned char* data, unsigned char* pcm, unsigned n)
+{
+    unsigned i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i*)(pcm + 4 * i), load_float_avx2(data + 4 * i));
+    }
+    encode_float_pcm32(data + 4 * i, pcm + 4 * i, n - i);
+}
+#endif
+
+PcmEncodeFn pcm_encoder(SmplFmt smpl_fmt, unsigned format, unsigned bits_per_sample)
+{
+    static const PcmEncodeFn loops[][4] = {
+        // PCM 16, 24, 32, IEEE float
+        {copy_int16, encode_int16_pcm24, encode_int16_pcm32, encode_int16_ieee32},
+        {encode_int24_pcm16, copy_int24, encode_int24_pcm32, encode_int24_ieee32},
+        {encode_int32_pcm16, encode_int32_pcm24, copy_32, encode_int32_ieee32},
+        {encode_float_pcm16, encode_float_pcm24, encode_float_pcm32, copy_32},
+    };
+    unsigned out;
+    if (format == WAVE_FORMAT_PCM && (bits_per_sample == 16 || bits_per_sample == 24 || bits_per_sample == 32)) {
+        out = bits_per_sample / 8 - 2;
+    } else if (format == WAVE_FORMAT_IEEE_FLOAT && bits_per_sample == 32) {
+        out = 3;
+    } else {
+        return NULL;
+    }
+    if (smpl_fmt > SMPL_FMT_FLOAT) {
+        return NULL;
+    }
+#ifdef PCM_AVX2
+    if (smpl_fmt == SMPL_FMT_FLOAT && g_avx2 && __builtin_cpu_supports("avx2")) {
+        static const PcmEncodeFn loops_avx2[3] = {encode_float_pcm16_avx2, encode_float_pcm24_avx2,
+                                                  encode_float_pcm32_avx2};
+        if (out < 3) {
+            return loops_avx2[out];
+        }
+    }
+#endif
+    return loops[smpl_fmt][out];
+}
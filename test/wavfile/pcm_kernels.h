@@ -0,0 +1,47 @@
+/*
+ * Copyright  2019 Dmitry Yudin. All rights reserved.
+ * Licensed under the Apache License, Version 2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// wavreader/wavwriter internal use, pcm_kernels_avx2() aside
+//
+// Conversion loops specialized per file format and user sample type, chosen once per file.
+// The results are the same as of pcmconv_to_int32()/pcmconv_to_double() per sample.
+//
+typedef enum {
+    SMPL_FMT_16,
+    SMPL_FMT_24,
+    SMPL_FMT_32,
+    SMPL_FMT_FLOAT,
+    SMPL_FMT_DOUBLE,
+    SMPL_FMT_NUM,
+} SmplFmt;
+
+// Allows the AVX2 loops when the CPU has AVX2 [default: 1]. The application passes its own SIMD level,
+// e.g. lowered by WAVALIGN_CPU, set before the files are opened.
+void pcm_kernels_avx2(int enable);
+
+// 'n' samples of the file at 'pcm' to 'smpl_fmt' samples at 'data'
+typedef void (*PcmDecodeFn)(const unsigned char* pcm, void* data, unsigned n);
+
+// NULL if there is no loop for the file layout, 'sample_block' bytes per sample
+PcmDecodeFn pcm_decoder(unsigned format, unsigned bits_per_sample, unsigned sample_block, SmplFmt smpl_fmt);
+
+// 'n' 'smpl_fmt' samples at 'data' to the file format at 'pcm'
+typedef void (*PcmEncodeFn)(const unsigned char* data, unsigned char* pcm, unsigned n);
+
+// NULL if there is no loop for the pair, packed samples in the file
+PcmEncodeFn pcm_encoder(SmplFmt smpl_fmt, unsigned format, unsigned bits_per_sample);
+
+#ifdef __cplusplus
+}
+#endif
@@ -7,11 +7,14 @@
 
 #include "wavreader.h"
 #include "wavwriter.h"
+#include "pcm_conv.h"
+#include "pcm_kernels.h"
 
 #include <assert.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <new>
 
@@ -66,7 +69,7 @@ static int test_readSmpl(const char *filename)
 
     unsigned bytesTotal = wr->samples_per_channel * wr->block_align;
     unsigned char *data = new (std::nothrow) unsigned char[bytesTotal];
-    TRACE_ERR(wr->samples_per_channel != WR_readRaw(wr, data, wr->samples_per_channel), "Error reading data: %s",
+    TRACE_ERR((int)wr->samples_per_channel != WR_readRaw(wr, data, wr->samples_per_channel), "Error reading data: %s",
               filename)
 
     unsigned channels = wr->channels;
@@ -75,7 +78,8 @@ static int test_readSmpl(const char *filename)
 
     for (unsigned i = 0; i < wr->samples_per_channel; i++) {
         for (unsigned ch = 0; ch < (unsigned)wr->channels; ch++) {
-            int x, y, idx = i * wr->channels + ch;
+            int x, y;
+            unsigned idx = i * wr->channels + ch;
             if (idx < COUNT_OF(pcm_data)) {
                 x = pcm_data[idx];
             } else {
@@ -133,19 +137,275 @@ static int test_readSmpl(const char *filename)
     return 0;
 }
 
-typedef enum {
-    SMPL_FMT_16,
-    SMPL_FMT_24,
-    SMPL_FMT_32,
-    SMPL_FMT_FLOAT,
-    SMPL_FMT_DOUBLE,
-} SmplFmt;
-static int test_readBuf(const char *filename, SmplFmt smpl_fmt, unsigned char *_data, unsigned *_samples_channel)
+// Metadata chunks around 'data' are skipped and listed in the directory
+static int test_chunks(const char *filename_ref, unsigned junk_len)
 {
-    sprintf(testPref, "%s(%s, %d)", "test_readBuf", filename, smpl_fmt);
+    sprintf(testPref, "%s(%s, %u)", "test_chunks", filename_ref, junk_len);
+
+    // RIFF WAVE, JUNK, chunks of the reference file, LIST
+    FILE *fp = fopen(filename_ref, "rb");
+    TRACE_ERR(fp == NULL, "Can't open for reading %s", filename_ref)
+    fseek(fp, 0, SEEK_END);
+    const unsigned ref_len = (unsigned)ftell(fp), list_len = 10, len = ref_len + 8 + junk_len + 8 + list_len;
+    fseek(fp, 0, SEEK_SET);
+    unsigned char *file = new (std::nothrow) unsigned char[len];
+    memset(file, 0, len);
+    TRACE_ERR(12 != fread(file, 1, 12, fp), "Error reading %s", filename_ref)
+    TRACE_ERR(ref_len - 12 != fread(file + 20 + junk_len, 1, ref_len - 12, fp), "Error reading %s", filename_ref)
+    fclose(fp);
+    memcpy(file + 12, "JUNK", 4);
+    memcpy(file + len - 8 - list_len, "LIST", 4);
+    for (unsigned i = 0; i < 4; i++) {
+        file[4 + i] = (unsigned char)((len - 8) >> 8 * i);
+        file[16 + i] = (unsigned char)(junk_len >> 8 * i);
+        file[len - 4 - list_len + i] = (unsigned char)(list_len >> 8 * i);
+    }
+    const char *filename = "tmp.wav";
+    TRACE_ERR(0 != dump(filename, file, len), "dump error")
+    delete[] file;
+
+    WavReader *wr_ref = WR_open(filename_ref);
+    TRACE_ERR(NULL == wr_ref, "Can't open for reading %s", filename_ref)
+    const unsigned n = wr_ref->samples_per_channel * wr_ref->channels;
+    short *data_ref = new (std::nothrow) short[n], *data = new (std::nothrow) short[n];
+    WR_readInt16(wr_ref, data_ref, wr_ref->samples_per_channel);
+    WR_close(wr_ref);
+    for (int mapped = 0; mapped < 2; mapped++) {
+        WavReader *wr = mapped ? WR_openMapped(filename) : WR_open(filename);
+        TRACE_ERR(NULL == wr, "Can't open for reading %s", filename)
+        unsigned count;
+        const WavChunk *chunks = WR_chunks(wr, &count);
+        TRACE_ERR(count < 4, "Wrong chunks number: %u", count)
+        TRACE_ERR(chunks[0].tag != WR_TAG('J', 'U', 'N', 'K') || chunks[0].offset != 20 ||
+                      chunks[0].size != junk_len,
+                  "Wrong first chunk")
+        TRACE_ERR(chunks[count - 1].tag != WR_TAG('L', 'I', 'S', 'T') || chunks[count - 1].size != list_len ||
+                      chunks[count - 1].offset != len - list_len,
+                  "Wrong last chunk")
+        const WavChunk *chunk = WR_findChunk(wr, WR_TAG('d', 'a', 't', 'a'));
+        TRACE_ERR(!chunk || chunk->size < wr->samples_per_channel * wr->block_align, "No 'data' chunk")
+        TRACE_ERR(WR_findChunk(wr, WR_TAG('b', 'e', 'x', 't')), "Unexpected 'bext' chunk")
+        TRACE_ERR(wr->samples_per_channel * wr->channels != n, "Wrong samples number: %u", wr->samples_per_channel)
+        TRACE_ERR((int)wr->samples_per_channel != WR_readInt16(wr, data, wr->samples_per_channel),
+                  "Error reading data: %s", filename)
+        TRACE_ERR(0 != memcmp(data, data_ref, n * sizeof(*data)), "Different data read")
+        WR_close(wr);
+    }
+    delete[] data_ref;
+    delete[] data;
+    printf("ok: %s\n", testPref);
 
-    WavReader *wr = WR_open(filename);
+    return 0;
+}
+
+// Decode loops give the same bits as pcmconv_*() per sample, SIMD bodies and tails included
+static int test_decoders()
+{
+    static const struct {
+        unsigned format, bits_per_sample, sample_block;
+        float range; // float formats, 0 for integer PCM
+    } layouts[] = {
+        {WAVE_FORMAT_PCM, 16, 2, 0},
+        {WAVE_FORMAT_PCM, 20, 3, 0},
+        {WAVE_FORMAT_PCM, 24, 3, 0},
+        {WAVE_FORMAT_PCM, 32, 4, 0},
+        {WAVE_FORMAT_IEEE_FLOAT, 32, 4, 1.f},
+        {WAVE_FORMAT_FLOAT_AUDITION, 24, 4, (float)(1UL << 23)},
+        {WAVE_FORMAT_FLOAT_AUDITION, 32, 4, (float)(1UL << 15)},
+    };
+    const unsigned N = 1000, lengths[] = {N, N - 1, 13, 9, 7, 0};
+    unsigned char *pcm = new (std::nothrow) unsigned char[4 * N];
+    double *data = new (std::nothrow) double[N + 1], *data_ref = new (std::nothrow) double[N];
+    srand(1);
+    for (unsigned l = 0; l < COUNT_OF(layouts); l++) {
+        const unsigned block = layouts[l].sample_block;
+        for (unsigned i = 0; i < N; i++) {
+            if (layouts[l].range == 0) {
+                for (unsigned k = 0; k < block; k++) {
+                    pcm[i * block + k] = (unsigned char)rand();
+                }
+            } else {
+                float x = layouts[l].range * (2.5f * rand() / RAND_MAX - 1.25f); // clipped as well
+                memcpy(pcm + i * block, &x, sizeof(x));
+            }
+        }
+        for (unsigned f = 0; f < SMPL_FMT_NUM; f++) {
+            const SmplFmt smpl_fmt = (SmplFmt)f;
+            sprintf(testPref, "%s(%u, %u, %d)", "test_decoders", layouts[l].format, layouts[l].bits_per_sample,
+                    smpl_fmt);
+            PcmDecodeFn decode = pcm_decoder(layouts[l].format, layouts[l].bits_per_sample, block, smpl_fmt);
+            TRACE_ERR(!decode, "No decoder")
+            for (unsigned n : lengths) {
+                unsigned char *out = (unsigned char *)data_ref;
+                int err_sticky = 0;
+                for (unsigned i = 0; i < n; i++) {
+                    const unsigned char *in = pcm + i * block;
+                    if (smpl_fmt == SMPL_FMT_FLOAT || smpl_fmt == SMPL_FMT_DOUBLE) {
+                        double x = pcmconv_to_double(in, layouts[l].format, layouts[l].bits_per_sample, &err_sticky);
+                        if (smpl_fmt == SMPL_FMT_FLOAT) {
+                            float y = (float)x;
+                            memcpy(out, &y, sizeof(y));
+                            out += sizeof(y);
+                        } else {
+                            memcpy(out, &x, sizeof(x));
+                            out += sizeof(x);
+                        }
+                        continue;
+                    }
+                    int32_t x = pcmconv_to_int32(in, layouts[l].format, layouts[l].bits_per_sample, &err_sticky);
+                    if (smpl_fmt == SMPL_FMT_16) {
+                        int16_t y = (int16_t)(x >> 16);
+                        memcpy(out, &y, sizeof(y));
+                        out += sizeof(y);
+                    } else if (smpl_fmt == SMPL_FMT_24) {
+                        *out++ = (unsigned char)(x >> 8);
+                        *out++ = (unsigned char)(x >> 16);
+                        *out++ = (unsigned char)(x >> 24);
+                    } else {
+                        memcpy(out, &x, sizeof(x));
+                        out += sizeof(x);
+                    }
+                }
+                const size_t len = out - (unsigned char *)data_ref;
+                memset(data, 0xa5, (len + 8) & ~7u);
+                decode(pcm, data, n);
+                TRACE_ERR(0 != memcmp(data, data_ref, len), "Different decoded data, %u samples", n)
+                TRACE_ERR(((unsigned char *)data)[len] != 0xa5, "Written past %u samples", n)
+            }
+        }
+    }
+    delete[] pcm;
+    delete[] data;
+    delete[] data_ref;
+    printf("ok: %s\n", "test_decoders");
+
+    return 0;
+}
+// Encode loops give the same file bytes as pcmconv_*() per sample, clipping included
+static int test_encoders()
+{
+    static const struct {
+        unsigned format, bits_per_sample;
+    } layouts[] = {
+        {WAVE_FORMAT_PCM, 16},
+        {WAVE_FORMAT_PCM, 24},
+        {WAVE_FORMAT_PCM, 32},
+        {WAVE_FORMAT_IEEE_FLOAT, 32},
+    };
+    const unsigned N = 1000, lengths[] = {N, N - 1, 17, 13, 9, 7, 0};
+    unsigned char *data = new (std::nothrow) unsigned char[4 * N];
+    unsigned char *pcm = new (std::nothrow) unsigned char[4 * N + 1];
+    unsigned char *pcm_ref = new (std::nothrow) unsigned char[4 * N];
+    srand(2);
+    for (unsigned f = 0; f < SMPL_FMT_DOUBLE; f++) {
+        const SmplFmt smpl_fmt = (SmplFmt)f;
+        const unsigned in_format = smpl_fmt == SMPL_FMT_FLOAT ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+        const unsigned in_bits = smpl_fmt == SMPL_FMT_16 ? 16 : smpl_fmt == SMPL_FMT_24 ? 24 : 32;
+        for (unsigned i = 0; i < N * (in_bits >> 3); i++) {
+            data[i] = (unsigned char)rand();
+        }
+        if (smpl_fmt == SMPL_FMT_FLOAT) {
+            for (unsigned i = 0; i < N; i++) {
+                float x = 2.5f * rand() / RAND_MAX - 1.25f; // clipped as well
+                x = i == 1 ? 1.f : i == 2 ? -1.f : x;
+                memcpy(data + 4 * i, &x, sizeof(x));
+            }
+        }
+        for (unsigned l = 0; l < COUNT_OF(layouts); l++) {
+            const unsigned block = layouts[l].bits_per_sample >> 3;
+            sprintf(testPref, "%s(%d, %u, %u)", "test_encoders", smpl_fmt, layouts[l].format,
+                    layouts[l].bits_per_sample);
+            PcmEncodeFn encode = pcm_encoder(smpl_fmt, layouts[l].format, layouts[l].bits_per_sample);
+            TRACE_ERR(!encode, "No encoder")
+            for (unsigned n : lengths) {
+                int err_sticky = 0;
+                for (unsigned i = 0; i < n; i++) {
+                    const unsigned char *in = data + i * (in_bits >> 3);
+                    unsigned char *out = pcm_ref + i * block;
+                    if (layouts[l].format == WAVE_FORMAT_IEEE_FLOAT) {
+                        float x = (float)pcmconv_to_double(in, in_format, in_bits, &err_sticky);
+                        memcpy(out, &x, sizeof(x));
+                        continue;
+                    }
+                    int32_t x = pcmconv_to_int32(in, in_format, in_bits, &err_sticky);
+                    for (unsigned k = 0; k < block; k++) {
+                        out[k] = (unsigned char)(x >> (8 * (4 - block + k)));
+                    }
+                }
+                memset(pcm, 0xa5, n * block + 1);
+                encode(data, pcm, n);
+                TRACE_ERR(0 != memcmp(pcm, pcm_ref, n * block), "Different encoded data, %u samples", n)
+                TRACE_ERR(pcm[n * block] != 0xa5, "Written past %u samples", n)
+            }
+        }
+    }
+    delete[] data;
+    delete[] pcm;
+    delete[] pcm_ref;
+    printf("ok: %s\n", "test_encoders");
+
+    return 0;
+}
+
+// Raw data copied past 'skip' samples after 'zeros' silent ones, same format files only
+static int test_copyRaw(const char *filename_ref, unsigned skip, unsigned zeros)
+{
+    sprintf(testPref, "%s(%s, %u, %u)", "test_copyRaw", filename_ref, skip, zeros);
+
+    WavReader *wr = WR_open(filename_ref);
+    TRACE_ERR(NULL == wr, "Can't open for reading %s", filename_ref)
+    const char *filename = "tmp.wav";
+    WavWriter *ww = WW_open(filename, wr->format, wr->channels, wr->sample_rate, wr->bits_per_sample);
+    if (!ww || ww->block_align != wr->block_align) { // not a writer format
+        if (ww) {
+            WW_close(ww);
+        }
+        WR_close(wr);
+        return 0;
+    }
+    const unsigned block_align = wr->block_align, spc = wr->samples_per_channel;
+    unsigned char *data_ref = new (std::nothrow) unsigned char[(spc + zeros) * block_align];
+    unsigned char *data = new (std::nothrow) unsigned char[(spc + zeros) * block_align];
+    memset(data_ref, 0, zeros * block_align);
+    TRACE_ERR((int)spc != WR_readRaw(wr, data_ref + zeros * block_align, spc), "Error reading data: %s", filename_ref)
+    const WavChunk *chunk = WR_findChunk(wr, WR_TAG('d', 'a', 't', 'a'));
+    TRACE_ERR(!chunk, "No 'data' chunk")
+    TRACE_ERR((int)zeros != WW_writeRaw(ww, data_ref, zeros), "Error writing data: %s", filename)
+    int n = WW_copyRaw(ww, filename_ref, chunk->offset + skip * block_align, spc - skip);
+    TRACE_ERR(n != (int)(spc - skip), "%d samples of %u copied", n, spc - skip)
+    WW_close(ww);
+    WR_close(wr);
+
+    wr = WR_open(filename);
+    TRACE_ERR(NULL == wr, "Can't open for reading %s", filename)
+    TRACE_ERR(wr->samples_per_channel != zeros + spc - skip, "Wrong samples number: %u", wr->samples_per_channel)
+    TRACE_ERR((int)wr->samples_per_channel != WR_readRaw(wr, data, wr->samples_per_channel), "Error reading data: %s",
+              filename)
+    TRACE_ERR(0 != memcmp(data, data_ref, zeros * block_align), "Different silence")
+    const unsigned char *copied = data + zeros * block_align, *copied_ref = data_ref + (zeros + skip) * block_align;
+    TRACE_ERR(0 != memcmp(copied, copied_ref, (spc - skip) * block_align), "Different copied data")
+    WR_close(wr);
+    delete[] data_ref;
+    delete[] data;
+    printf("ok: %s\n", testPref);
+
+    return 0;
+}
+
+static int test_readBuf(const char *filename, SmplFmt smpl_fmt, int mapped, unsigned char *_data,
+                        unsigned *_samples_channel)
+{
+    sprintf(testPref, "%s(%s, %d%s)", "test_readBuf", filename, smpl_fmt, mapped ? ", mapped" : "");
+
+    WavReader *wr = mapped ? WR_openMapped(filename) : WR_open(filename);
     TRACE_ERR(NULL == wr, "Can't open for reading %s", filename)
+    unsigned spcMapped;
+    const uint8_t *raw = WR_data(wr, &spcMapped);
+    TRACE_ERR(raw && spcMapped != wr->samples_per_channel, "Wrong mapped samples number: %u", spcMapped)
+#if defined(__unix__) || defined(__APPLE__)
+    TRACE_ERR(mapped && !raw, "Not mapped: %s", filename)
+#endif
+    WR_willneed(wr, wr->samples_per_channel);
 
     TRACE_ERR(wr->channels != NUM_CHANNLES, "Wrong channels number: %u", wr->channels)
     TRACE_ERR(wr->sample_rate != SAMPLE_RATE, "Wrong sample rate: %u", wr->sample_rate)
@@ -171,19 +431,22 @@ static int test_readBuf(const char *filename, SmplFmt smpl_fmt, unsigned char *_
         case SMPL_FMT_DOUBLE:
             nRead = WR_readDouble(wr, (double *)data, wr->samples_per_channel);
             break;
+        default:
+            break;
     }
-    TRACE_ERR(nRead != wr->samples_per_channel, "Error reading data: %s", filename)
+    TRACE_ERR(nRead != (int)wr->samples_per_channel, "Error reading data: %s", filename)
 
     for (unsigned i = 0; i < wr->samples_per_channel; i++) {
         for (unsigned ch = 0; ch < wr->channels; ch++) {
-            int x, y, idx = i * wr->channels + ch;
+            int x, y;
+            unsigned idx = i * wr->channels + ch;
             if (idx < COUNT_OF(pcm_data)) {
                 x = pcm_data[idx];
             } else {
                 x = 0; // audition inserts zeros to the end of file
             }
-            double z;
-            float scale_to_i16;
+            double z = 0;
+            float scale_to_i16 = 0;
             switch (smpl_fmt) {
                 case SMPL_FMT_16:
                     scale_to_i16 = 1;
@@ -210,6 +473,8 @@ static int test_readBuf(const char *filename, SmplFmt smpl_fmt, unsigned char *_
                     z = *(double *)data;
                     data += sizeof(double);
                     break;
+                default:
+                    break;
             }
             y = (short)round(z * scale_to_i16);
             TRACE_ERR(x != y, "Wrong samples value at position %u: %d(orig) != %d(read)", i * wr->channels + ch, x, y)
@@ -244,6 +509,8 @@ static int test_writeBuf(const char *filename_ref, SmplFmt smpl_fmt, unsigned ch
         case SMPL_FMT_DOUBLE: // skip
             bits_per_sample = 64;
             break;
+        default:
+            return 1;
     }
     WavWriter *ww = WW_open(filename, WAVE_FORMAT_PCM, NUM_CHANNLES, SAMPLE_RATE, bits_per_sample);
     TRACE_ERR(NULL == ww, "Can't open for writing %s", filename)
@@ -263,10 +530,11 @@ static int test_writeBuf(const char *filename_ref, SmplFmt smpl_fmt, unsigned ch
             nWritten = WW_writeFloat(ww, (float *)data_ref, samples_channel);
             break;
         case SMPL_FMT_DOUBLE: // skip
+        default:
             return 1;
     }
     if (smpl_fmt != SMPL_FMT_DOUBLE) {
-        TRACE_ERR(nWritten != samples_channel, "Error writing data: %s", filename)
+        TRACE_ERR(nWritten != (int)samples_channel, "Error writing data: %s", filename)
     }
     WW_close(ww);
 
@@ -295,8 +563,10 @@ static int test_writeBuf(const char *filename_ref, SmplFmt smpl_fmt, unsigned ch
         case SMPL_FMT_DOUBLE:
             nRead = WR_readDouble(wr, (double *)data, samples_channel);
             break;
+        default:
+            break;
     }
-    TRACE_ERR(nRead != samples_channel, "Error reading data: %s", filename)
+    TRACE_ERR(nRead != (int)samples_channel, "Error reading data: %s", filename)
 
     TRACE_ERR(0 != memcmp(data_ref, data, samples_channel * wr->channels * (wr->bits_per_sample >> 3)),
               "Different written/read data")
@@ -318,13 +588,26 @@ int main()
     for (unsigned i = 0; i < COUNT_OF(files); i++) {
         TRACE_ERR(0 != test_readSmpl(files[i].name), "Test failed")
     }
+    for (int avx2 = 0; avx2 <= 1; avx2++) {
+        pcm_kernels_avx2(avx2);
+        TRACE_ERR(0 != test_decoders(), "Test failed")
+        TRACE_ERR(0 != test_encoders(), "Test failed")
+    }
+    for (unsigned i = 0; i < COUNT_OF(files); i++) {
+        TRACE_ERR(0 != test_chunks(files[i].name, i == 0 ? 3 << 20 : 1000 + i), "Test failed")
+    }
+    for (unsigned i = 0; i < COUNT_OF(files); i++) {
+        TRACE_ERR(0 != test_copyRaw(files[i].name, 0, 0), "Test failed")
+        TRACE_ERR(0 != test_copyRaw(files[i].name, 7, 3), "Test failed")
+    }
 
     unsigned char *data = new (std::nothrow) unsigned char[(COUNT_OF(pcm_data) + 4) * sizeof(double)];
     for (unsigned j = 0; j < 5; j++) {
         SmplFmt smpl_fmt = (SmplFmt)j;
         for (unsigned i = 0; i < COUNT_OF(files); i++) {
             unsigned samples_channel;
-            TRACE_ERR(0 != test_readBuf(files[i].name, smpl_fmt, data, &samples_channel), "Test failed")
+            TRACE_ERR(0 != test_readBuf(files[i].name, smpl_fmt, 1, data, &samples_channel), "Test failed")
+            TRACE_ERR(0 != test_readBuf(files[i].name, smpl_fmt, 0, data, &samples_channel), "Test failed")
             if (smpl_fmt == SMPL_FMT_DOUBLE) {
                 continue;
             }
@@ -5,6 +5,7 @@
 
 #include "wavreader.h"
 #include "pcm_conv.h"
+#include "pcm_kernels.h"
 
 #include <assert.h>
 #include <stdint.h>
@@ -12,6 +13,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define WR_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define WAVE_FORMAT_EXTENSIBLE 0xFFFE
 
 typedef struct {
@@ -26,6 +35,12 @@ typedef struct {
     FILE* fp;
     unsigned char* buf; // internal buffer to perform data transformation into format requested
     unsigned bufSize;
+    void* map; // whole file, the stream is closed then
+    size_t mapSize;
+    const unsigned char* pcm; // read position in the mapping
+    WavChunk* chunks;
+    unsigned numChunks, maxChunks;
+    PcmDecodeFn decode[SMPL_FMT_NUM]; // NULL for pcmconv_*() per sample
 } WR;
 static int check_consistency()
 {
@@ -36,40 +51,80 @@ static int check_consistency()
            &wavReader->block_align == &wr->block_align && &wavReader->samples_per_channel == &wr->samples_per_channel;
 }
 
-#define TAG(a, b, c, d) (((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
-static uint32_t read_tag32(WR* wr)
+#define TAG(a, b, c, d) WR_TAG(a, b, c, d)
+static uint32_t get_tag32(const unsigned char* p)
 {
-    uint32_t tag = 0;
-    tag = (tag << 8) | fgetc(wr->fp);
-    tag = (tag << 8) | fgetc(wr->fp);
-    tag = (tag << 8) | fgetc(wr->fp);
-    tag = (tag << 8) | fgetc(wr->fp);
-    return tag;
+    return TAG((uint32_t)p[0], p[1], p[2], p[3]);
 }
-static uint32_t read_int32(WR* wr)
+static uint32_t get_int32(const unsigned char* p)
 {
-    uint32_t value = 0;
-    value |= fgetc(wr->fp) << 0;
-    value |= fgetc(wr->fp) << 8;
-    value |= fgetc(wr->fp) << 16;
-    value |= fgetc(wr->fp) << 24;
-    return value;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
 }
-static uint16_t read_int16(WR* wr)
+static uint16_t get_int16(const unsigned char* p)
 {
-    uint16_t value = 0;
-    value |= fgetc(wr->fp) << 0;
-    value |= fgetc(wr->fp) << 8;
-    return value;
+    return (uint16_t)(p[0] | (p[1] << 8));
 }
-static void skip(FILE* fp, unsigned n)
+
+static int add_chunk(WR* wr, uint32_t tag, long offset, uint32_t size)
 {
-    for (unsigned i = 0; i < n; i++) {
-        fgetc(fp);
+    if (wr->numChunks == wr->maxChunks) {
+        unsigned n = wr->maxChunks ? 2 * wr->maxChunks : 8;
+        WavChunk* chunks_new = (WavChunk*)realloc(wr->chunks, n * sizeof(*chunks_new));
+        if (!chunks_new) {
+            return 0;
+        }
+        wr->chunks = chunks_new;
+        wr->maxChunks = n;
     }
+    WavChunk* chunk = &wr->chunks[wr->numChunks++];
+    chunk->tag = tag;
+    chunk->size = size;
+    chunk->offset = offset;
+    return 1;
 }
 
-WavReader* WR_open(const char* filename)
+// Chunks after 'data' go to the directory only, the stream position is not kept
+static void scan_chunks(WR* wr, long pos, uint32_t len)
+{
+    unsigned char hdr[8];
+    while (len >= 8 && 0 == fseek(wr->fp, pos, SEEK_SET) && 1 == fread(hdr, sizeof(hdr), 1, wr->fp)) {
+        uint32_t chunk_len = get_int32(hdr + 4);
+        len -= 8;
+        if (chunk_len > len || !add_chunk(wr, get_tag32(hdr), pos + 8, chunk_len)) {
+            break;
+        }
+        len -= chunk_len;
+        pos += 8 + (long)chunk_len;
+    }
+}
+
+// Map the file with the data chunk at 'data_pos', keep reading from the stream on failure
+static void map_data(WR* wr, long data_pos)
+{
+#ifdef WR_MMAP
+    struct stat st;
+    if (data_pos < 0 || 0 != fstat(fileno(wr->fp), &st) ||
+        (uint64_t)st.st_size < (uint64_t)data_pos + wr->data_length || (uint64_t)st.st_size > (size_t)-1) {
+        return;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(wr->fp), 0);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    wr->map = map;
+    wr->mapSize = (size_t)st.st_size;
+    wr->pcm = (const unsigned char*)map + data_pos;
+    fclose(wr->fp);
+    wr->fp = NULL;
+#else
+    (void)wr;
+    (void)data_pos;
+#endif
+}
+
+// Headers are read in one go per chunk and payloads are skipped with a seek
+static WavReader* open_internal(const char* filename, int mapped)
 {
     if (!check_consistency()) {
         return NULL;
@@ -83,22 +138,29 @@ WavReader* WR_open(const char* filename)
         goto exit;
     }
 
-    uint32_t tag = read_tag32(wr);
-    uint32_t len = read_int32(wr);
-    if (tag != TAG('R', 'I', 'F', 'F') || len < 4) {
+    unsigned char hdr[40]; // the largest 'fmt ' parsed, WAVEFORMATEXTENSIBLE
+    if (1 != fread(hdr, 12, 1, wr->fp)) {
+        goto exit;
+    }
+    uint32_t len = get_int32(hdr + 4);
+    if (get_tag32(hdr) != TAG('R', 'I', 'F', 'F') || len < 4) {
         goto exit;
     }
-    tag = read_tag32(wr);
     len -= 4;
-    if (tag != TAG('W', 'A', 'V', 'E')) {
+    if (get_tag32(hdr + 8) != TAG('W', 'A', 'V', 'E')) {
         goto exit;
     }
 
+    long pos = 12;
     while (len >= 8) {
-        uint32_t chunk = read_tag32(wr);
-        uint32_t chunk_len = read_int32(wr);
+        if (0 != fseek(wr->fp, pos, SEEK_SET) || 1 != fread(hdr, 8, 1, wr->fp)) {
+            break;
+        }
+        uint32_t chunk = get_tag32(hdr);
+        uint32_t chunk_len = get_int32(hdr + 4);
         len -= 8;
-        if (chunk_len > len) {
+        pos += 8;
+        if (chunk_len > len || !add_chunk(wr, chunk, pos, chunk_len)) {
             break;
         }
         len -= chunk_len;
@@ -106,36 +168,32 @@ WavReader* WR_open(const char* filename)
             if (chunk_len < 16) { // Insufficient data for 'fmt '
                 break;
             }
-            wr->format = read_int16(wr);
-            wr->channels = read_int16(wr);
-            wr->sample_rate = read_int32(wr);
-            int byte_rate = read_int32(wr);
-            wr->block_align = read_int16(wr);
-            wr->bits_per_sample = read_int16(wr);
-            chunk_len -= 16;
+            size_t hdr_len = chunk_len < sizeof(hdr) ? chunk_len : sizeof(hdr);
+            if (1 != fread(hdr, hdr_len, 1, wr->fp)) {
+                break;
+            }
+            wr->format = get_int16(hdr + 0);
+            wr->channels = get_int16(hdr + 2);
+            wr->sample_rate = get_int32(hdr + 4);
+            wr->block_align = get_int16(hdr + 12);
+            wr->bits_per_sample = get_int16(hdr + 14);
             if (wr->block_align == 0 || wr->bits_per_sample == 0) {
                 break;
             }
             if (wr->format == WAVE_FORMAT_EXTENSIBLE) {
-                if (chunk_len < 12) { // Insufficient data for waveformatex
-                    return NULL;
+                if (chunk_len < 16 + 12) { // Insufficient data for waveformatex
+                    break;
                 }
-                skip(wr->fp, 8);
-                chunk_len -= 8;
-                wr->format = read_int32(wr);
-                chunk_len -= 4;
-            } else if (chunk_len == 4) {
-                int cbSize = read_int16(wr);
-                chunk_len -= 2;
+                wr->format = get_int32(hdr + 24); // SubFormat, after cbSize, wValidBitsPerSample, dwChannelMask
+            } else if (chunk_len == 16 + 4) {
+                int cbSize = get_int16(hdr + 16);
                 if (cbSize == 2) {
-                    unsigned audition = read_int16(wr);
-                    chunk_len -= 2;
+                    unsigned audition = get_int16(hdr + 18);
                     if (audition == 1) {
                         wr->format = WAVE_FORMAT_FLOAT_AUDITION;
                     }
                 }
             }
-            skip(wr->fp, chunk_len);
 
             if (wr->bits_per_sample == 24 && wr->block_align == 4 * wr->channels) {
                 wr->format = WAVE_FORMAT_FLOAT_AUDITION;
@@ -145,79 +203,180 @@ WavReader* WR_open(const char* filename)
                 break;
             }
         } else if (chunk == TAG('d', 'a', 't', 'a')) {
+            if (wr->block_align == 0) { // no 'fmt ' yet
+                break;
+            }
             if (chunk_len) {
                 wr->data_length = chunk_len;
+                scan_chunks(wr, pos + (long)chunk_len, len);
             } else {
-                long pos = ftell(wr->fp);
                 if (0 != fseek(wr->fp, 0, SEEK_END)) {
                     break;
                 }
                 wr->data_length = ftell(wr->fp) - pos;
-                if (0 != fseek(wr->fp, pos, SEEK_SET)) {
-                    break;
-                }
+            }
+            if (0 != fseek(wr->fp, pos, SEEK_SET)) {
+                break;
             }
             wr->samples_per_channel = wr->data_length / wr->block_align;
             wr->data_length = wr->samples_per_channel * wr->block_align;
+            for (int i = 0; i < SMPL_FMT_NUM; i++) {
+                wr->decode[i] = pcm_decoder(wr->format, wr->bits_per_sample, wr->block_align / wr->channels,
+                                            (SmplFmt)i);
+            }
+            if (mapped) {
+                map_data(wr, pos);
+            }
             return (WavReader*)wr;
-        } else {
-            skip(wr->fp, chunk_len);
         }
+        pos += (long)chunk_len;
     }
 
 exit:
     if (wr->fp) {
         fclose(wr->fp);
     }
+    free(wr->chunks);
     free(wr);
     return NULL;
 }
 
+WavReader* WR_open(const char* filename)
+{
+    return open_internal(filename, 0);
+}
+
+WavReader* WR_openMapped(const char* filename)
+{
+    return open_internal(filename, 1);
+}
+
 void WR_close(WavReader* wavReader)
 {
     WR* wr = (WR*)wavReader;
-    fclose(wr->fp);
+    if (wr->fp) {
+        fclose(wr->fp);
+    }
+#ifdef WR_MMAP
+    if (wr->map) {
+        munmap(wr->map, wr->mapSize);
+    }
+#endif
     if (wr->buf) {
         free(wr->buf);
     }
+    free(wr->chunks);
     free(wr);
 }
 
+const WavChunk* WR_chunks(WavReader* wavReader, unsigned* count)
+{
+    WR* wr = (WR*)wavReader;
+    *count = wr->numChunks;
+    return wr->chunks;
+}
+
+const WavChunk* WR_findChunk(WavReader* wavReader, uint32_t tag)
+{
+    WR* wr = (WR*)wavReader;
+    for (unsigned i = 0; i < wr->numChunks; i++) {
+        if (wr->chunks[i].tag == tag) {
+            return &wr->chunks[i];
+        }
+    }
+    return NULL;
+}
+
+const uint8_t* WR_data(WavReader* wavReader, unsigned* spc)
+{
+    WR* wr = (WR*)wavReader;
+    *spc = wr->pcm ? wr->data_length / wr->block_align : 0;
+    return wr->pcm;
+}
+
+void WR_willneed(WavReader* wavReader, unsigned spc)
+{
+    WR* wr = (WR*)wavReader;
+    if (spc > wr->data_length / wr->block_align) {
+        spc = wr->data_length / wr->block_align;
+    }
+    size_t len = (size_t)spc * wr->block_align;
+    if (len == 0) {
+        return;
+    }
+#ifdef WR_MMAP
+    if (wr->pcm) {
+        uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t begin = (uintptr_t)wr->pcm & ~(page - 1);
+        madvise((void*)begin, (uintptr_t)wr->pcm + len - begin, MADV_WILLNEED);
+        return;
+    }
+#endif
+#ifdef POSIX_FADV_WILLNEED
+    long pos = ftell(wr->fp);
+    if (pos >= 0) {
+        posix_fadvise(fileno(wr->fp), pos, (off_t)len, POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+
 int WR_readRaw(WavReader* wavReader, uint8_t* data, unsigned spc)
 {
     WR* wr = (WR*)wavReader;
     if (spc > wr->data_length / wr->block_align) {
         spc = wr->data_length / wr->block_align;
     }
-    unsigned n = (unsigned)fread(data, wr->block_align, spc, wr->fp);
+    unsigned n;
+    if (wr->pcm) {
+        n = spc;
+        memcpy(data, wr->pcm, n * wr->block_align);
+        wr->pcm += n * wr->block_align;
+    } else {
+        n = (unsigned)fread(data, wr->block_align, spc, wr->fp);
+    }
     wr->data_length -= n * wr->block_align;
     return n;
 }
 
-typedef enum {
-    SMPL_FMT_16,
-    SMPL_FMT_32,
-    SMPL_FMT_24,
-    SMPL_FMT_FLOAT,
-    SMPL_FMT_DOUBLE,
-} SmplFmt;
-static int read_internal(WavReader* wavReader, void* _data, unsigned spc, SmplFmt smpl_fmt)
+// Next 'spc' raw samples per channel: in place for a mapped reader, through the internal buffer otherwise
+static const unsigned char* fetch(WR* wr, unsigned* spc)
 {
-    WR* wr = (WR*)wavReader;
-    if (wr->bufSize < spc * wr->block_align) {
-        unsigned n = spc * wr->block_align;
+    if (wr->pcm) {
+        if (*spc > wr->data_length / wr->block_align) {
+            *spc = wr->data_length / wr->block_align;
+        }
+        const unsigned char* pcm = wr->pcm;
+        wr->pcm += *spc * wr->block_align;
+        wr->data_length -= *spc * wr->block_align;
+        return pcm;
+    }
+    if (wr->bufSize < *spc * wr->block_align) {
+        unsigned n = *spc * wr->block_align;
         void* buf_new = realloc(wr->buf, n);
         if (!buf_new) {
-            return 0;
+            return NULL;
         }
         wr->buf = buf_new;
         wr->bufSize = n;
     }
-    spc = WR_readRaw(wavReader, wr->buf, spc);
+    *spc = WR_readRaw((WavReader*)wr, wr->buf, *spc);
+    return wr->buf;
+}
+
+static int read_internal(WavReader* wavReader, void* _data, unsigned spc, SmplFmt smpl_fmt)
+{
+    WR* wr = (WR*)wavReader;
+    const unsigned char* pcm = fetch(wr, &spc);
+    if (!pcm) {
+        return 0;
+    }
+    if (wr->decode[smpl_fmt]) {
+        wr->decode[smpl_fmt](pcm, _data, spc * wr->channels);
+        return spc;
+    }
     unsigned sample_block = wr->block_align / wr->channels;
 
     unsigned char* data = (unsigned char*)_data;
-    const unsigned char* pcm = wr->buf;
     int format = wr->format, bits_per_sample = wr->bits_per_sample, err_sticky = 0;
     for (unsigned i = 0; i < spc * wr->channels; i++) {
         if (smpl_fmt == SMPL_FMT_16 || smpl_fmt == SMPL_FMT_24 || smpl_fmt == SMPL_FMT_32) {
@@ -247,7 +406,7 @@ static int read_internal(WavReader* wavReader, void* _data, unsigned spc, SmplFm
         }
         pcm += sample_block;
     }
-    return err_sticky ? -1 : spc;
+    return err_sticky ? -1 : (int)spc;
 }
 
 int WR_readInt16(WavReader* wavReader, int16_t* data, unsigned spc)
@@ -26,6 +26,26 @@ typedef struct {
 WavReader* WR_open(const char* filename);
 void WR_close(WavReader*);
 
+#define WR_TAG(a, b, c, d) (((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+typedef struct {
+    uint32_t tag;    // WR_TAG('L', 'I', 'S', 'T') for "LIST"
+    uint32_t size;   // payload bytes
+    uint64_t offset; // payload position in the file
+} WavChunk;
+// Chunks of the file in order, 'fmt ' and 'data' included
+const WavChunk* WR_chunks(WavReader*, unsigned* count);
+const WavChunk* WR_findChunk(WavReader*, uint32_t tag); // the first one, NULL if none
+
+// Same as WR_open(), with the file mapped read-only: samples are decoded straight from the mapping
+// instead of going through a read buffer. Falls back to WR_open() behavior where mapping fails or is
+// not available.
+WavReader* WR_openMapped(const char* filename);
+// Raw data chunk at the read position and the number of samples per channel left in *spc,
+// NULL if the reader is not mapped
+const uint8_t* WR_data(WavReader*, unsigned* spc);
+// Hint that the next 'spc' samples per channel are about to be read
+void WR_willneed(WavReader*, unsigned spc);
+
 int WR_readInt16(WavReader*, int16_t* data, unsigned spc);
 int WR_readInt24p(WavReader*, uint8_t* data, unsigned spc);
 int WR_readInt32(WavReader*, int32_t* data, unsigned spc);
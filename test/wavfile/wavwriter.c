@@ -3,8 +3,13 @@
  * Licensed under the Apache License, Version 2.0
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // copy_file_range()
+#endif
+
 #include "wavwriter.h"
 #include "pcm_conv.h"
+#include "pcm_kernels.h"
 
 #include <assert.h>
 #include <stdint.h>
@@ -12,6 +17,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __linux__
+#define WW_KERNEL_COPY
+#include <linux/fs.h> // FICLONERANGE
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 typedef struct {
     unsigned format;
     unsigned channels;
@@ -23,6 +37,7 @@ typedef struct {
     FILE* fp;
     unsigned char* buf; // internal buffer to perform data transformation from user to file format
     unsigned bufSize;
+    PcmEncodeFn encode[SMPL_FMT_NUM]; // NULL for pcmconv_*() per sample
 } WW;
 static int check_consistency()
 {
@@ -115,6 +130,9 @@ WavWriter* WW_open(const char* filename, unsigned format, unsigned channels, uin
     ww->sample_rate = sample_rate;
     ww->bits_per_sample = bits_per_sample;
     ww->block_align = ((bits_per_sample + 7) >> 3) * channels;
+    for (int i = 0; i < SMPL_FMT_NUM; i++) {
+        ww->encode[i] = pcm_encoder((SmplFmt)i, format, bits_per_sample);
+    }
 
     write_header(ww, ww->data_length);
     return (WavWriter*)ww;
@@ -142,29 +160,117 @@ int WW_writeRaw(WavWriter* wavWriter, const unsigned char* data, unsigned spc)
     return n;
 }
 
-typedef enum {
-    SMPL_FMT_16,
-    SMPL_FMT_24,
-    SMPL_FMT_32,
-    SMPL_FMT_FLOAT,
-    SMPL_FMT_DOUBLE,
-} SmplFmt;
-static int write_internal(WavWriter* wavWriter, const void* data, unsigned spc, int format, int bits_per_sample)
+// At least 'n' bytes of the internal buffer, the content is not kept
+static int reserve(WW* ww, unsigned n)
 {
-    WW* ww = (WW*)wavWriter;
-
-    unsigned n = spc * ww->block_align;
     if (ww->bufSize < n) {
-        if (ww->buf) {
-            free(ww->buf);
+        unsigned size = 2 * ww->bufSize > n ? 2 * ww->bufSize : n;
+        free(ww->buf);
+        ww->buf = malloc(size);
+        ww->bufSize = ww->buf ? size : 0;
+    }
+    return ww->buf != NULL;
+}
+
+#ifdef WW_KERNEL_COPY
+// In-kernel copy of 'len' bytes, returns the bytes copied
+static uint64_t copy_range(int fd_in, off_t off_in, int fd_out, off_t off_out, uint64_t len)
+{
+    uint64_t done = 0;
+    while (done < len) {
+        size_t chunk = len - done < (1u << 30) ? (size_t)(len - done) : (1u << 30);
+        ssize_t n = copy_file_range(fd_in, &off_in, fd_out, &off_out, chunk, 0);
+        if (n <= 0) { // not across filesystems before Linux 5.3, not at all before 4.5
+            if (lseek(fd_out, off_out, SEEK_SET) < 0 || (n = sendfile(fd_out, fd_in, &off_in, chunk)) <= 0) {
+                break;
+            }
+            off_out += n;
         }
-        ww->buf = malloc(n);
-        if (!ww->buf) {
-            return 0;
+        done += n;
+    }
+    return done;
+}
+
+// The whole blocks are cloned where the filesystem shares extents (btrfs, XFS), the rest is copied
+static uint64_t copy_kernel(int fd_in, uint64_t off_in, int fd_out, uint64_t off_out, uint64_t len)
+{
+    uint64_t done = 0;
+#ifdef FICLONERANGE
+    struct stat st;
+    const uint64_t block = 0 == fstat(fd_out, &st) && st.st_blksize > 0 ? (uint64_t)st.st_blksize : 4096;
+    if (off_in % block == off_out % block) {
+        const uint64_t head = (block - off_in % block) % block;
+        const uint64_t body = len > head ? (len - head) / block * block : 0;
+        if (body && head == copy_range(fd_in, (off_t)off_in, fd_out, (off_t)off_out, head)) {
+            struct file_clone_range range;
+            range.src_fd = fd_in;
+            range.src_offset = off_in + head;
+            range.src_length = body;
+            range.dest_offset = off_out + head;
+            done = head;
+            if (0 == ioctl(fd_out, FICLONERANGE, &range)) {
+                done += body;
+            }
         }
-        ww->bufSize = n;
     }
+#endif
+    return done + copy_range(fd_in, (off_t)(off_in + done), fd_out, (off_t)(off_out + done), len - done);
+}
+#endif
 
+int WW_copyRaw(WavWriter* wavWriter, const char* filename, uint64_t offset, unsigned spc)
+{
+    WW* ww = (WW*)wavWriter;
+    FILE* fp = fopen(filename, "rb");
+    long pos = ftell(ww->fp);
+    if (fp == NULL || pos < 0 || 0 != fflush(ww->fp)) {
+        if (fp) {
+            fclose(fp);
+        }
+        return -1;
+    }
+    const uint64_t len = (uint64_t)spc * ww->block_align;
+    uint64_t done = 0;
+#ifdef WW_KERNEL_COPY
+    done = copy_kernel(fileno(fp), offset, fileno(ww->fp), (uint64_t)pos, len);
+    if (0 != fseek(ww->fp, pos + (long)done, SEEK_SET)) { // the stream is behind the descriptor
+        done = 0;
+    }
+#endif
+    // the rest through the stdio buffers
+    if (done < len && reserve(ww, 1 << 20) && 0 == fseek(fp, (long)(offset + done), SEEK_SET)) {
+        while (done < len) {
+            size_t n = len - done < ww->bufSize ? (size_t)(len - done) : ww->bufSize;
+            n = fread(ww->buf, 1, n, fp);
+            if (n == 0 || n != fwrite(ww->buf, 1, n, ww->fp)) {
+                break;
+            }
+            done += n;
+        }
+    }
+    fclose(fp);
+    unsigned n = (unsigned)(done / ww->block_align);
+    ww->data_length += n * ww->block_align;
+    if (done != (uint64_t)n * ww->block_align) { // a partial sample is dropped
+        fseek(ww->fp, pos + (long)n * ww->block_align, SEEK_SET);
+    }
+    return n;
+}
+
+static int write_internal(WavWriter* wavWriter, const void* data, unsigned spc, SmplFmt smpl_fmt)
+{
+    WW* ww = (WW*)wavWriter;
+
+    if (!reserve(ww, spc * ww->block_align)) {
+        return 0;
+    }
+
+    if (ww->encode[smpl_fmt]) {
+        ww->encode[smpl_fmt]((const unsigned char*)data, ww->buf, spc * ww->channels);
+        return WW_writeRaw(wavWriter, ww->buf, spc);
+    }
+    const int format = smpl_fmt == SMPL_FMT_FLOAT ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+    const int bits_per_sample = smpl_fmt == SMPL_FMT_16 ? 16 : smpl_fmt == SMPL_FMT_24 ? 24 : 32;
     const unsigned char* pcm = (const unsigned char*)data;
     unsigned char* output = ww->buf;
     int err_sticky = 0;
@@ -198,17 +304,17 @@ static int write_internal(WavWriter* wavWriter, const void* data, unsigned spc,
 
 int WW_writeInt16(WavWriter* wavWriter, const int16_t* data, unsigned spc)
 {
-    return write_internal(wavWriter, data, spc, WAVE_FORMAT_PCM, 16);
+    return write_internal(wavWriter, data, spc, SMPL_FMT_16);
 }
 int WW_writeInt24(WavWriter* wavWriter, const uint8_t* data, unsigned spc)
 {
-    return write_internal(wavWriter, data, spc, WAVE_FORMAT_PCM, 24);
+    return write_internal(wavWriter, data, spc, SMPL_FMT_24);
 }
 int WW_writeInt32(WavWriter* wavWriter, const int32_t* data, unsigned spc)
 {
-    return write_internal(wavWriter, data, spc, WAVE_FORMAT_PCM, 32);
+    return write_internal(wavWriter, data, spc, SMPL_FMT_32);
 }
 int WW_writeFloat(WavWriter* wavWriter, const float* data, unsigned spc)
 {
-    return write_internal(wavWriter, data, spc, WAVE_FORMAT_IEEE_FLOAT, 32);
+    return write_internal(wavWriter, data, spc, SMPL_FMT_FLOAT);
 }
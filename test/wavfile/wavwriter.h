@@ -31,6 +31,9 @@ int WW_writeInt24(WavWriter*, const uint8_t* data, unsigned spc);
 int WW_writeInt32(WavWriter*, const int32_t* data, unsigned spc);
 int WW_writeFloat(WavWriter*, const float* data, unsigned spc);
 int WW_writeRaw(WavWriter*, const uint8_t* data, unsigned spc);
+// Appends 'spc' samples per channel of the file format from 'filename' at byte 'offset', a reflink clone
+// or an in-kernel copy where available. Returns the samples per channel copied, -1 on open error.
+int WW_copyRaw(WavWriter*, const char* filename, uint64_t offset, unsigned spc);
 
 #ifdef __cplusplus
 }